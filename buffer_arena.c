@@ -0,0 +1,187 @@
+#include "include/buffer_arena.h"
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <linux/dma-buf.h>
+#include <linux/dma-heap.h>
+
+
+#define HUGE_PAGE_SIZE (2 * 1024 * 1024)
+#define DMA_HEAP_PATH "/dev/dma_heap/system"
+
+
+/// @brief Rounds size up to a multiple of alignment, which must be a power of two.
+size_t _align_up(size_t size, size_t alignment)
+{
+    return (size + alignment - 1) & ~(alignment - 1);
+}
+
+/// @brief Resets an arena to hold nothing.
+void _arena_clear(Buffer_Arena *arena)
+{
+    memset(arena, 0, sizeof(Buffer_Arena));
+    for (int i = 0; i < ARENA_MAX_BLOCKS; i++)
+        arena->dmabuf_fds[i] = -1;
+}
+
+/// @brief Validates the requested amount of blocks & rounds the block size to whole pages.
+int _arena_layout(Buffer_Arena *arena, size_t block_size, unsigned int block_count)
+{
+    if (block_size == 0 || block_count == 0 || block_count > ARENA_MAX_BLOCKS)
+    {
+        printf("Invalid arena layout: %u blocks of %zu bytes!\n", block_count, block_size);
+        return -1;
+    }
+
+    // Page alignment is required for USERPTR buffers and keeps blocks from sharing cache lines.
+    arena->block_size = _align_up(block_size, (size_t)sysconf(_SC_PAGESIZE));
+    arena->block_count = block_count;
+    return 0;
+}
+
+
+int arena_init(Buffer_Arena *arena, size_t block_size, unsigned int block_count, bool hugepages)
+{
+    _arena_clear(arena);
+    if (_arena_layout(arena, block_size, block_count) == -1)
+        return -1;
+
+    size_t size = arena->block_size * block_count;
+    void *mem = MAP_FAILED;
+
+    if (hugepages)
+    {
+        // Explicit huge pages only exist if the system has reserved some.
+        arena->mapped_size = _align_up(size, HUGE_PAGE_SIZE);
+        mem = mmap(NULL, arena->mapped_size, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+        arena->hugepages = mem != MAP_FAILED;
+    }
+
+    if (mem == MAP_FAILED)
+    {
+        arena->mapped_size = hugepages ? _align_up(size, HUGE_PAGE_SIZE) : size;
+        mem = mmap(NULL, arena->mapped_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mem == MAP_FAILED)
+        {
+            printf("Failed to map a %zu byte arena!\n", arena->mapped_size);
+            _arena_clear(arena);
+            return -1;
+        }
+
+        // Fall back to transparent huge pages, which the kernel may or may not grant.
+        if (hugepages)
+            arena->hugepages = madvise(mem, arena->mapped_size, MADV_HUGEPAGE) == 0;
+    }
+
+    arena->mem = mem;
+    for (unsigned int i = 0; i < block_count; i++)
+        arena->blocks[i] = arena->mem + i * arena->block_size;
+
+    // Touch every page now, so the first frames are not slowed down by page faults.
+    memset(arena->mem, 0, size);
+    return 0;
+}
+
+int arena_init_dmabuf(Buffer_Arena *arena, size_t block_size, unsigned int block_count)
+{
+    _arena_clear(arena);
+    if (_arena_layout(arena, block_size, block_count) == -1)
+        return -1;
+
+    int heap = open(DMA_HEAP_PATH, O_RDONLY | O_CLOEXEC);
+    if (heap == -1)
+    {
+        printf("No DMA heap at %s.\n", DMA_HEAP_PATH);
+        return -1;
+    }
+
+    arena->dmabuf = true;
+    for (unsigned int i = 0; i < block_count; i++)
+    {
+        struct dma_heap_allocation_data allocation;
+        memset(&allocation, 0, sizeof(allocation));
+        allocation.len = arena->block_size;
+        allocation.fd_flags = O_RDWR | O_CLOEXEC;
+
+        if (ioctl(heap, DMA_HEAP_IOCTL_ALLOC, &allocation) < 0)
+        {
+            printf("DMA_HEAP_IOCTL_ALLOC failed at block %u!\n", i);
+            goto dmabuf_failed;
+        }
+        arena->dmabuf_fds[i] = (int)allocation.fd;
+
+        void *mem = mmap(NULL, arena->block_size, PROT_READ | PROT_WRITE, MAP_SHARED, arena->dmabuf_fds[i], 0);
+        if (mem == MAP_FAILED)
+        {
+            printf("mmap of DMA-BUF failed at block %u!\n", i);
+            goto dmabuf_failed;
+        }
+        arena->blocks[i] = mem;
+    }
+
+    close(heap);
+    return 0;
+
+dmabuf_failed:
+    close(heap);
+    arena_free(arena);
+    return -1;
+}
+
+bool arena_fits(const Buffer_Arena *arena, size_t block_size, unsigned int block_count)
+{
+    return arena->block_count >= block_count && arena->block_size >= block_size;
+}
+
+/// @brief Starts or ends a CPU read of a DMA-BUF block.
+int _arena_sync(Buffer_Arena *arena, unsigned int block, uint64_t flags)
+{
+    if (!arena->dmabuf || block >= arena->block_count)
+        return 0;
+
+    struct dma_buf_sync sync = { .flags = flags | DMA_BUF_SYNC_READ };
+    if (ioctl(arena->dmabuf_fds[block], DMA_BUF_IOCTL_SYNC, &sync) < 0)
+        return -1;
+
+    return 0;
+}
+
+int arena_begin_access(Buffer_Arena *arena, unsigned int block)
+{
+    return _arena_sync(arena, block, DMA_BUF_SYNC_START);
+}
+
+int arena_end_access(Buffer_Arena *arena, unsigned int block)
+{
+    return _arena_sync(arena, block, DMA_BUF_SYNC_END);
+}
+
+void arena_free(Buffer_Arena *arena)
+{
+    if (arena->dmabuf)
+    {
+        for (unsigned int i = 0; i < ARENA_MAX_BLOCKS; i++)
+        {
+            if (arena->blocks[i] != NULL)
+                munmap(arena->blocks[i], arena->block_size);
+            if (arena->dmabuf_fds[i] != -1)
+                close(arena->dmabuf_fds[i]);
+        }
+    }
+    else if (arena->mem != NULL)
+    {
+        if (munmap(arena->mem, arena->mapped_size) == -1)
+            printf("ERROR: munmap() for arena returned -1.\n");
+    }
+
+    _arena_clear(arena);
+}
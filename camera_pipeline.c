@@ -0,0 +1,951 @@
+#include "include/camera_pipeline.h"
+
+#include "include/img_data.h"
+#include "include/img_processing.h"
+#include "include/webcam_handler.h"
+#include "include/aabb.h"
+#include "include/synthetic_camera.h"
+#include "include/jpegutils.h"
+#include "include/worker_pool.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <math.h>
+#include <time.h>
+
+#include <omp.h>
+#include <pthread.h>
+
+
+#define DETECTION_CAPACITY 256
+#define BENCHMARK_WARMUP 0.5
+#define DECODE_CORPUS_FRAMES 64
+#define DECODE_SETUP_ROUNDS 1000
+
+
+typedef struct Camera_Pipeline
+{
+    pthread_t thread;
+    Webcam *cam;
+    int camera;
+    int camera_c;
+
+    const Img_Fmt *shared_fmt; // Settings shared by all cameras, changed by the main thread.
+    Img_Fmt *fmt; // Private copy of the settings, refreshed before every frame.
+    RGB *rgb;
+
+    atomic_uint frame_count;
+    atomic_bool running;
+    bool active;
+
+    Dot_Tracker tracker;
+    Detection_Error error; // Only measured for synthetic cameras.
+} Camera_Pipeline;
+
+static Camera_Pipeline pipelines[MAX_CAMERAS];
+
+// Held by the main thread while it changes the shared settings, and by pipelines while they copy them.
+static pthread_mutex_t settings_lock = PTHREAD_MUTEX_INITIALIZER;
+
+
+typedef struct Detection_Stream
+{
+    pthread_mutex_t lock;
+    Detection detections[DETECTION_CAPACITY];
+    unsigned int head, tail;
+    unsigned int dropped;
+} Detection_Stream;
+
+static Detection_Stream detection_stream = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+
+/// @brief Converts the region of interest of a frame to RGB.
+int _convert_frame(const Img_Fmt *fmt, const Frame *frame, RGB *rgb)
+{
+    switch (frame->format)
+    {
+    case PIX_YUYV:
+        return yuyv_to_rgb(frame->data, frame->size, frame->stride, frame->roi, frame->cropped, fmt, rgb);
+
+    case PIX_NV12:
+        return nv12_to_rgb(frame->data, frame->size, frame->stride, frame->roi, frame->cropped, fmt, rgb);
+
+    case PIX_MJPEG:
+    default:
+        return mjpeg_to_rgb(frame->data, frame->size, frame->roi, frame->cropped, fmt, rgb);
+    }
+}
+
+int process_image(const Img_Fmt *fmt, Webcam *cam, Frame *frame, RGB *rgb, bool draw, Dot_Tracker *tracker, Detection *detection)
+{
+    detection->pos = (Vec2){0, 0};
+    detection->confidence = -1.0f;
+    detection->direction = DIR_IDLE;
+
+    int result = get_frame(cam, frame);
+    if (result == -1)
+        return -1;
+
+    detection->sequence = frame->sequence;
+    detection->capture_time = frame->timestamp;
+
+    bool partial = frame->format == PIX_MJPEG && fmt->visualize != 1.0f;
+    // Coarse detection decodes only the parts of the frame it scans.
+    bool coarse = partial && fmt->coarse_scale > 0.0f;
+    // The YCbCr detector converts the frame itself, to HSV without going through RGB.
+    bool ycc = partial && !coarse && fmt->ycc_detector == 1.0f;
+    // Band streaming converts & scores the frame while decoding it, with or without the YCbCr table.
+    bool bands = partial && !coarse && fmt->band_stream == 1.0f;
+    // A dot found in the last frame is looked for around where it is predicted to be first.
+    bool track = partial && tracker != NULL && tracker->tracking && 
+        fmt->track_radius > 0.0f && tracker->frames_since_full < (unsigned int)fmt->track_refresh;
+
+    Vec2 dot_pos;
+    float confidence = 0.0f;
+    bool found = false;
+    AABB window;
+
+    if (track)
+    {
+        int radius = (int)fmt->track_radius;
+        Vec2 predicted = (Vec2){ tracker->pos.x + tracker->velocity.x, tracker->pos.y + tracker->velocity.y };
+        window = (AABB){
+            .w = MAX(0, predicted.x - radius),
+            .n = MAX(0, predicted.y - radius),
+            .e = MAX(0, predicted.x + radius + 1),
+            .s = MAX(0, predicted.y + radius + 1)
+        };
+
+        result = find_laser_dot_window(fmt, frame->data, frame->size, frame->roi, frame->cropped, window, rgb, &dot_pos, &confidence);
+        found = result == 0 && confidence > fmt->dot_threshold;
+        tracker->frames_since_full++;
+    }
+
+    // Decode the whole frame if there was no dot to follow, or it was lost.
+    if (!found)
+    {
+        if (!coarse && !ycc && !bands && _convert_frame(fmt, frame, rgb) == -1)
+            return -1;
+
+        // Only the region of interest is converted, blank out the rows above it before drawing over them.
+        if (draw)
+            memset(rgb, 0, frame->roi.n * fmt->width * sizeof(RGB));
+
+        if (fmt->visualize == 1.0f)
+        {
+            result = apply_img_effects(fmt, rgb, frame->roi);
+            if (result == -1)
+                return -1;
+
+            return 0;
+        }
+
+        if (coarse)
+            result = find_laser_dot_coarse(fmt, frame->data, frame->size, frame->roi, frame->cropped, draw, rgb, &dot_pos, &confidence);
+        else if (bands)
+            result = find_laser_dot_bands(fmt, frame->data, frame->size, frame->roi, frame->cropped, draw, rgb, &dot_pos, &confidence);
+        else if (ycc)
+            result = find_laser_dot_ycc(fmt, frame->data, frame->size, frame->roi, frame->cropped, draw, rgb, &dot_pos, &confidence);
+        else
+            result = find_laser_dot(fmt, rgb, frame->roi, &dot_pos, &confidence);
+
+        if (tracker != NULL)
+            tracker->frames_since_full = 0;
+    }
+
+    confidence -= fmt->dot_threshold;
+
+    if (tracker != NULL)
+    {
+        // The velocity is only known if the dot was found in the last frame as well.
+        tracker->velocity = (confidence > 0 && tracker->tracking) ?
+            (Vec2){ dot_pos.x - tracker->pos.x, dot_pos.y - tracker->pos.y } : (Vec2){0, 0};
+        tracker->tracking = confidence > 0;
+        if (tracker->tracking)
+            tracker->pos = dot_pos;
+    }
+
+    if (draw && found)
+        draw_box(fmt, rgb, window, 1, (RGB){255, 255, 0});
+    if (draw && confidence > 0)
+        draw_circle(fmt, rgb, dot_pos, 10, CLAMP((int)(log2f(confidence + 1.0f)) + confidence / 10.0f, 1, 50), (RGB){0,0,255});
+
+    AABB
+        left_select = (AABB){0, 0, fmt->width/5, fmt->height},
+        right_select = (AABB){fmt->width*4/5, 0, fmt->width, fmt->height},
+        fwd_select = (AABB){fmt->width/5, 0, fmt->width*4/5, fmt->height/3},
+        back_select = (AABB){fmt->width/5, fmt->height*2/3, fmt->width*4/5, fmt->height};
+
+    bool
+        go_left = point_intersect(dot_pos, left_select) && confidence > 0,
+        go_right = point_intersect(dot_pos, right_select) && confidence > 0,
+        go_fwd = point_intersect(dot_pos, fwd_select) && confidence > 0,
+        go_back = point_intersect(dot_pos, back_select) && confidence > 0;
+
+    if (draw)
+    {
+        draw_box(fmt, rgb, left_select, 1, go_left ? (RGB){0, 255, 0} : (RGB){255, 0, 0});
+        draw_box(fmt, rgb, right_select, 1, go_right ? (RGB){0, 255, 0} : (RGB){255, 0, 0});
+        draw_box(fmt, rgb, fwd_select, 1, go_fwd ? (RGB){0, 255, 0} : (RGB){255, 0, 0});
+        draw_box(fmt, rgb, back_select, 1, go_back ? (RGB){0, 255, 0} : (RGB){255, 0, 0});
+    }
+
+    detection->pos = dot_pos;
+    detection->confidence = confidence;
+
+    if (go_left)
+        detection->direction = DIR_LEFT;
+    else if (go_right)
+        detection->direction = DIR_RIGHT;
+    else if (go_fwd)
+        detection->direction = DIR_FORWARD;
+    else if (go_back)
+        detection->direction = DIR_BACK;
+
+    return 0;
+}
+
+const char *direction_name(Direction direction)
+{
+    switch (direction)
+    {
+    case DIR_LEFT:      return "Turning left...";
+    case DIR_RIGHT:     return "Turning right...";
+    case DIR_FORWARD:   return "Going forward...";
+    case DIR_BACK:      return "Going back...";
+    case DIR_IDLE:
+    default:            return "Idling...";
+    }
+}
+
+
+int publish_detection(const Detection *detection)
+{
+    pthread_mutex_lock(&detection_stream.lock);
+
+    // Drop the oldest detection rather than stall a camera if the stream is not being read.
+    if (detection_stream.head - detection_stream.tail >= DETECTION_CAPACITY)
+    {
+        detection_stream.tail++;
+        detection_stream.dropped++;
+    }
+
+    detection_stream.detections[detection_stream.head % DETECTION_CAPACITY] = *detection;
+    detection_stream.head++;
+
+    pthread_mutex_unlock(&detection_stream.lock);
+    return 0;
+}
+
+int poll_detection(Detection *detection)
+{
+    int result = 0;
+    pthread_mutex_lock(&detection_stream.lock);
+
+    if (detection_stream.tail != detection_stream.head)
+    {
+        *detection = detection_stream.detections[detection_stream.tail % DETECTION_CAPACITY];
+        detection_stream.tail++;
+        result = 1;
+    }
+
+    pthread_mutex_unlock(&detection_stream.lock);
+    return result;
+}
+
+
+/// @brief Compares a detection with the nearest dot drawn by a synthetic camera.
+void _measure_detection_error(Webcam *cam, const Detection *detection, Detection_Error *error)
+{
+    const Synthetic_Dot *dots;
+    int dot_c;
+    if (synthetic_truth(webcam_synthetic(cam), &dots, &dot_c) == -1)
+        return;
+
+    error->frame_count++;
+    bool detected = detection->confidence > 0.0f;
+
+    if (dot_c == 0)
+    {
+        if (detected)
+            error->false_count++;
+        return;
+    }
+
+    if (!detected)
+    {
+        error->miss_count++;
+        return;
+    }
+
+    // Detections are pixel positions, the dot centers are sub-pixel.
+    float distance = INFINITY;
+    for (int i = 0; i < dot_c; i++)
+    {
+        float dx = (detection->pos.x + 0.5f) - dots[i].x;
+        float dy = (detection->pos.y + 0.5f) - dots[i].y;
+        distance = MIN(distance, sqrtf(dx * dx + dy * dy));
+    }
+
+    error->detected_count++;
+    error->total += distance;
+    error->max = MAX(error->max, distance);
+}
+
+/// @brief Copies the shared settings into the pipeline's private settings.
+/// Background cameras never visualize or compare threading, and split thread_count evenly.
+void _refresh_pipeline_settings(Camera_Pipeline *pipeline)
+{
+    pthread_mutex_lock(&settings_lock);
+    memcpy(pipeline->fmt, pipeline->shared_fmt, sizeof(Img_Fmt));
+    pthread_mutex_unlock(&settings_lock);
+
+    pipeline->fmt->visualize = 0.0f;
+    pipeline->fmt->compare_threading = 0.0f;
+    pipeline->fmt->thread_count = MAX(1.0f, floorf(pipeline->fmt->thread_count / pipeline->camera_c));
+}
+
+void pipeline_lock_settings()
+{
+    pthread_mutex_lock(&settings_lock);
+}
+
+void pipeline_unlock_settings()
+{
+    pthread_mutex_unlock(&settings_lock);
+}
+
+void *_pipeline_thread(void *input)
+{
+    Camera_Pipeline *pipeline = (Camera_Pipeline*)input;
+
+    while (atomic_load(&pipeline->running))
+    {
+        int frame_result = next_frame(pipeline->cam);
+        if (frame_result == -1)
+            break;
+        if (frame_result == 1)
+            continue;
+
+        _refresh_pipeline_settings(pipeline);
+
+        Frame frame = { .slot = -1 };
+        Detection detection = {
+            .camera = pipeline->camera,
+            .frame_num = atomic_load(&pipeline->frame_count)
+        };
+
+        if (process_image(pipeline->fmt, pipeline->cam, &frame, pipeline->rgb, false, &pipeline->tracker, &detection) == 0)
+        {
+            publish_detection(&detection);
+
+            if (webcam_synthetic(pipeline->cam) != NULL)
+                _measure_detection_error(pipeline->cam, &detection, &pipeline->error);
+        }
+
+        if (close_frame(pipeline->cam, &frame) == -1)
+            break;
+
+        atomic_fetch_add(&pipeline->frame_count, 1);
+    }
+
+    return NULL;
+}
+
+int pipeline_start(Webcam *cam, int camera, int camera_c, const Img_Fmt *fmt)
+{
+    if (camera < 0 || camera >= MAX_CAMERAS || pipelines[camera].active)
+        return -1;
+
+    Camera_Pipeline *pipeline = &pipelines[camera];
+    pipeline->cam = cam;
+    pipeline->camera = camera;
+    pipeline->camera_c = MAX(1, camera_c);
+    pipeline->shared_fmt = fmt;
+    pipeline->fmt = malloc(sizeof(Img_Fmt));
+    pipeline->rgb = malloc(fmt->size * sizeof(RGB));
+    atomic_store(&pipeline->frame_count, 0);
+    memset(&pipeline->tracker, 0, sizeof(Dot_Tracker));
+    memset(&pipeline->error, 0, sizeof(Detection_Error));
+
+    if (pipeline->fmt == NULL || pipeline->rgb == NULL)
+    {
+        printf("Failed to allocate pipeline for camera %d!\n", camera);
+        goto start_failed;
+    }
+    _refresh_pipeline_settings(pipeline);
+
+    atomic_store(&pipeline->running, true);
+    int result = pthread_create(&pipeline->thread, NULL, _pipeline_thread, pipeline);
+
+    if (result != 0)
+    {
+        printf("Failed to create pipeline thread for camera %d!\n", camera);
+        goto start_failed;
+    }
+
+    pipeline->active = true;
+    return 0;
+
+start_failed:
+    free(pipeline->fmt);
+    free(pipeline->rgb);
+    pipeline->fmt = NULL;
+    pipeline->rgb = NULL;
+    return -1;
+}
+
+int pipeline_stop_all()
+{
+    for (int i = 0; i < MAX_CAMERAS; i++)
+    {
+        Camera_Pipeline *pipeline = &pipelines[i];
+        if (!pipeline->active)
+            continue;
+
+        // The thread notices within capture_timeout, as next_frame never blocks longer.
+        atomic_store(&pipeline->running, false);
+        pthread_join(pipeline->thread, NULL);
+
+        free(pipeline->fmt);
+        free(pipeline->rgb);
+        pipeline->fmt = NULL;
+        pipeline->rgb = NULL;
+        pipeline->active = false;
+    }
+
+    return 0;
+}
+
+
+/// @brief Sleeps for the given amount of seconds.
+void _pipeline_sleep(double seconds)
+{
+    struct timespec ts = {
+        .tv_sec = (time_t)seconds,
+        .tv_nsec = (long)((seconds - (double)(time_t)seconds) * 1e9)
+    };
+    nanosleep(&ts, NULL);
+}
+
+int pipeline_benchmark(const char *devices[], int device_c, const Img_Fmt *fmt, float seconds)
+{
+    device_c = MIN(device_c, MAX_CAMERAS);
+    printf("\nBenchmarking 1-%d camera(s), %.1f s each...\n", device_c, seconds);
+
+    for (int camera_c = 1; camera_c <= device_c; camera_c++)
+    {
+        Webcam *cams[MAX_CAMERAS] = { NULL };
+        unsigned int start_counts[MAX_CAMERAS], end_counts[MAX_CAMERAS];
+
+        for (int i = 0; i < camera_c; i++)
+        {
+            if (webcam_init(&cams[i], devices[i], fmt) == -1 ||
+                pipeline_start(cams[i], i, camera_c, fmt) == -1)
+            {
+                pipeline_stop_all();
+                for (int j = 0; j <= i; j++)
+                    webcam_close(cams[j]);
+                return -1;
+            }
+        }
+
+        // Let the pipelines reach a steady state before measuring.
+        _pipeline_sleep(BENCHMARK_WARMUP);
+
+        Detection_Error errors[MAX_CAMERAS];
+        double start_time = omp_get_wtime();
+        for (int i = 0; i < camera_c; i++)
+            start_counts[i] = atomic_load(&pipelines[i].frame_count);
+
+        _pipeline_sleep(seconds);
+
+        double elapsed = omp_get_wtime() - start_time;
+        for (int i = 0; i < camera_c; i++)
+            end_counts[i] = atomic_load(&pipelines[i].frame_count);
+
+        pipeline_stop_all();
+        for (int i = 0; i < camera_c; i++)
+        {
+            errors[i] = pipelines[i].error;
+            webcam_close(cams[i]);
+        }
+
+        // Detections are not needed for the benchmark.
+        Detection detection;
+        while (poll_detection(&detection) == 1)
+            continue;
+
+        unsigned int total = 0;
+        for (int i = 0; i < camera_c; i++)
+            total += end_counts[i] - start_counts[i];
+
+        printf("%d camera(s): %.1f fps total (", camera_c, (float)(total / elapsed));
+        for (int i = 0; i < camera_c; i++)
+            printf("%s%.1f", (i > 0) ? ", " : "", (float)((end_counts[i] - start_counts[i]) / elapsed));
+        printf(" per camera)\n");
+
+        for (int i = 0; i < camera_c; i++)
+        {
+            const Detection_Error *error = &errors[i];
+            if (error->frame_count == 0)
+                continue;
+
+            printf("  Camera %d detection: ", i);
+            if (error->detected_count > 0)
+                printf("mean error %.2f px, max %.2f px, ", error->total / error->detected_count, error->max);
+            printf("%u misses, %u false detections in %u frames\n",
+                error->miss_count, error->false_count, error->frame_count);
+        }
+    }
+
+    return 0;
+}
+
+
+/// @brief A set of MJPEG frames copied out of a device, decoded over & over by the decode benchmark.
+typedef struct Decode_Corpus
+{
+    unsigned char *frames[DECODE_CORPUS_FRAMES];
+    unsigned int sizes[DECODE_CORPUS_FRAMES];
+    int frame_c;
+    int width, height;
+} Decode_Corpus;
+
+typedef struct Decode_Worker
+{
+    pthread_t thread;
+    const Decode_Corpus *corpus;
+    int first_frame;
+    atomic_bool *running;
+    atomic_uint decoded_count;
+    unsigned int error_count;
+} Decode_Worker;
+
+void *_decode_thread(void *input)
+{
+    Decode_Worker *worker = (Decode_Worker*)input;
+    const Decode_Corpus *corpus = worker->corpus;
+
+    int plane_size = corpus->width * corpus->height;
+    jpeg_decoder *decoder = jpeg_decoder_create();
+    unsigned char *planes = malloc(plane_size * 2);
+    if (decoder == NULL || planes == NULL)
+    {
+        printf("Failed to allocate a decoder!\n");
+        free(planes);
+        jpeg_decoder_destroy(decoder);
+        return NULL;
+    }
+
+    // Workers start at different frames, so that they do not read the same data in lockstep.
+    int i = worker->first_frame;
+    while (atomic_load(worker->running))
+    {
+        if (decode_jpeg_raw(decoder, corpus->frames[i], corpus->sizes[i], 0, Y4M_CHROMA_422,
+            corpus->width, corpus->height, planes, planes + plane_size, planes + plane_size * 3 / 2) != 0)
+            worker->error_count++;
+
+        atomic_fetch_add(&worker->decoded_count, 1);
+        i = (i + 1) % corpus->frame_c;
+    }
+
+    free(planes);
+    jpeg_decoder_destroy(decoder);
+    return NULL;
+}
+
+/// @brief Decodes the corpus on thread_c threads for the given amount of seconds.
+/// @param fps Receives the frames decoded per second by all threads together.
+int _run_decode_workers(const Decode_Corpus *corpus, int thread_c, float seconds, double *fps, unsigned int *error_count)
+{
+    Decode_Worker *workers = calloc(thread_c, sizeof(Decode_Worker));
+    if (workers == NULL)
+        return -1;
+
+    int result = 0;
+    atomic_bool running = true;
+    int started_c = 0;
+    for (; started_c < thread_c; started_c++)
+    {
+        workers[started_c].corpus = corpus;
+        workers[started_c].first_frame = started_c * corpus->frame_c / thread_c;
+        workers[started_c].running = &running;
+        if (pthread_create(&workers[started_c].thread, NULL, _decode_thread, &workers[started_c]) != 0)
+        {
+            printf("Failed to start decode thread %d!\n", started_c);
+            result = -1;
+            break;
+        }
+    }
+
+    _pipeline_sleep(BENCHMARK_WARMUP);
+    unsigned int start_count = 0;
+    for (int i = 0; i < started_c; i++)
+        start_count += atomic_load(&workers[i].decoded_count);
+    double start_time = omp_get_wtime();
+
+    _pipeline_sleep(seconds);
+
+    // The counts are read while the workers run, so frames being decoded are not counted yet.
+    unsigned int end_count = 0;
+    for (int i = 0; i < started_c; i++)
+        end_count += atomic_load(&workers[i].decoded_count);
+    double elapsed = omp_get_wtime() - start_time;
+
+    atomic_store(&running, false);
+    *error_count = 0;
+    for (int i = 0; i < started_c; i++)
+    {
+        pthread_join(workers[i].thread, NULL);
+        *error_count += workers[i].error_count;
+    }
+    free(workers);
+
+    *fps = (end_count - start_count) / elapsed;
+    return result;
+}
+
+int _compare_times(const void *a, const void *b)
+{
+    double diff = *(const double*)a - *(const double*)b;
+    return (diff > 0.0) - (diff < 0.0);
+}
+
+/// @brief Measures what reusing a decoder saves over creating one for every frame, as decoding used to.
+/// The setup is a fixed cost per frame, so it matters most for small frames. Decodes with a reused & a new
+/// decoder alternate, so that both see the same system load, and the medians are compared.
+int _measure_decoder_setup(const Decode_Corpus *corpus)
+{
+    int plane_size = corpus->width * corpus->height;
+    jpeg_decoder *reused = jpeg_decoder_create();
+    unsigned char *planes = malloc(plane_size * 2);
+    double *times = malloc(DECODE_SETUP_ROUNDS * 2 * sizeof(double));
+    if (reused == NULL || planes == NULL || times == NULL)
+    {
+        printf("Failed to allocate decode buffers!\n");
+        jpeg_decoder_destroy(reused);
+        free(planes);
+        free(times);
+        return -1;
+    }
+    double *reused_times = times, *new_times = times + DECODE_SETUP_ROUNDS;
+
+    for (int i = 0; i < DECODE_SETUP_ROUNDS; i++)
+    {
+        int f = i % corpus->frame_c;
+        unsigned char *u = planes + plane_size, *v = planes + plane_size * 3 / 2;
+
+        // Whichever goes second finds the frame in the cache, so they take turns going first.
+        for (int turn = 0; turn < 2; turn++)
+        {
+            double start = omp_get_wtime();
+            if ((turn + i) % 2 == 0)
+            {
+                decode_jpeg_raw(reused, corpus->frames[f], corpus->sizes[f], 0, Y4M_CHROMA_422, corpus->width, corpus->height, planes, u, v);
+                reused_times[i] = omp_get_wtime() - start;
+            }
+            else
+            {
+                jpeg_decoder *decoder = jpeg_decoder_create();
+                if (decoder != NULL)
+                    decode_jpeg_raw(decoder, corpus->frames[f], corpus->sizes[f], 0, Y4M_CHROMA_422, corpus->width, corpus->height, planes, u, v);
+                jpeg_decoder_destroy(decoder);
+                new_times[i] = omp_get_wtime() - start;
+            }
+        }
+    }
+
+    qsort(reused_times, DECODE_SETUP_ROUNDS, sizeof(double), _compare_times);
+    qsort(new_times, DECODE_SETUP_ROUNDS, sizeof(double), _compare_times);
+    double reused_median = reused_times[DECODE_SETUP_ROUNDS / 2], new_median = new_times[DECODE_SETUP_ROUNDS / 2];
+
+    printf("Median decode: %.1f us with a reused decoder, %.1f us with a new one, %.1f us (%.1f%%) of setup saved per frame\n",
+        reused_median * 1e6, new_median * 1e6, (new_median - reused_median) * 1e6, 100.0 * (new_median - reused_median) / new_median);
+
+    jpeg_decoder_destroy(reused);
+    free(planes);
+    free(times);
+    return 0;
+}
+
+/// @brief The parts of a corpus frame, decoded one per slot with a decoder each.
+typedef struct Split_Decode_Task
+{
+    jpeg_decoder **decoders;
+    const jpeg_part *parts;
+    int ctype, chroma_shift, width;
+    unsigned char *y, *u, *v;
+} Split_Decode_Task;
+
+void _split_decode_task(void *arg, int t_id, int t_count)
+{
+    Split_Decode_Task *task = (Split_Decode_Task*)arg;
+    int row = task->parts[t_id].first_row, chroma_row = row >> task->chroma_shift;
+    decode_jpeg_part(task->decoders[t_id], &task->parts[t_id], task->ctype, task->width,
+        task->y + row * task->width, task->u + chroma_row * task->width / 2, task->v + chroma_row * task->width / 2);
+}
+
+/// @brief Compares decoding frames whole on one thread to splitting them at their restart markers
+/// & decoding the parts on thread_c threads, as mjpeg_to_rgb does.
+int _measure_split_decode(Decode_Corpus *corpus, int thread_c, float seconds)
+{
+    int plane_size = corpus->width * corpus->height;
+    jpeg_decoder *decoders[JPEG_MAX_PARTS] = { NULL };
+    jpeg_part *parts = malloc(JPEG_MAX_PARTS * sizeof(jpeg_part));
+    unsigned char *planes = malloc(plane_size * 2);
+    int result = (parts == NULL || planes == NULL) ? -1 : 0;
+    for (int i = 0; i < JPEG_MAX_PARTS && result == 0; i++)
+        if ((decoders[i] = jpeg_decoder_create()) == NULL)
+            result = -1;
+
+    if (result == -1)
+    {
+        printf("Failed to allocate decode buffers!\n");
+        goto split_done;
+    }
+
+    thread_c = CLAMP(thread_c, 1, JPEG_MAX_PARTS);
+    int part_c = split_jpeg_restarts(corpus->frames[0], corpus->sizes[0], thread_c, parts);
+    if (part_c < 2)
+    {
+        printf("The frames have no restart markers to split the decode at, or thread_count is 1.\n");
+        goto split_done;
+    }
+
+    // Frames that do not split are left out of the split rate, instead of being decoded whole.
+    double fps[2];
+    int min_part_c = part_c, max_part_c = part_c;
+    unsigned int unsplit_count = 0;
+    for (int split = 0; split < 2; split++)
+    {
+        unsigned int decoded_count = 0, frame_i = 0;
+        double start_time = omp_get_wtime(), elapsed;
+        while ((elapsed = omp_get_wtime() - start_time) < seconds)
+        {
+            int f = frame_i++ % corpus->frame_c;
+            unsigned char *u = planes + plane_size, *v = planes + plane_size * 3 / 2;
+
+            // Decoded in the chroma layout the frame was encoded in, as mjpeg_to_rgb does.
+            int ctype = jpeg_native_chroma(corpus->frames[f], corpus->sizes[f]);
+            if (!split)
+            {
+                decode_jpeg_raw(decoders[0], corpus->frames[f], corpus->sizes[f], 0, ctype,
+                    corpus->width, corpus->height, planes, u, v);
+                decoded_count++;
+                continue;
+            }
+
+            int frame_part_c = split_jpeg_restarts(corpus->frames[f], corpus->sizes[f], thread_c, parts);
+            if (frame_part_c < 2)
+            {
+                unsplit_count++;
+                continue;
+            }
+            min_part_c = MIN(min_part_c, frame_part_c);
+            max_part_c = MAX(max_part_c, frame_part_c);
+
+            Split_Decode_Task task = {
+                .decoders = decoders,
+                .parts = parts,
+                .ctype = ctype,
+                .chroma_shift = (ctype == Y4M_CHROMA_422) ? 0 : 1,
+                .width = corpus->width,
+                .y = planes, .u = u, .v = v
+            };
+            pool_run(STAGE_DECODE, frame_part_c, _split_decode_task, &task);
+            decoded_count++;
+        }
+        fps[split] = decoded_count / elapsed;
+    }
+
+    if (min_part_c == max_part_c)
+        printf("Split at restart markers into %d parts: ", max_part_c);
+    else
+        printf("Split at restart markers into %d-%d parts: ", min_part_c, max_part_c);
+    printf("%.1f frames/s, whole on one thread: %.1f frames/s, %.2fx\n", fps[1], fps[0], fps[1] / fps[0]);
+    if (unsplit_count > 0)
+        printf("%u decodes of frames without restart markers were left out of the split rate.\n", unsplit_count);
+
+split_done:
+    for (int i = 0; i < JPEG_MAX_PARTS; i++)
+        jpeg_decoder_destroy(decoders[i]);
+    free(parts);
+    free(planes);
+    return result;
+}
+
+/// @brief Decodes frame f of the corpus into planes, with TurboJPEG if turbo is set & libjpeg otherwise.
+int _decode_with_backend(jpeg_decoder *decoder, bool turbo, const Decode_Corpus *corpus, int f, unsigned char *planes)
+{
+    int plane_size = corpus->width * corpus->height;
+    unsigned char *u = planes + plane_size, *v = u + plane_size / 2;
+    if (turbo)
+        return decode_jpeg_turbo(decoder, corpus->frames[f], corpus->sizes[f], Y4M_CHROMA_422, corpus->width, corpus->height, planes, u, v);
+    return decode_jpeg_raw(decoder, corpus->frames[f], corpus->sizes[f], 0, Y4M_CHROMA_422, corpus->width, corpus->height, planes, u, v);
+}
+
+/// @brief Compares the decode rate of the libjpeg & TurboJPEG backends on one thread,
+/// and whether they decode the first frame to the same planes.
+int _measure_decode_backends(const Decode_Corpus *corpus, float seconds)
+{
+    if (!jpeg_turbo_available())
+    {
+        printf("Built without USE_TURBOJPEG, the TurboJPEG backend was not measured.\n");
+        return 0;
+    }
+
+    int plane_size = corpus->width * corpus->height;
+    jpeg_decoder *decoder = jpeg_decoder_create();
+    unsigned char *planes = malloc(plane_size * 4);
+    if (decoder == NULL || planes == NULL)
+    {
+        printf("Failed to allocate decode buffers!\n");
+        jpeg_decoder_destroy(decoder);
+        free(planes);
+        return -1;
+    }
+
+    double fps[2];
+    for (int turbo = 0; turbo < 2; turbo++)
+    {
+        unsigned int decoded_count = 0;
+        double start_time = omp_get_wtime(), elapsed;
+        while ((elapsed = omp_get_wtime() - start_time) < seconds)
+        {
+            int f = decoded_count++ % corpus->frame_c;
+            _decode_with_backend(decoder, turbo, corpus, f, planes);
+        }
+        fps[turbo] = decoded_count / elapsed;
+    }
+
+    // Both backends decode the first frame into their own planes, so they can be compared.
+    _decode_with_backend(decoder, false, corpus, 0, planes);
+    _decode_with_backend(decoder, true, corpus, 0, planes + plane_size * 2);
+    bool same = memcmp(planes, planes + plane_size * 2, plane_size * 2) == 0;
+    printf("libjpeg: %.1f frames/s, TurboJPEG: %.1f frames/s, %.2fx, %s planes\n",
+        fps[0], fps[1], fps[1] / fps[0], same ? "same" : "different");
+
+    jpeg_decoder_destroy(decoder);
+    free(planes);
+    return 0;
+}
+
+/// @brief Copies MJPEG frames out of a device, until the corpus is full or the frames repeat.
+int _record_decode_corpus(const char *device, const Img_Fmt *fmt, Decode_Corpus *corpus)
+{
+    // Cleared first, the caller frees whatever frames it holds even if the device fails to open.
+    memset(corpus, 0, sizeof(Decode_Corpus));
+
+    Webcam *cam;
+    if (webcam_init(&cam, device, fmt) == -1)
+        return -1;
+
+    corpus->width = (int)fmt->width;
+    corpus->height = (int)fmt->height;
+
+    int result = 0;
+    while (corpus->frame_c < DECODE_CORPUS_FRAMES)
+    {
+        int frame_result = next_frame(cam);
+        if (frame_result == -1)
+        {
+            result = -1;
+            break;
+        }
+        if (frame_result == 1)
+            continue;
+
+        Frame frame = { .slot = -1 };
+        if (get_frame(cam, &frame) == -1)
+        {
+            result = -1;
+            break;
+        }
+
+        if (frame.format != PIX_MJPEG || frame.cropped)
+        {
+            printf("The decode benchmark needs uncropped MJPEG frames, set pixel_format=1 & roi_top=0.\n");
+            close_frame(cam, &frame);
+            result = -1;
+            break;
+        }
+
+        // Recordings & synthetic cameras loop, stop once the first frame comes around again.
+        if (corpus->frame_c > 0 && frame.size == corpus->sizes[0] && memcmp(frame.data, corpus->frames[0], frame.size) == 0)
+        {
+            close_frame(cam, &frame);
+            break;
+        }
+
+        unsigned char *copy = malloc(frame.size);
+        if (copy == NULL)
+        {
+            close_frame(cam, &frame);
+            result = -1;
+            break;
+        }
+        memcpy(copy, frame.data, frame.size);
+        corpus->frames[corpus->frame_c] = copy;
+        corpus->sizes[corpus->frame_c] = frame.size;
+        corpus->frame_c++;
+
+        if (close_frame(cam, &frame) == -1)
+        {
+            result = -1;
+            break;
+        }
+    }
+
+    webcam_close(cam);
+    return (corpus->frame_c > 0) ? result : -1;
+}
+
+int decode_benchmark(const char *device, const Img_Fmt *fmt, float seconds)
+{
+    Decode_Corpus corpus = {0};
+    if (_record_decode_corpus(device, fmt, &corpus) == -1)
+    {
+        for (int i = 0; i < corpus.frame_c; i++)
+            free(corpus.frames[i]);
+        printf("Failed to record frames to decode!\n");
+        return -1;
+    }
+
+    int max_threads = omp_get_num_procs();
+    printf("\nBenchmarking the decoding of %d %dx%d frame(s) on 1-%d thread(s), %.1f s each...\n",
+        corpus.frame_c, corpus.width, corpus.height, max_threads, seconds);
+
+    double single_fps = 0.0;
+    unsigned int error_count;
+    int result = 0;
+    for (int thread_c = 1; thread_c <= max_threads && result == 0; thread_c++)
+    {
+        double fps;
+        result = _run_decode_workers(&corpus, thread_c, seconds, &fps, &error_count);
+        if (result == -1)
+            break;
+
+        if (thread_c == 1)
+            single_fps = fps;
+
+        printf("%d thread(s): %.1f frames/s, %.2fx of one thread", thread_c, fps, (single_fps > 0.0) ? fps / single_fps : 0.0);
+        if (error_count > 0)
+            printf(", %u decode errors", error_count);
+        printf("\n");
+    }
+
+    if (result == 0)
+        result = _measure_decoder_setup(&corpus);
+    if (result == 0)
+        result = _measure_decode_backends(&corpus, seconds);
+    if (result == 0)
+        result = _measure_split_decode(&corpus, (int)fmt->thread_count, seconds);
+
+    for (int i = 0; i < corpus.frame_c; i++)
+        free(corpus.frames[i]);
+    return result;
+}
@@ -0,0 +1,497 @@
+#include "include/hsv_convert.h"
+
+#include "include/img_data.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <math.h>
+#include <time.h>
+
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HSV_X86
+#endif
+
+
+#define HSV_BLOCK 64 // Pixels converted at a time, split into channels of floats that stay in the L1 cache.
+#define HSV_BENCHMARK_PIXELS (1280 * 720)
+
+
+/// @brief Converts HSV_BLOCK pixels with channels of 0-255 the same way as rgb_to_hsv.
+typedef void (*Hsv_Kernel)(const float *r, const float *g, const float *b, float *h, float *s, float *v);
+
+typedef struct Hsv_Kernel_Info
+{
+    const char *name;
+    Hsv_Kernel kernel; // NULL converts with rgb_to_hsv.
+    bool supported;
+} Hsv_Kernel_Info;
+
+static Hsv_Kernel kernel;
+static const char *kernel_name = "scalar";
+static pthread_once_t kernel_once = PTHREAD_ONCE_INIT;
+static bool quantize_sse2;
+
+// Tables of hsv_lut, 768 KB. Within the sector of its largest channel, the hue only depends on
+// max - min & the difference of the other two channels, the saturation on max & max - min.
+static float hue_lut[256][512]; // [max - min][255 + difference of the other two]: 60 * difference / (max - min).
+static float sat_lut[256][256]; // [max][max - min]
+static float val_lut[256];
+static pthread_once_t lut_once = PTHREAD_ONCE_INIT;
+
+
+// The kernels follow rgb_to_hsv step by step, without its branches & fmodf:
+// the hue before wrapping is between 60 & 420 degrees, so wrapping it only ever subtracts 360 once.
+
+#ifdef HSV_X86
+__attribute__((target("sse2")))
+static inline __m128 _select_sse2(__m128 mask, __m128 a, __m128 b)
+{
+    return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+}
+
+__attribute__((target("sse2")))
+void _hsv_kernel_sse2(const float *r, const float *g, const float *b, float *h, float *s, float *v)
+{
+    const __m128
+        scale = _mm_set1_ps(255.0f), zero = _mm_setzero_ps(),
+        sixty = _mm_set1_ps(60.0f), full = _mm_set1_ps(360.0f),
+        r_offset = _mm_set1_ps(360.0f), g_offset = _mm_set1_ps(120.0f), b_offset = _mm_set1_ps(240.0f);
+
+    for (int i = 0; i < HSV_BLOCK; i += 4)
+    {
+        __m128
+            vr = _mm_div_ps(_mm_load_ps(r + i), scale),
+            vg = _mm_div_ps(_mm_load_ps(g + i), scale),
+            vb = _mm_div_ps(_mm_load_ps(b + i), scale);
+
+        __m128 max = _mm_max_ps(vr, _mm_max_ps(vg, vb));
+        __m128 min = _mm_min_ps(vr, _mm_min_ps(vg, vb));
+        __m128 diff = _mm_sub_ps(max, min);
+
+        __m128 is_r = _mm_cmpeq_ps(max, vr);
+        __m128 is_g = _mm_cmpeq_ps(max, vg);
+        __m128 num = _select_sse2(is_r, _mm_sub_ps(vg, vb), _select_sse2(is_g, _mm_sub_ps(vb, vr), _mm_sub_ps(vr, vg)));
+        __m128 offset = _select_sse2(is_r, r_offset, _select_sse2(is_g, g_offset, b_offset));
+
+        __m128 hue = _mm_add_ps(_mm_mul_ps(sixty, _mm_div_ps(num, diff)), offset);
+        hue = _mm_sub_ps(hue, _mm_and_ps(_mm_cmpge_ps(hue, full), full));
+        hue = _mm_andnot_ps(_mm_cmpeq_ps(max, min), hue);
+
+        _mm_store_ps(h + i, hue);
+        _mm_store_ps(s + i, _mm_andnot_ps(_mm_cmpeq_ps(max, zero), _mm_div_ps(diff, max)));
+        _mm_store_ps(v + i, max);
+    }
+}
+
+__attribute__((target("avx2")))
+void _hsv_kernel_avx2(const float *r, const float *g, const float *b, float *h, float *s, float *v)
+{
+    const __m256
+        scale = _mm256_set1_ps(255.0f), zero = _mm256_setzero_ps(),
+        sixty = _mm256_set1_ps(60.0f), full = _mm256_set1_ps(360.0f),
+        r_offset = _mm256_set1_ps(360.0f), g_offset = _mm256_set1_ps(120.0f), b_offset = _mm256_set1_ps(240.0f);
+
+    for (int i = 0; i < HSV_BLOCK; i += 8)
+    {
+        __m256
+            vr = _mm256_div_ps(_mm256_load_ps(r + i), scale),
+            vg = _mm256_div_ps(_mm256_load_ps(g + i), scale),
+            vb = _mm256_div_ps(_mm256_load_ps(b + i), scale);
+
+        __m256 max = _mm256_max_ps(vr, _mm256_max_ps(vg, vb));
+        __m256 min = _mm256_min_ps(vr, _mm256_min_ps(vg, vb));
+        __m256 diff = _mm256_sub_ps(max, min);
+
+        __m256 is_r = _mm256_cmp_ps(max, vr, _CMP_EQ_OQ);
+        __m256 is_g = _mm256_cmp_ps(max, vg, _CMP_EQ_OQ);
+        __m256 num = _mm256_blendv_ps(_mm256_blendv_ps(_mm256_sub_ps(vr, vg), _mm256_sub_ps(vb, vr), is_g), _mm256_sub_ps(vg, vb), is_r);
+        __m256 offset = _mm256_blendv_ps(_mm256_blendv_ps(b_offset, g_offset, is_g), r_offset, is_r);
+
+        __m256 hue = _mm256_add_ps(_mm256_mul_ps(sixty, _mm256_div_ps(num, diff)), offset);
+        hue = _mm256_sub_ps(hue, _mm256_and_ps(_mm256_cmp_ps(hue, full, _CMP_GE_OQ), full));
+        hue = _mm256_andnot_ps(_mm256_cmp_ps(max, min, _CMP_EQ_OQ), hue);
+
+        _mm256_store_ps(h + i, hue);
+        _mm256_store_ps(s + i, _mm256_andnot_ps(_mm256_cmp_ps(max, zero, _CMP_EQ_OQ), _mm256_div_ps(diff, max)));
+        _mm256_store_ps(v + i, max);
+    }
+}
+
+__attribute__((target("avx512f")))
+void _hsv_kernel_avx512(const float *r, const float *g, const float *b, float *h, float *s, float *v)
+{
+    const __m512
+        scale = _mm512_set1_ps(255.0f), zero = _mm512_setzero_ps(),
+        sixty = _mm512_set1_ps(60.0f), full = _mm512_set1_ps(360.0f),
+        r_offset = _mm512_set1_ps(360.0f), g_offset = _mm512_set1_ps(120.0f), b_offset = _mm512_set1_ps(240.0f);
+
+    for (int i = 0; i < HSV_BLOCK; i += 16)
+    {
+        __m512
+            vr = _mm512_div_ps(_mm512_load_ps(r + i), scale),
+            vg = _mm512_div_ps(_mm512_load_ps(g + i), scale),
+            vb = _mm512_div_ps(_mm512_load_ps(b + i), scale);
+
+        __m512 max = _mm512_max_ps(vr, _mm512_max_ps(vg, vb));
+        __m512 min = _mm512_min_ps(vr, _mm512_min_ps(vg, vb));
+        __m512 diff = _mm512_sub_ps(max, min);
+
+        __mmask16 is_r = _mm512_cmp_ps_mask(max, vr, _CMP_EQ_OQ);
+        __mmask16 is_g = _mm512_cmp_ps_mask(max, vg, _CMP_EQ_OQ);
+        __m512 num = _mm512_mask_blend_ps(is_r, _mm512_mask_blend_ps(is_g, _mm512_sub_ps(vr, vg), _mm512_sub_ps(vb, vr)), _mm512_sub_ps(vg, vb));
+        __m512 offset = _mm512_mask_blend_ps(is_r, _mm512_mask_blend_ps(is_g, b_offset, g_offset), r_offset);
+
+        // With an explicit rounding, the multiplication is not fused with the addition, which rgb_to_hsv does not do either.
+        __m512 hue = _mm512_add_ps(_mm512_mul_round_ps(sixty, _mm512_div_ps(num, diff), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC), offset);
+        hue = _mm512_mask_sub_ps(hue, _mm512_cmp_ps_mask(hue, full, _CMP_GE_OQ), hue, full);
+        hue = _mm512_maskz_mov_ps(_mm512_cmp_ps_mask(max, min, _CMP_NEQ_UQ), hue);
+
+        _mm512_store_ps(h + i, hue);
+        _mm512_store_ps(s + i, _mm512_maskz_div_ps(_mm512_cmp_ps_mask(max, zero, _CMP_NEQ_UQ), diff, max));
+        _mm512_store_ps(v + i, max);
+    }
+}
+
+/// @brief Quantizes n floats the same way as HSV_QUANTIZE_H (if hue is set) or HSV_QUANTIZE_SV, 16 at a time.
+/// @return The amount quantized, the rest are left to the caller.
+__attribute__((target("sse2")))
+int _quantize_sse2(const float *x, unsigned char *q, int n, bool hue)
+{
+    const __m128 scale = _mm_set1_ps(hue ? 256.0f / 360.0f : 255.0f), half = _mm_set1_ps(0.5f);
+    // The hue wraps around, the others are 255 at most.
+    const __m128i wrap = _mm_set1_epi32(hue ? 255 : -1);
+
+    int i = 0;
+    for (; i + 16 <= n; i += 16)
+    {
+        __m128i q32[4];
+        for (int j = 0; j < 4; j++)
+            q32[j] = _mm_and_si128(_mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(_mm_load_ps(x + i + j * 4), scale), half)), wrap);
+
+        __m128i q16_lo = _mm_packs_epi32(q32[0], q32[1]), q16_hi = _mm_packs_epi32(q32[2], q32[3]);
+        _mm_storeu_si128((__m128i*)(q + i), _mm_packus_epi16(q16_lo, q16_hi));
+    }
+    return i;
+}
+#endif
+
+/// @brief The kernels, widest first.
+static Hsv_Kernel_Info kernels[] = {
+#ifdef HSV_X86
+    { "AVX-512", _hsv_kernel_avx512, false },
+    { "AVX2", _hsv_kernel_avx2, false },
+    { "SSE2", _hsv_kernel_sse2, false },
+#endif
+    { "scalar", NULL, true }
+};
+#define KERNEL_COUNT (int)(sizeof(kernels) / sizeof(kernels[0]))
+
+void _pick_kernel()
+{
+#ifdef HSV_X86
+    __builtin_cpu_init();
+    kernels[0].supported = __builtin_cpu_supports("avx512f");
+    kernels[1].supported = __builtin_cpu_supports("avx2");
+    kernels[2].supported = __builtin_cpu_supports("sse2");
+    quantize_sse2 = kernels[2].supported;
+#endif
+
+    for (int i = 0; i < KERNEL_COUNT; i++)
+    {
+        if (kernels[i].supported)
+        {
+            kernel = kernels[i].kernel;
+            kernel_name = kernels[i].name;
+            return;
+        }
+    }
+}
+
+int hsv_convert_init()
+{
+    pthread_once(&kernel_once, _pick_kernel);
+    return 0;
+}
+
+const char *hsv_kernel_name()
+{
+    hsv_convert_init();
+    return kernel_name;
+}
+
+void _build_hsv_lut()
+{
+    for (int diff = 1; diff < 256; diff++)
+        for (int d = -diff; d <= diff; d++)
+            hue_lut[diff][255 + d] = (float)(60.0 * d / diff);
+
+    // The same math as rgb_to_hsv, which only depends on max & min for these two.
+    for (int max = 0; max < 256; max++)
+    {
+        val_lut[max] = max / 255.0f;
+        for (int diff = 0; diff <= max; diff++)
+            sat_lut[max][diff] = rgb_to_hsv((RGB){ .R = max, .G = max - diff, .B = max - diff }).S;
+    }
+}
+
+/// @brief Converts n of up to HSV_BLOCK pixels into channels of floats, aligned for the kernels:
+/// with the tables of hsv_lut if lut is set, with the kernel if the block is whole, with rgb_to_hsv otherwise.
+void _convert_block(Hsv_Kernel with, bool lut, const RGB *rgb, int n, float *h, float *s, float *v)
+{
+    if (lut)
+    {
+        pthread_once(&lut_once, _build_hsv_lut);
+
+        // Integer max & min, then one load per channel. The sector is picked with selects rather than branches,
+        // which are unpredictable on noisy frames.
+        for (int j = 0; j < n; j++)
+        {
+            int r = rgb[j].R, g = rgb[j].G, b = rgb[j].B;
+            int max = MAX(r, MAX(g, b));
+            int diff = max - MIN(r, MIN(g, b));
+
+            // Same sector order as rgb_to_hsv when two channels are the largest. Grey lands on the zeros of row 0.
+            int d = (max == r) ? g - b : (max == g) ? b - r : r - g;
+            float offset = (max == r) ? ((d < 0) ? 360.0f : 0.0f) : (max == g) ? 120.0f : 240.0f;
+
+            h[j] = offset + hue_lut[diff][255 + d];
+            s[j] = sat_lut[max][diff];
+            v[j] = val_lut[max];
+        }
+        return;
+    }
+
+    if (with != NULL && n == HSV_BLOCK)
+    {
+        _Alignas(64) float r[HSV_BLOCK], g[HSV_BLOCK], b[HSV_BLOCK];
+        for (int j = 0; j < HSV_BLOCK; j++)
+        {
+            r[j] = rgb[j].R;
+            g[j] = rgb[j].G;
+            b[j] = rgb[j].B;
+        }
+
+        with(r, g, b, h, s, v);
+        return;
+    }
+
+    // The pixels after the last whole block.
+    for (int j = 0; j < n; j++)
+    {
+        HSV px = rgb_to_hsv(rgb[j]);
+        h[j] = px.H;
+        s[j] = px.S;
+        v[j] = px.V;
+    }
+}
+
+/// @brief Converts count pixels into HSV structs, to compare a conversion to rgb_to_hsv before quantizing.
+void _convert_with(Hsv_Kernel with, bool lut, const RGB *rgb, HSV *hsv, int count)
+{
+    _Alignas(64) float h[HSV_BLOCK], s[HSV_BLOCK], v[HSV_BLOCK];
+
+    for (int i = 0; i < count; i += HSV_BLOCK)
+    {
+        int n = MIN(HSV_BLOCK, count - i);
+        _convert_block(with, lut, rgb + i, n, h, s, v);
+
+        for (int j = 0; j < n; j++)
+            hsv[i + j] = (HSV){ h[j], s[j], v[j] };
+    }
+}
+
+/// @brief Converts count pixels into a row of Hsv_Planes.
+void _convert_planes(Hsv_Kernel with, bool lut, const RGB *rgb, unsigned char *h, unsigned char *s, unsigned char *v, int count)
+{
+    _Alignas(64) float block_h[HSV_BLOCK], block_s[HSV_BLOCK], block_v[HSV_BLOCK];
+
+    for (int i = 0; i < count; i += HSV_BLOCK)
+    {
+        int n = MIN(HSV_BLOCK, count - i);
+        _convert_block(with, lut, rgb + i, n, block_h, block_s, block_v);
+
+        int j = 0;
+#ifdef HSV_X86
+        if (quantize_sse2)
+        {
+            _quantize_sse2(block_h, h + i, n, true);
+            _quantize_sse2(block_s, s + i, n, false);
+            j = _quantize_sse2(block_v, v + i, n, false);
+        }
+#endif
+        for (; j < n; j++)
+        {
+            h[i + j] = HSV_QUANTIZE_H(block_h[j]);
+            s[i + j] = HSV_QUANTIZE_SV(block_s[j]);
+            v[i + j] = HSV_QUANTIZE_SV(block_v[j]);
+        }
+    }
+}
+
+void rgb_to_hsv_batch(const RGB *rgb, unsigned char *h, unsigned char *s, unsigned char *v, int count, bool lut)
+{
+    pthread_once(&kernel_once, _pick_kernel);
+    _convert_planes(kernel, lut, rgb, h, s, v, count);
+}
+
+
+double _hsv_time()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/// @brief Compares a conversion to rgb_to_hsv on all 2^24 colors & prints the largest difference of every channel.
+/// @param planes Compare the values read back from Hsv_Planes instead of the converted floats.
+/// @param rgb, expected, hsv Buffers of 256 * 256 pixels, planes of 256 * 256 bytes.
+/// @return The largest difference of every channel.
+HSV _check_colors(const char *name, Hsv_Kernel with, bool lut, bool planes, 
+    RGB *rgb, HSV *expected, HSV *hsv, unsigned char *plane_buffer)
+{
+    const int chunk = 256 * 256;
+    HSV max_error = { 0.0f, 0.0f, 0.0f };
+    unsigned int mismatch_c = 0;
+
+    // Every color of one red value at a time.
+    for (int r = 0; r < 256; r++)
+    {
+        for (int i = 0; i < chunk; i++)
+        {
+            rgb[i] = (RGB){ .R = r, .G = i >> 8, .B = i & 255 };
+            expected[i] = rgb_to_hsv(rgb[i]);
+        }
+
+        if (planes)
+        {
+            unsigned char *h = plane_buffer, *s = h + chunk, *v = s + chunk;
+            _convert_planes(with, lut, rgb, h, s, v, chunk);
+            for (int i = 0; i < chunk; i++)
+                hsv[i] = (HSV){ HSV_PLANE_H(h[i]), HSV_PLANE_SV(s[i]), HSV_PLANE_SV(v[i]) };
+        }
+        else
+            _convert_with(with, lut, rgb, hsv, chunk);
+
+        for (int i = 0; i < chunk; i++)
+        {
+            // Hue wraps around, 360 degrees is read back as 0.
+            HSV error = {
+                fabsf(hsv[i].H - expected[i].H),
+                fabsf(hsv[i].S - expected[i].S),
+                fabsf(hsv[i].V - expected[i].V)
+            };
+            error.H = MIN(error.H, 360.0f - error.H);
+            mismatch_c += error.H != 0.0f || error.S != 0.0f || error.V != 0.0f;
+            max_error.H = MAX(max_error.H, error.H);
+            max_error.S = MAX(max_error.S, error.S);
+            max_error.V = MAX(max_error.V, error.V);
+        }
+    }
+
+    printf("%s: %u colors differ, max. error H %g, S %g, V %g\n", name, mismatch_c,
+        max_error.H, max_error.S, max_error.V);
+    return max_error;
+}
+
+/// @brief Whether no channel differs by more than the bound, printing it if one does.
+bool _within(HSV max_error, HSV bound)
+{
+    bool within = max_error.H <= bound.H && max_error.S <= bound.S && max_error.V <= bound.V;
+    if (!within)
+        printf("Over the bound of H %g, S %g, V %g!\n", bound.H, bound.S, bound.V);
+    return within;
+}
+
+/// @brief Converts the benchmark frame into planes with a kernel (or the tables if lut is set) for the given time.
+/// @return Millions of pixels converted per second.
+double _time_conversion(Hsv_Kernel with, bool lut, float seconds, const RGB *rgb, unsigned char *plane_buffer)
+{
+    unsigned char 
+        *h = plane_buffer, 
+        *s = h + HSV_BENCHMARK_PIXELS, 
+        *v = s + HSV_BENCHMARK_PIXELS;
+
+    unsigned int frame_c = 0;
+    double start_time = _hsv_time(), elapsed;
+    while ((elapsed = _hsv_time() - start_time) < seconds)
+    {
+        _convert_planes(with, lut, rgb, h, s, v, HSV_BENCHMARK_PIXELS);
+        frame_c++;
+    }
+
+    return (double)frame_c * HSV_BENCHMARK_PIXELS / elapsed / 1e6;
+}
+
+int hsv_benchmark(float seconds)
+{
+    hsv_convert_init();
+
+    const int chunk = 256 * 256;
+    RGB *rgb = malloc(MAX(chunk, HSV_BENCHMARK_PIXELS) * sizeof(RGB));
+    HSV *expected = malloc(chunk * sizeof(HSV));
+    HSV *hsv = malloc(chunk * sizeof(HSV));
+    unsigned char *planes = malloc(MAX(chunk, HSV_BENCHMARK_PIXELS) * 3);
+    if (rgb == NULL || expected == NULL || hsv == NULL || planes == NULL)
+    {
+        printf("Failed to allocate HSV benchmark buffers!\n");
+        free(rgb);
+        free(expected);
+        free(hsv);
+        free(planes);
+        return -1;
+    }
+
+    const HSV 
+        exact = { HSV_MAX_ERROR, HSV_MAX_ERROR, HSV_MAX_ERROR },
+        lut_bound = { HSV_LUT_MAX_ERROR, HSV_LUT_MAX_ERROR, HSV_LUT_MAX_ERROR },
+        plane_bound = { HSV_PLANE_MAX_ERROR_H + HSV_LUT_MAX_ERROR, HSV_PLANE_MAX_ERROR_SV, HSV_PLANE_MAX_ERROR_SV };
+
+    int result = 0;
+    printf("\nComparing the HSV kernels to rgb_to_hsv on all 2^24 colors (picked: %s)...\n", kernel_name);
+    for (int k = 0; k < KERNEL_COUNT; k++)
+    {
+        if (kernels[k].supported && kernels[k].kernel != NULL &&
+            !_within(_check_colors(kernels[k].name, kernels[k].kernel, false, false, rgb, expected, hsv, planes), exact))
+            result = -1;
+    }
+    if (!_within(_check_colors("hsv_lut", NULL, true, false, rgb, expected, hsv, planes), lut_bound))
+        result = -1;
+
+    printf("\nSame, read back from the planes of a byte per channel the scan works on...\n");
+    if (!_within(_check_colors(kernel_name, kernel, false, true, rgb, expected, hsv, planes), plane_bound) ||
+        !_within(_check_colors("hsv_lut", NULL, true, true, rgb, expected, hsv, planes), plane_bound))
+        result = -1;
+
+    // Noise rather than a gradient, so the branches of rgb_to_hsv are as unpredictable as in a real frame.
+    unsigned int seed = 1;
+    for (int i = 0; i < HSV_BENCHMARK_PIXELS; i++)
+    {
+        seed = seed * 1103515245 + 12345;
+        rgb[i] = (RGB){ .R = seed >> 24, .G = seed >> 16, .B = seed >> 8 };
+    }
+
+    printf("\nConverting %d pixels into planes on one thread, %.1f s each...\n", HSV_BENCHMARK_PIXELS, seconds);
+    double scalar_rate = 0.0;
+    for (int k = KERNEL_COUNT - 1; k >= 0; k--)
+    {
+        if (!kernels[k].supported)
+            continue;
+
+        double rate = _time_conversion(kernels[k].kernel, false, seconds, rgb, planes);
+        if (kernels[k].kernel == NULL)
+            scalar_rate = rate;
+        printf("%s: %.1f Mpixels/s, %.2fx of scalar\n", kernels[k].name, rate, rate / scalar_rate);
+    }
+    double lut_rate = _time_conversion(NULL, true, seconds, rgb, planes);
+    printf("hsv_lut: %.1f Mpixels/s, %.2fx of scalar\n", lut_rate, lut_rate / scalar_rate);
+
+    free(rgb);
+    free(expected);
+    free(hsv);
+    free(planes);
+    return result;
+}
@@ -5,14 +5,145 @@
 #include "include/img_data.h"
 #include "include/jpegutils.h"
 #include "include/aabb.h"
+#include "include/worker_pool.h"
+#include "include/hsv_convert.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdbool.h>
 #include <math.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
 
-#include <omp.h>
+#include <pthread.h>
 #include <SDL2/SDL.h>
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+
+#define COARSE_CANDIDATES 4 // Whitest spots of the coarse image that are decoded & scored at full size.
+#define YCC_LUT_CHROMA_BITS 6 // Bits of U & V that select an entry of the YCbCr to HSV table, all 8 bits of Y do.
+#define SCAN_L2_FALLBACK (256 * 1024) // L2 cache size assumed if the system does not report one.
+#define SCAN_TILES_PER_SLOT 32 // Least amount of tiles per slot of the scan, so there are some left to steal.
+#define BAND_SCAN_ROWS 16 // Rows of the region of interest that are scored at a time while a frame is decoded in bands.
+
+
+/// @brief Per-thread working memory, grown to the largest frame processed & kept for the next one.
+/// Frames of 1080p and up are far too large for the stack.
+typedef struct Scratch_Buffers
+{
+    unsigned char *yuv; // Decoded Y, U & V planes.
+    size_t yuv_size;
+    Hsv_Planes hsv;
+    size_t hsv_size;
+    jpeg_decoder *decoder; // Every thread decodes with its own, so cameras can decode at the same time.
+} Scratch_Buffers;
+
+static pthread_key_t scratch_key;
+static pthread_once_t scratch_once = PTHREAD_ONCE_INIT;
+
+void _free_scratch_buffers(void *input)
+{
+    Scratch_Buffers *scratch = (Scratch_Buffers*)input;
+    free(scratch->yuv);
+    free(scratch->hsv.h);
+    jpeg_decoder_destroy(scratch->decoder);
+    free(scratch);
+}
+
+void _create_scratch_key()
+{
+    pthread_key_create(&scratch_key, _free_scratch_buffers);
+}
+
+/// @brief Returns the calling thread's scratch buffers, creating them on first use.
+Scratch_Buffers *_get_scratch_buffers()
+{
+    pthread_once(&scratch_once, _create_scratch_key);
+
+    Scratch_Buffers *scratch = pthread_getspecific(scratch_key);
+    if (scratch == NULL)
+    {
+        scratch = calloc(1, sizeof(Scratch_Buffers));
+        if (scratch == NULL || pthread_setspecific(scratch_key, scratch) != 0)
+        {
+            free(scratch);
+            return NULL;
+        }
+    }
+    return scratch;
+}
+
+/// @brief Returns room for the Y, U & V planes of a frame, all of them fmt->size bytes.
+unsigned char *_scratch_yuv(const Img_Fmt *fmt)
+{
+    Scratch_Buffers *scratch = _get_scratch_buffers();
+    if (scratch == NULL)
+        return NULL;
+
+    size_t size = (size_t)fmt->size * 3;
+    if (scratch->yuv_size < size)
+    {
+        free(scratch->yuv);
+        scratch->yuv = malloc(size);
+        scratch->yuv_size = (scratch->yuv == NULL) ? 0 : size;
+    }
+    return scratch->yuv;
+}
+
+/// @brief Returns the calling thread's JPEG decoder.
+jpeg_decoder *_scratch_decoder()
+{
+    Scratch_Buffers *scratch = _get_scratch_buffers();
+    if (scratch == NULL)
+        return NULL;
+
+    if (scratch->decoder == NULL)
+        scratch->decoder = jpeg_decoder_create();
+    return scratch->decoder;
+}
+
+/// @brief Returns room for the HSV planes of a frame, in a single allocation.
+Hsv_Planes *_scratch_hsv(const Img_Fmt *fmt)
+{
+    Scratch_Buffers *scratch = _get_scratch_buffers();
+    if (scratch == NULL)
+        return NULL;
+
+    const int pitch = (fmt->width + HSV_PLANE_ALIGN - 1) / HSV_PLANE_ALIGN * HSV_PLANE_ALIGN;
+    const size_t plane_size = (size_t)pitch * fmt->height;
+    if (scratch->hsv_size < plane_size * 3)
+    {
+        free(scratch->hsv.h);
+        scratch->hsv.h = aligned_alloc(HSV_PLANE_ALIGN, plane_size * 3);
+        scratch->hsv_size = (scratch->hsv.h == NULL) ? 0 : plane_size * 3;
+        if (scratch->hsv.h == NULL)
+            return NULL;
+    }
+    scratch->hsv.s = scratch->hsv.h + plane_size;
+    scratch->hsv.v = scratch->hsv.s + plane_size;
+    scratch->hsv.pitch = pitch;
+    return &scratch->hsv;
+}
+
+/// @brief The planes starting at the given row, to convert rows of frames cropped at the sensor into.
+Hsv_Planes _hsv_from_row(const Hsv_Planes *hsv, int row)
+{
+    size_t offset = (size_t)row * hsv->pitch;
+    return (Hsv_Planes){ hsv->h + offset, hsv->s + offset, hsv->v + offset, hsv->pitch };
+}
+
+/// @brief Converts pixels x0 to x1 of a row of a full-width RGB frame into the HSV planes.
+void _row_to_hsv(const Img_Fmt *fmt, const RGB *rgb, const Hsv_Planes *hsv, int y, int x0, int x1)
+{
+    size_t p = (size_t)y * hsv->pitch + x0;
+    rgb_to_hsv_batch(&rgb[y * fmt->width + x0], hsv->h + p, hsv->s + p, hsv->v + p, x1 - x0, fmt->hsv_lut == 1.0f);
+}
+
 
 void _yuyv_to_rgb(unsigned char y1, unsigned char u, unsigned char y2, unsigned char v, RGB *rgb)
 {
@@ -30,59 +161,180 @@ void _yuyv_to_rgb(unsigned char y1, unsigned char u, unsigned char y2, unsigned
     }
 }
 
-int mjpeg_to_rgb(unsigned char *mjpeg, unsigned int mjpeg_size, const Img_Fmt *fmt, RGB *rgb)
+/// @brief The parts of a frame split at its restart markers, decoded one per slot.
+typedef struct Part_Decode_Task
+{
+    const jpeg_part *parts;
+    int ctype, width;
+    unsigned char *col_y, *col_u, *col_v;
+    atomic_int result;
+} Part_Decode_Task;
+
+void _decode_part_task(void *arg, int t_id, int t_count)
 {
-    unsigned char 
-        col_y[fmt->size],
-        col_u[fmt->size],
-        col_v[fmt->size];
+    Part_Decode_Task *task = (Part_Decode_Task*)arg;
+
+    // Every thread decodes with its own decoder.
+    jpeg_decoder *part_decoder = _scratch_decoder();
+    int row = task->parts[t_id].first_row;
+    int chroma_row = (task->ctype == Y4M_CHROMA_422) ? row : row / 2;
+    int part_result = (part_decoder == NULL) ? -1 : decode_jpeg_part(
+        part_decoder, &task->parts[t_id], task->ctype, task->width,
+        task->col_y + row * task->width, task->col_u + chroma_row * task->width / 2, task->col_v + chroma_row * task->width / 2);
+
+    if (part_result != 0)
+        atomic_store(&task->result, part_result);
+}
 
-    int result = decode_jpeg_raw(
-        mjpeg, mjpeg_size, 
-        0, Y4M_CHROMA_422, 
-        fmt->width, fmt->height, 
+/// @brief Decodes an MJPEG frame into Y, U & V planes. Frames with restart markers are split at them
+/// & their parts decoded on thread_count threads, others are decoded by the calling thread alone,
+/// with the backend chosen by decode_backend.
+/// @param ctype Y4M_CHROMA_422 for U & V planes of full height, Y4M_CHROMA_420JPEG for half height.
+int _decode_mjpeg(const Img_Fmt *fmt, jpeg_decoder *decoder, unsigned char *mjpeg, unsigned int mjpeg_size, int ctype, int height,
+    unsigned char *col_y, unsigned char *col_u, unsigned char *col_v)
+{
+    jpeg_part parts[JPEG_MAX_PARTS];
+    int part_c = 1;
+    if (fmt->thread_count > 1.0f)
+        part_c = split_jpeg_restarts(mjpeg, mjpeg_size, (int)fmt->thread_count, parts);
+
+    if (part_c < 2 && fmt->decode_backend == 1.0f)
+        return decode_jpeg_turbo(decoder, mjpeg, mjpeg_size, ctype, fmt->width, height, col_y, col_u, col_v);
+    if (part_c < 2)
+        return decode_jpeg_raw(decoder, mjpeg, mjpeg_size, 0, ctype, fmt->width, height, col_y, col_u, col_v);
+
+    Part_Decode_Task task = {
+        .parts = parts,
+        .ctype = ctype,
+        .width = fmt->width,
+        .col_y = col_y, .col_u = col_u, .col_v = col_v
+    };
+    atomic_init(&task.result, 0);
+    pool_run(STAGE_DECODE, part_c, _decode_part_task, &task);
+    return atomic_load(&task.result);
+}
+
+/// @brief Converts rows of Y, U & V planes to RGB.
+/// @param chroma_shift 0 if the U & V planes have a row for every row of Y (4:2:2), 1 for every other row (4:2:0).
+void _planes_to_rgb(const unsigned char *col_y, const unsigned char *col_u, const unsigned char *col_v,
+    int width, int start_row, int end_row, int chroma_shift, RGB *rgb)
+{
+    for (int row = start_row; row < end_row; row++)
+    {
+        const unsigned char 
+            *row_y = col_y + row * width,
+            *row_u = col_u + (row >> chroma_shift) * width / 2,
+            *row_v = col_v + (row >> chroma_shift) * width / 2;
+        RGB *row_rgb = rgb + row * width;
+
+        for (int i = 0; i < width / 2; i++)
+            _yuyv_to_rgb(row_y[i * 2], row_u[i], row_y[i * 2 + 1], row_v[i], &row_rgb[i * 2]);
+    }
+}
+
+void _planes_to_hsv(const unsigned char *col_y, const unsigned char *col_u, const unsigned char *col_v,
+    int width, int start_row, int end_row, int chroma_shift, const Hsv_Planes *hsv);
+
+/// @brief Rows of decoded planes, converted to RGB and/or HSV in even slices of rows.
+typedef struct Planes_Task
+{
+    unsigned char *planes[3];
+    int width, row_count, chroma_shift;
+    RGB *rgb; // NULL if not needed.
+    const Hsv_Planes *hsv; // NULL if not needed.
+} Planes_Task;
+
+void _convert_planes_task(void *arg, int t_id, int t_count)
+{
+    Planes_Task *task = (Planes_Task*)arg;
+
+    // Threads convert whole rows, even ones for 4:2:0 frames, so chroma rows are read by one thread only.
+    int 
+        row_pairs = task->row_count / 2,
+        start_row = row_pairs * t_id / t_count * 2, 
+        end_row = (t_id == t_count - 1) ? task->row_count : row_pairs * (t_id + 1) / t_count * 2;
+
+    if (task->hsv != NULL)
+        _planes_to_hsv(task->planes[0], task->planes[1], task->planes[2], task->width, start_row, end_row, task->chroma_shift, task->hsv);
+    if (task->rgb != NULL)
+        _planes_to_rgb(task->planes[0], task->planes[1], task->planes[2], task->width, start_row, end_row, task->chroma_shift, task->rgb);
+}
+
+/// @brief Decodes an MJPEG frame into the calling thread's Y, U & V planes.
+/// @param planes Receives the first row of the region of interest in the Y, U & V planes.
+/// @param chroma_shift Receives 0 for 4:2:2 planes, 1 for 4:2:0 planes with half as many chroma rows.
+int _decode_mjpeg_roi(unsigned char *mjpeg, unsigned int mjpeg_size, AABB roi, bool cropped, const Img_Fmt *fmt, 
+    unsigned char *planes[3], int *chroma_shift)
+{
+    jpeg_decoder *decoder = _scratch_decoder();
+    unsigned char *col_y = _scratch_yuv(fmt);
+    if (decoder == NULL || col_y == NULL)
+    {
+        printf("Failed to allocate decode buffers!\n");
+        return -1;
+    }
+    unsigned char
+        *col_u = col_y + fmt->size,
+        *col_v = col_u + fmt->size;
+
+    // Frames cropped at the sensor are encoded at the size of the region of interest.
+    const int roi_height = roi.s - roi.n;
+
+    // 4:2:0 frames are decoded & converted with their chroma planes at half height, instead of upsampling them.
+    const int ctype = jpeg_native_chroma(mjpeg, mjpeg_size);
+    *chroma_shift = (ctype == Y4M_CHROMA_422) ? 0 : 1;
+
+    timer_begin_measure(DECODE);
+    int result = _decode_mjpeg(
+        fmt, decoder, mjpeg, mjpeg_size, ctype, 
+        cropped ? roi_height : fmt->height, 
         col_y, col_u, col_v);
+    timer_end_measure(DECODE);
 
     if (result != 0)
         printf("Error in decode_jpeg_raw: %d\n",result);
 
-    int yuv_size = fmt->width * fmt->height / 2;
+    // Its top is aligned to 16 rows, so the region of interest starts on a chroma row of 4:2:0 frames as well.
+    if (!cropped)
+    {
+        col_y += roi.n * fmt->width;
+        col_u += (roi.n >> *chroma_shift) * fmt->width / 2;
+        col_v += (roi.n >> *chroma_shift) * fmt->width / 2;
+    }
+
+    planes[0] = col_y;
+    planes[1] = col_u;
+    planes[2] = col_v;
+    return 0;
+}
+
+int mjpeg_to_rgb(unsigned char *mjpeg, unsigned int mjpeg_size, AABB roi, bool cropped, const Img_Fmt *fmt, RGB *rgb)
+{
+    unsigned char *planes[3];
+    int chroma_shift;
+    if (_decode_mjpeg_roi(mjpeg, mjpeg_size, roi, cropped, fmt, planes, &chroma_shift) == -1)
+        return -1;
 
-    unsigned char 
-        col_y_cpy[fmt->size],
-        col_u_cpy[fmt->size],
-        col_v_cpy[fmt->size];
+    unsigned char
+        *col_y = planes[0],
+        *col_u = planes[1],
+        *col_v = planes[2];
+    const int roi_height = roi.s - roi.n;
+
+    // Only the rows of the region of interest are converted, into their place in the full frame.
+    rgb += roi.n * fmt->width;
 
-    if (fmt->compare_threading == 1.0f)
-        for (int i = 0; i < fmt->size; i++)
-        {
-            col_y_cpy[i] = col_y[i];
-            col_u_cpy[i] = col_u[i];
-            col_v_cpy[i] = col_v[i];
-        }
-    
     // Multi-threaded:
     {
         timer_begin_measure(T_CONVERSION);
-        const unsigned char thread_count = fmt->thread_count;
-        #pragma omp parallel num_threads(thread_count)
-        {
-            int 
-                t_id = omp_get_thread_num(), 
-                start_i = yuv_size * t_id / thread_count, 
-                end_i = yuv_size * (t_id + 1) / thread_count;
-
-            for (int i = start_i; i < end_i; i++)
-            {
-                unsigned char 
-                    y1 = col_y[i * 2],
-                    u = col_u[i],
-                    y2 = col_y[i * 2 + 1],
-                    v = col_v[i];
-
-                _yuyv_to_rgb(y1, u, y2, v, &rgb[i * 2]);
-            }
-        }
+        Planes_Task task = {
+            .planes = { col_y, col_u, col_v },
+            .width = fmt->width,
+            .row_count = roi_height,
+            .chroma_shift = chroma_shift,
+            .rgb = rgb
+        };
+        pool_run(STAGE_CONVERSION, fmt->thread_count, _convert_planes_task, &task);
         timer_end_measure(T_CONVERSION);
     }
     
@@ -90,42 +342,250 @@ int mjpeg_to_rgb(unsigned char *mjpeg, unsigned int mjpeg_size, const Img_Fmt *f
     if (fmt->compare_threading == 1.0f)
     {
         timer_begin_measure(CONVERSION);
-        for (int i = 0; i < yuv_size; i++)
-        {
-            unsigned char 
-                y1 = col_y_cpy[i * 2],
-                u = col_u_cpy[i],
-                y2 = col_y_cpy[i * 2 + 1],
-                v = col_v_cpy[i];
+        _planes_to_rgb(col_y, col_u, col_v, fmt->width, 0, roi_height, chroma_shift, rgb);
+        timer_end_measure(CONVERSION);
+    }
+    return 0;
+}
 
-                _yuyv_to_rgb(y1, u, y2, v, &rgb[i * 2]);
-        }
+
+/// @brief Converts a pair of pixels of a raw frame, starting at pixel x of row y.
+/// @param plane_height Amount of rows in the frame's (first) plane.
+void _raw_pair_to_rgb(const unsigned char *data, unsigned int stride, unsigned int plane_height, bool nv12, int x, int y, RGB *rgb)
+{
+    if (nv12)
+    {
+        // Full-size Y plane followed by a half-height plane of interleaved U & V.
+        const unsigned char *y_row = &data[y * stride];
+        const unsigned char *uv_row = &data[plane_height * stride + (y / 2) * stride];
+
+        _yuyv_to_rgb(y_row[x], uv_row[x], y_row[x + 1], uv_row[x + 1], rgb);
+    }
+    else
+    {
+        const unsigned char *yuyv = &data[y * stride + x * 2];
+
+        _yuyv_to_rgb(yuyv[0], yuyv[1], yuyv[2], yuyv[3], rgb);
+    }
+}
+
+/// @brief Pairs of pixels of a raw frame, converted in even slices.
+typedef struct Raw_Task
+{
+    const unsigned char *data;
+    unsigned int stride, plane_height;
+    bool nv12;
+    int width, first_row, pair_count;
+    RGB *rgb;
+} Raw_Task;
+
+void _convert_raw_task(void *arg, int t_id, int t_count)
+{
+    Raw_Task *task = (Raw_Task*)arg;
+    int
+        start_i = task->pair_count * t_id / t_count,
+        end_i = task->pair_count * (t_id + 1) / t_count;
+
+    for (int i = start_i; i < end_i; i++)
+        _raw_pair_to_rgb(task->data, task->stride, task->plane_height, task->nv12, 
+            i * 2 % task->width, task->first_row + i * 2 / task->width, &task->rgb[i * 2]);
+}
+
+/// @brief Converts the region of interest of a raw YUYV or NV12 frame straight to RGB, skipping any decoding.
+/// Frames cropped at the sensor hold only the region's rows, otherwise they are skipped in software.
+int _raw_to_rgb(const unsigned char *data, unsigned int stride, bool nv12, AABB roi, bool cropped, const Img_Fmt *fmt, RGB *rgb)
+{
+    const int width = fmt->width;
+    const unsigned int plane_height = cropped ? roi.s - roi.n : fmt->height;
+    const int first_row = cropped ? 0 : roi.n;
+    int pair_count = (roi.s - roi.n) * width / 2;
+
+    rgb += roi.n * width;
+
+    // Multi-threaded:
+    {
+        timer_begin_measure(T_CONVERSION);
+        Raw_Task task = {
+            .data = data,
+            .stride = stride,
+            .plane_height = plane_height,
+            .nv12 = nv12,
+            .width = width,
+            .first_row = first_row,
+            .pair_count = pair_count,
+            .rgb = rgb
+        };
+        pool_run(STAGE_CONVERSION, fmt->thread_count, _convert_raw_task, &task);
+        timer_end_measure(T_CONVERSION);
+    }
+
+    // Single-threaded:
+    if (fmt->compare_threading == 1.0f)
+    {
+        timer_begin_measure(CONVERSION);
+        for (int i = 0; i < pair_count; i++)
+            _raw_pair_to_rgb(data, stride, plane_height, nv12, i * 2 % width, first_row + i * 2 / width, &rgb[i * 2]);
         timer_end_measure(CONVERSION);
     }
     return 0;
 }
 
+int yuyv_to_rgb(const unsigned char *yuyv, unsigned int size, unsigned int stride, AABB roi, bool cropped, const Img_Fmt *fmt, RGB *rgb)
+{
+    unsigned int height = cropped ? roi.s - roi.n : fmt->height;
+
+    stride = MAX(stride, fmt->width * 2);
+    if (size < stride * height)
+    {
+        printf("Incomplete YUYV frame: %u of %u bytes.\n", size, stride * height);
+        return -1;
+    }
+
+    return _raw_to_rgb(yuyv, stride, false, roi, cropped, fmt, rgb);
+}
+
+int nv12_to_rgb(const unsigned char *nv12, unsigned int size, unsigned int stride, AABB roi, bool cropped, const Img_Fmt *fmt, RGB *rgb)
+{
+    unsigned int height = cropped ? roi.s - roi.n : fmt->height;
+
+    stride = MAX(stride, fmt->width);
+    if (size < stride * height * 3 / 2)
+    {
+        printf("Incomplete NV12 frame: %u of %u bytes.\n", size, stride * height * 3 / 2);
+        return -1;
+    }
+
+    return _raw_to_rgb(nv12, stride, true, roi, cropped, fmt, rgb);
+}
+
+
+/// @brief Whether a pixel is too far from white to be scored.
+bool _skip_pixel(const Img_Fmt *fmt, float h, float s, float v)
+{
+    return (h > 180.0f - fmt->filter_hue * 180.0f && h < 180.0f + fmt->filter_hue * 180.0f) ||
+        s > 1.0f - fmt->filter_sat || v < fmt->filter_val;
+}
+
+/// @brief _skip_pixel in terms of the bytes of the HSV planes, to find the pixels worth scoring 16 at a time.
+typedef struct Scan_Filter
+{
+    bool none; // No pixel passes.
+    bool all_hues; // Every hue passes.
+    unsigned char h_skip, h_skip_range; // Hues of h_skip up to h_skip + h_skip_range are skipped.
+    unsigned char s_max, v_min;
+} Scan_Filter;
+
+/// @brief Derives the byte thresholds from _skip_pixel itself, so both skip the same pixels.
+Scan_Filter _scan_filter(const Img_Fmt *fmt)
+{
+    Scan_Filter filter = { .none = false, .all_hues = true };
+
+    // Saturation passes up to a maximum, value from a minimum.
+    int s_max = -1, v_min = 256;
+    for (int q = 0; q < 256; q++)
+    {
+        if (!_skip_pixel(fmt, 0.0f, HSV_PLANE_SV(q), 1.0f))
+            s_max = q;
+        if (!_skip_pixel(fmt, 0.0f, 0.0f, HSV_PLANE_SV(255 - q)))
+            v_min = 255 - q;
+    }
+
+    // The skipped hues are a range around 180 degrees.
+    int h_first = -1, h_last = -1;
+    for (int q = 0; q < 256; q++)
+    {
+        if (_skip_pixel(fmt, HSV_PLANE_H(q), 0.0f, 1.0f))
+        {
+            if (h_first == -1)
+                h_first = q;
+            h_last = q;
+        }
+    }
+
+    filter.none = s_max == -1 || v_min == 256 || (h_first == 0 && h_last == 255);
+    filter.s_max = (unsigned char)MAX(0, s_max);
+    filter.v_min = (unsigned char)MIN(255, v_min);
+    if (h_first != -1)
+    {
+        filter.all_hues = false;
+        filter.h_skip = (unsigned char)h_first;
+        filter.h_skip_range = (unsigned char)(h_last - h_first);
+    }
+    return filter;
+}
+
+/// @brief Returns the first pixel from x up to x1 of row y that passes the filter, x1 if none do.
+int _next_candidate(const Scan_Filter *filter, const Hsv_Planes *hsv, int y, int x, int x1)
+{
+    if (filter->none)
+        return x1;
+
+    const unsigned char 
+        *row_h = hsv->h + (size_t)y * hsv->pitch,
+        *row_s = hsv->s + (size_t)y * hsv->pitch,
+        *row_v = hsv->v + (size_t)y * hsv->pitch;
+
+#ifdef __SSE2__
+    const __m128i 
+        h_skip = _mm_set1_epi8((char)filter->h_skip), 
+        h_skip_range = _mm_set1_epi8((char)filter->h_skip_range),
+        s_max = _mm_set1_epi8((char)filter->s_max), 
+        v_min = _mm_set1_epi8((char)filter->v_min);
+
+    for (; x + 16 <= x1; x += 16)
+    {
+        __m128i 
+            h = _mm_loadu_si128((const __m128i*)(row_h + x)),
+            s = _mm_loadu_si128((const __m128i*)(row_s + x)),
+            v = _mm_loadu_si128((const __m128i*)(row_v + x));
+
+        // Unsigned comparisons by way of min & max.
+        __m128i pass = _mm_and_si128(
+            _mm_cmpeq_epi8(_mm_min_epu8(s, s_max), s), 
+            _mm_cmpeq_epi8(_mm_max_epu8(v, v_min), v));
+        if (!filter->all_hues)
+        {
+            // Hues below h_skip wrap around to above h_skip_range.
+            __m128i offset = _mm_sub_epi8(h, h_skip);
+            pass = _mm_andnot_si128(_mm_cmpeq_epi8(_mm_min_epu8(offset, h_skip_range), offset), pass);
+        }
+
+        int mask = _mm_movemask_epi8(pass);
+        if (mask != 0)
+            return x + __builtin_ctz(mask);
+    }
+#endif
+
+    for (; x < x1; x++)
+    {
+        bool h_pass = filter->all_hues || (unsigned char)(row_h[x] - filter->h_skip) > filter->h_skip_range;
+        if (h_pass && row_s[x] <= filter->s_max && row_v[x] >= filter->v_min)
+            return x;
+    }
+    return x1;
+}
 
 /// @brief Calculates the stength of a given pixel and compares it to the given strength.
-/// @param hsv Image in HSV format.
-/// @param i Index of the pixel to evaluate.
-/// @param res_str The strength to compare i's strength to. If i's strength is greater, this variable gets overwritten.
-/// @param res_i The index of the pixel with the greater strength.
+/// @param hsv Image in HSV planes.
+/// @param i_x, i_y Coordinates of the pixel to evaluate.
+/// @param res_str The strength to compare the pixel's strength to. If the pixel's strength is greater, this variable gets overwritten.
+/// @param res_i The index of the pixel with the greater strength, in pixels of rows of fmt->width.
 /// @param out_hsv The separate strengths of each color channel. Set to NULL if unused.
+/// @param roi Only the rows of the region of interest are sampled.
 int _compare_strength(
-    const Img_Fmt *fmt, const HSV *hsv, 
-    int i, float *res_str, int *res_i, 
+    const Img_Fmt *fmt, const Hsv_Planes *hsv, AABB roi, 
+    int i_x, int i_y, float *res_str, int *res_i, 
     HSV *out_hsv)
 {
-    if ((hsv[i].H > 180.0f - fmt->filter_hue * 180.0f && hsv[i].H < 180.0f + fmt->filter_hue * 180.0f) ||
-        hsv[i].S > 1.0f - fmt->filter_sat || hsv[i].V < fmt->filter_val)
-        return 0; // Skip pixels that are not within a given distance to white.
+    const int width = fmt->width;
+    const int pitch = hsv->pitch;
+    const int i_p = i_x + i_y * pitch;
+
+    // Skip pixels that are not within a given distance to white.
+    if (_skip_pixel(fmt, HSV_PLANE_H(hsv->h[i_p]), HSV_PLANE_SV(hsv->s[i_p]), HSV_PLANE_SV(hsv->v[i_p])))
+        return 0;
 
      
-    const int width = fmt->width;
-    const int height = fmt->height;
-    const int i_x = i % width;
-    const int i_y = i / width;
     const int sample_step = (int)fmt->sample_step;
 
     const float scan_rad = fmt->scan_rad;
@@ -140,8 +600,8 @@ int _compare_strength(
     float curr_str = 0.0f;
     int str_div = 0;
     
-    for (int o_y = MAX(i_y - (int)scan_rad, 0); 
-        o_y < MIN(i_y + (int)scan_rad, height); 
+    for (int o_y = MAX(i_y - (int)scan_rad, (int)roi.n); 
+        o_y < MIN(i_y + (int)scan_rad, (int)roi.s); 
         o_y++)
     {
         for (int o_x = MAX(i_x - (int)scan_rad, 0); 
@@ -160,7 +620,11 @@ int _compare_strength(
                 continue;
             float center_dist = sqrtf(center_dist_sqr);
 
-            int i_offset = o_x + o_y * width;
+            int i_offset = o_x + o_y * pitch;
+            const float 
+                o_h = HSV_PLANE_H(hsv->h[i_offset]), 
+                o_s = HSV_PLANE_SV(hsv->s[i_offset]), 
+                o_v = HSV_PLANE_SV(hsv->v[i_offset]);
 
             // A lot of math that results in a number which trends towards either 0 or 1, 
             // depending on how likely it is to be part of a laser dot.
@@ -168,16 +632,16 @@ int _compare_strength(
             float desired_s = powf(CLERP(0.0f, MAX(0.0f, LERP(-2.5f, 1.0f, tapered_dist)) * 0.85f, powf(tapered_dist, 0.1f)), 1.5f);
             float desired_v = LERP(1.0f, 0.9f, tapered_dist);
 
-            float alt_h_offset = (alt_weights == 0.0f) ? 0.0f : fabsf(hsv[i_offset].H - 180.0f) / 180.0f;
+            float alt_h_offset = (alt_weights == 0.0f) ? 0.0f : fabsf(o_h - 180.0f) / 180.0f;
             float alt_s_offset = (alt_weights == 0.0f) ? 0.0f : CLERP(0.0f, MAX(0.0f, LERP(-2.5f, 1.0f, tapered_dist)) * 0.85f, powf(tapered_dist, 0.1f));
             float alt_v_offset = (alt_weights == 0.0f) ? 0.0f : 0.0f;
 
-            float curr_h_offset = LERP(((CLAMP(fabsf(hsv[i_offset].H - 180.0f), 0.0f, 360.0f)) * ((hsv[i_offset].V + 1.0f) / 2.0f)) / 180.0f, alt_h_offset, alt_weights);
-            float curr_s_offset = LERP(fabsf((1.0f - desired_s) - hsv[i_offset].S), alt_s_offset, alt_weights);
-            float curr_v_offset = LERP(CLERP(1.0f, 0.0f, (desired_v - hsv[i_offset].V) / desired_v), alt_v_offset, alt_weights);
+            float curr_h_offset = LERP(((CLAMP(fabsf(o_h - 180.0f), 0.0f, 360.0f)) * ((o_v + 1.0f) / 2.0f)) / 180.0f, alt_h_offset, alt_weights);
+            float curr_s_offset = LERP(fabsf((1.0f - desired_s) - o_s), alt_s_offset, alt_weights);
+            float curr_v_offset = LERP(CLERP(1.0f, 0.0f, (desired_v - o_v) / desired_v), alt_v_offset, alt_weights);
 
             curr_h_offset *= 1.0f - powf(CLAMP(
-                (1.0f - hsv[i_offset].S - h_white_falloff) * h_white_penalty, 
+                (1.0f - o_s - h_white_falloff) * h_white_penalty, 
                 0.0f, 1.0f - h_white_falloff) / (1.0f - h_white_falloff), h_white_curve
             );
             
@@ -207,12 +671,181 @@ int _compare_strength(
     if (curr_str > *res_str)
     {
         *res_str = curr_str;
-        *res_i = i;
+        *res_i = i_x + i_y * width;
     }
     return (int)(fmt->skip_len);
 }
 
-int _scan_for_dot(const Img_Fmt *fmt, const HSV *hsv, int *res_i, float *res_str)
+/// @brief Per-slot state of a tiled scan, a cache line of its own so slots never write to a shared one.
+typedef struct Scan_Slot
+{
+    _Alignas(64) _Atomic uint64_t tiles; // Tiles left to the slot, the first in the low & the end in the high 32 bits.
+    float best_str;
+    int best_i;
+    double busy; // CPU time spent scanning, in seconds.
+    unsigned int tile_c, steal_c;
+} Scan_Slot;
+
+/// @brief The region of interest, scanned in square tiles that each slot takes from its own range,
+/// stealing from the others once it runs out.
+typedef struct Scan_Task
+{
+    const Img_Fmt *fmt;
+    const Hsv_Planes *hsv;
+    Scan_Filter filter;
+    AABB roi;
+    int tile_side, tiles_x;
+    Scan_Slot *slots;
+} Scan_Task;
+
+/// @brief Busy time of every slot of the tiled scans so far, for scan_report.
+typedef struct Scan_Stats
+{
+    pthread_mutex_t lock;
+    unsigned int runs[POOL_MAX_THREADS];
+    double busy[POOL_MAX_THREADS];
+    unsigned long tile_c[POOL_MAX_THREADS], steal_c[POOL_MAX_THREADS];
+} Scan_Stats;
+
+static Scan_Stats scan_stats = { .lock = PTHREAD_MUTEX_INITIALIZER };
+
+static long l2_cache_size;
+static pthread_once_t l2_cache_once = PTHREAD_ONCE_INIT;
+
+void _read_l2_cache_size()
+{
+    l2_cache_size = sysconf(_SC_LEVEL2_CACHE_SIZE);
+    if (l2_cache_size <= 0)
+        l2_cache_size = SCAN_L2_FALLBACK;
+}
+
+/// @brief The side of the scan tiles, so that a tile & the rows & columns within scan_rad around it,
+/// which its pixels are scored on, fit in half of the L2 cache, and every slot has a few of them.
+int _scan_tile_side(const Img_Fmt *fmt, AABB roi, int thread_count)
+{
+    pthread_once(&l2_cache_once, _read_l2_cache_size);
+    int side = (int)sqrtf((float)l2_cache_size / 2 / 3) - 2 * (int)fmt->scan_rad; // A byte per channel.
+    int spread_side = (int)sqrtf((float)fmt->width * (roi.s - roi.n) / (thread_count * SCAN_TILES_PER_SLOT));
+    return MAX(16, MIN(side, spread_side));
+}
+
+double _thread_cpu_time()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static inline uint64_t _tile_range(uint32_t first, uint32_t end)
+{
+    return ((uint64_t)end << 32) | first;
+}
+
+/// @brief Takes the next tile of a slot's own range.
+bool _pop_tile(Scan_Slot *slot, int *tile)
+{
+    uint64_t range = atomic_load(&slot->tiles);
+    while (true)
+    {
+        uint32_t first = (uint32_t)range, end = (uint32_t)(range >> 32);
+        if (first >= end)
+            return false;
+
+        if (atomic_compare_exchange_weak(&slot->tiles, &range, _tile_range(first + 1, end)))
+        {
+            *tile = first;
+            return true;
+        }
+    }
+}
+
+/// @brief Moves the second half of the tiles left to the slot with the most of them into an empty slot's range.
+/// @return false once no slot has any left.
+bool _steal_tiles(Scan_Task *task, int t_id, int t_count)
+{
+    while (true)
+    {
+        int victim = -1;
+        uint32_t most = 0;
+        uint64_t victim_range = 0;
+
+        for (int i = 1; i < t_count; i++)
+        {
+            int v = (t_id + i) % t_count;
+            uint64_t range = atomic_load(&task->slots[v].tiles);
+            uint32_t first = (uint32_t)range, end = (uint32_t)(range >> 32);
+            if (end > first && end - first > most)
+            {
+                most = end - first;
+                victim = v;
+                victim_range = range;
+            }
+        }
+        if (victim == -1)
+            return false;
+
+        // The victim keeps the tiles it is about to reach, a single tile left is taken whole.
+        uint32_t first = (uint32_t)victim_range, end = (uint32_t)(victim_range >> 32);
+        uint32_t split = first + most / 2;
+        if (atomic_compare_exchange_strong(&task->slots[victim].tiles, &victim_range, _tile_range(first, split)))
+        {
+            atomic_store(&task->slots[t_id].tiles, _tile_range(split, end));
+            return true;
+        }
+    }
+}
+
+void _scan_tile(const Scan_Task *task, int tile, float *res_str, int *res_i)
+{
+    const int width = task->fmt->width;
+    const int 
+        x0 = (tile % task->tiles_x) * task->tile_side,
+        y0 = task->roi.n + (tile / task->tiles_x) * task->tile_side,
+        x1 = MIN(x0 + task->tile_side, width),
+        y1 = MIN(y0 + task->tile_side, (int)task->roi.s);
+
+    for (int y = y0; y < y1; y++)
+    {
+        for (int x = _next_candidate(&task->filter, task->hsv, y, x0, x1); x < x1; 
+            x = _next_candidate(&task->filter, task->hsv, y, x + 1, x1))
+        {
+            x += _compare_strength(
+                task->fmt, task->hsv, task->roi, x, y, 
+                res_str, res_i, 
+                NULL
+            );
+        }
+    }
+}
+
+void _scan_task(void *arg, int t_id, int t_count)
+{
+    Scan_Task *task = (Scan_Task*)arg;
+    Scan_Slot *slot = &task->slots[t_id];
+    double start = _thread_cpu_time();
+
+    slot->best_str = -1.0f;
+    slot->best_i = -1;
+
+    int tile;
+    while (true)
+    {
+        if (!_pop_tile(slot, &tile))
+        {
+            if (!_steal_tiles(task, t_id, t_count))
+                break;
+            slot->steal_c++;
+            continue;
+        }
+
+        _scan_tile(task, tile, &slot->best_str, &slot->best_i);
+        slot->tile_c++;
+    }
+
+    slot->busy = _thread_cpu_time() - start;
+}
+
+int _scan_for_dot(const Img_Fmt *fmt, const Hsv_Planes *hsv, AABB roi, int *res_i, float *res_str)
 {
     if (fmt->compare_threading == 1.0f)
     {
@@ -221,15 +854,20 @@ int _scan_for_dot(const Img_Fmt *fmt, const HSV *hsv, int *res_i, float *res_str
         *res_str = -1.0, 
         *res_i = -1;
 
-        for (int i = 0; i < fmt->size; i++)
+        const Scan_Filter filter = _scan_filter(fmt);
+        for (int y = roi.n; y < roi.s; y++)
         {
-            HSV out_hsv = (HSV){0.0f, 0.0f, 0.0f};
-            i += _compare_strength(
-                fmt, hsv, 
-                i, 
-                res_str, res_i, 
-                &out_hsv
-            );
+            for (int x = _next_candidate(&filter, hsv, y, 0, fmt->width); x < (int)fmt->width; 
+                x = _next_candidate(&filter, hsv, y, x + 1, fmt->width))
+            {
+                HSV out_hsv = (HSV){0.0f, 0.0f, 0.0f};
+                x += _compare_strength(
+                    fmt, hsv, roi, 
+                    x, y, 
+                    res_str, res_i, 
+                    &out_hsv
+                );
+            }
         }
         timer_end_measure(SCAN);
     }
@@ -241,39 +879,45 @@ int _scan_for_dot(const Img_Fmt *fmt, const HSV *hsv, int *res_i, float *res_str
         *res_str = -1.0f, 
         *res_i = -1;
 
-        const unsigned char thread_count = fmt->thread_count;
-
-        float best_str[thread_count];
-        int best_i[thread_count];
-
-        #pragma omp parallel num_threads(thread_count)
+        const int thread_count = CLAMP((int)fmt->thread_count, 1, POOL_MAX_THREADS);
+        Scan_Slot slots[thread_count];
+
+        Scan_Task task = {
+            .fmt = fmt,
+            .hsv = hsv,
+            .filter = _scan_filter(fmt),
+            .roi = roi,
+            .tile_side = _scan_tile_side(fmt, roi, thread_count),
+            .slots = slots
+        };
+        task.tiles_x = (fmt->width + task.tile_side - 1) / task.tile_side;
+        int tiles_y = (roi.s - roi.n + task.tile_side - 1) / task.tile_side;
+        int tile_c = task.tiles_x * tiles_y;
+
+        // Every slot starts on a band of neighbouring tiles.
+        for (int i = 0; i < thread_count; i++)
         {
-            unsigned int 
-                t_id = omp_get_thread_num(), 
-                start_i = fmt->size * t_id / thread_count, 
-                end_i = fmt->size * (t_id + 1) / thread_count;
-
-            best_str[t_id] = -1.0f,
-            best_i[t_id] = -1;
-            
-            for (int i = start_i; i < end_i; i++)
-            {
-                i += _compare_strength(
-                    fmt, hsv, i, 
-                    &(best_str[t_id]), &(best_i[t_id]), 
-                    NULL
-                );
-            }
+            atomic_init(&slots[i].tiles, _tile_range(tile_c * i / thread_count, tile_c * (i + 1) / thread_count));
+            slots[i].tile_c = 0;
+            slots[i].steal_c = 0;
         }
+        pool_run(STAGE_SCAN, thread_count, _scan_task, &task);
 
+        pthread_mutex_lock(&scan_stats.lock);
         for (int i = 0; i < thread_count; i++)
         {
-            if (best_str[i] > *res_str)
+            if (slots[i].best_str > *res_str)
             {
-                *res_str = best_str[i];
-                *res_i = best_i[i];
+                *res_str = slots[i].best_str;
+                *res_i = slots[i].best_i;
             }
+
+            scan_stats.runs[i]++;
+            scan_stats.busy[i] += slots[i].busy;
+            scan_stats.tile_c[i] += slots[i].tile_c;
+            scan_stats.steal_c[i] += slots[i].steal_c;
         }
+        pthread_mutex_unlock(&scan_stats.lock);
 
         timer_end_measure(T_SCAN);
     }
@@ -281,75 +925,788 @@ int _scan_for_dot(const Img_Fmt *fmt, const HSV *hsv, int *res_i, float *res_str
     return 0;
 }
 
+int scan_report()
+{
+    pthread_mutex_lock(&scan_stats.lock);
+
+    double total = 0.0, most = 0.0;
+    int slot_c = 0;
+    for (; slot_c < POOL_MAX_THREADS && scan_stats.runs[slot_c] > 0; slot_c++)
+    {
+        double busy = scan_stats.busy[slot_c] / scan_stats.runs[slot_c];
+        total += busy;
+        most = MAX(most, busy);
+    }
+
+    if (slot_c > 0)
+    {
+        printf("Scan busy time per slot (avg. CPU ms per frame, tiles, steals):\n");
+        for (int i = 0; i < slot_c; i++)
+        {
+            printf("%d: %.3f ms, %.1f tiles, %.1f steals\n", i, 
+                scan_stats.busy[i] / scan_stats.runs[i] * 1000.0,
+                (double)scan_stats.tile_c[i] / scan_stats.runs[i], 
+                (double)scan_stats.steal_c[i] / scan_stats.runs[i]);
+        }
+        printf("Imbalance (busiest / mean): %.2f\n", (total > 0.0) ? most / (total / slot_c) : 1.0);
+    }
+
+    pthread_mutex_unlock(&scan_stats.lock);
+    return 0;
+}
+
 
-void _visualize_pixel_strengths(const Img_Fmt *fmt, RGB *rgb, HSV *hsv)
+/// @brief The strength of every pixel of the region of interest, drawn in even slices.
+typedef struct Visualize_Task
 {
-    const unsigned char thread_count = 4;
+    const Img_Fmt *fmt;
+    RGB *rgb;
+    const Hsv_Planes *hsv;
+    AABB roi;
+    unsigned int roi_start, roi_size;
+} Visualize_Task;
+
+void _visualize_task(void *arg, int t_id, int t_count)
+{
+    Visualize_Task *task = (Visualize_Task*)arg;
+    unsigned int 
+        start_i = task->roi_start + task->roi_size * t_id / t_count, 
+        end_i = task->roi_start + task->roi_size * (t_id + 1) / t_count;
 
-    #pragma omp parallel num_threads(thread_count)
+    for (int i = start_i; i < end_i; i++)
     {
-        unsigned int 
-            t_id = omp_get_thread_num(), 
-            start_i = fmt->size * t_id / thread_count, 
-            end_i = fmt->size * (t_id + 1) / thread_count;
+        float str = 0.0f;
+        int index = -1;
+
+        HSV out_hsv = (HSV){0.0f, 0.0f, 0.0f};
+        int skip = _compare_strength(
+            task->fmt, task->hsv, task->roi, i % task->fmt->width, i / task->fmt->width, 
+            &str, &index, 
+            (task->fmt->greyscale == 1.0f ? NULL : &out_hsv)
+        );
 
-        for (int i = start_i; i < end_i; i++)
+
+        if (task->fmt->greyscale == 1.0f)
         {
-            float str = 0.0f;
-            int index = -1;
-
-            HSV out_hsv = (HSV){0.0f, 0.0f, 0.0f};
-            int skip = _compare_strength(
-                fmt, hsv, i, 
-                &str, &index, 
-                (fmt->greyscale == 1.0f ? NULL : &out_hsv)
-            );
+            str = MAX(str - task->fmt->dot_threshold, 0.0f);
+            unsigned char brightness = (unsigned char)CLAMP((str / (str + 10.0f)) * 255.0f, 0.0f, 255.0f);
+            //unsigned char brightness = (unsigned char)(sqrtf(str) * 255.0f);
+            task->rgb[i] = (RGB){
+                .R = brightness, 
+                .G = brightness, 
+                .B = brightness 
+            };
+        }
+        else
+        {
+            task->rgb[i] = (RGB){
+                .R = (unsigned char)(out_hsv.H * 255.0f), 
+                .G = (unsigned char)(out_hsv.S * 255.0f), 
+                .B = (unsigned char)(out_hsv.V * 255.0f) 
+            };
+        }
+
+        i += skip;
+    }
+}
 
+void _visualize_pixel_strengths(const Img_Fmt *fmt, RGB *rgb, const Hsv_Planes *hsv, AABB roi)
+{
+    Visualize_Task task = {
+        .fmt = fmt,
+        .rgb = rgb,
+        .hsv = hsv,
+        .roi = roi,
+        .roi_start = roi.n * fmt->width,
+        .roi_size = (roi.s - roi.n) * fmt->width
+    };
+    pool_run(STAGE_VISUALIZE, fmt->thread_count, _visualize_task, &task);
+}
+
+
+/// @brief Scans an HSV image for the strongest dot.
+int _find_laser_dot_hsv(const Img_Fmt *fmt, const Hsv_Planes *hsv, AABB roi, Vec2 *pos, float *confidence)
+{
+    float r_str;
+    int r_i;
+    _scan_for_dot(fmt, hsv, roi, &r_i, &r_str);
+
+    if (r_i == -1)
+    {
+        *pos = (Vec2){0,0};
+        *confidence = -1;
+        return -1;
+    }
 
-            if (fmt->greyscale == 1.0f)
+    *pos = (Vec2){r_i % fmt->width, r_i / fmt->width};
+    *confidence = r_str;
+    return 0;
+}
+
+/// @brief Rows converted to HSV in even slices.
+typedef struct Hsv_Task
+{
+    const Img_Fmt *fmt;
+    const RGB *rgb;
+    const Hsv_Planes *hsv;
+    AABB roi;
+} Hsv_Task;
+
+void _convert_hsv_task(void *arg, int t_id, int t_count)
+{
+    Hsv_Task *task = (Hsv_Task*)arg;
+    int 
+        row_c = task->roi.s - task->roi.n,
+        start_row = task->roi.n + row_c * t_id / t_count,
+        end_row = task->roi.n + row_c * (t_id + 1) / t_count;
+
+    for (int y = start_row; y < end_row; y++)
+        _row_to_hsv(task->fmt, task->rgb, task->hsv, y, 0, task->fmt->width);
+}
+
+/// @brief Converts the rows of roi to HSV on thread_count threads.
+void _roi_to_hsv(const Img_Fmt *fmt, const RGB *rgb, AABB roi, const Hsv_Planes *hsv)
+{
+    Hsv_Task task = {
+        .fmt = fmt,
+        .rgb = rgb,
+        .hsv = hsv,
+        .roi = roi
+    };
+    pool_run(STAGE_CONVERSION, fmt->thread_count, _convert_hsv_task, &task);
+}
+
+int find_laser_dot(const Img_Fmt *fmt, const RGB *rgb, AABB roi, Vec2 *pos, float *confidence)
+{
+    Hsv_Planes *hsv = _scratch_hsv(fmt);
+    if (hsv == NULL)
+    {
+        printf("Failed to allocate scan buffers!\n");
+        *pos = (Vec2){0,0};
+        *confidence = -1;
+        return -1;
+    }
+
+    _roi_to_hsv(fmt, rgb, roi, hsv);
+    return _find_laser_dot_hsv(fmt, hsv, roi, pos, confidence);
+}
+
+
+/// @brief HSV values of every Y & quantized U & V, indexed by _ycc_lut_index, 3 bytes each quantized like Hsv_Planes.
+static unsigned char *ycc_lut;
+static pthread_once_t ycc_lut_once = PTHREAD_ONCE_INIT;
+
+static inline int _ycc_lut_index(unsigned char y, unsigned char u, unsigned char v)
+{
+    return (y << (YCC_LUT_CHROMA_BITS * 2)) | 
+        ((u >> (8 - YCC_LUT_CHROMA_BITS)) << YCC_LUT_CHROMA_BITS) | 
+        (v >> (8 - YCC_LUT_CHROMA_BITS));
+}
+
+/// @brief Fills the table, converting the center of every U & V range the same way as the RGB conversions.
+void _build_ycc_lut()
+{
+    const int levels = 1 << YCC_LUT_CHROMA_BITS;
+    const int half_step = 1 << (7 - YCC_LUT_CHROMA_BITS);
+
+    ycc_lut = malloc((size_t)256 * levels * levels * 3);
+    if (ycc_lut == NULL)
+        return;
+
+    for (int y = 0; y < 256; y++)
+    {
+        for (int u = 0; u < 256; u += half_step * 2)
+        {
+            for (int v = 0; v < 256; v += half_step * 2)
             {
-                str = MAX(str - fmt->dot_threshold, 0.0f);
-                unsigned char brightness = (unsigned char)CLAMP((str / (str + 10.0f)) * 255.0f, 0.0f, 255.0f);
-                //unsigned char brightness = (unsigned char)(sqrtf(str) * 255.0f);
-                rgb[i] = (RGB){
-                    .R = brightness, 
-                    .G = brightness, 
-                    .B = brightness 
-                };
+                RGB pair[2];
+                _yuyv_to_rgb(y, u + half_step, y, v + half_step, pair);
+                HSV hsv = rgb_to_hsv(pair[0]);
+                unsigned char *entry = &ycc_lut[_ycc_lut_index(y, u, v) * 3];
+                entry[0] = HSV_QUANTIZE_H(hsv.H);
+                entry[1] = HSV_QUANTIZE_SV(hsv.S);
+                entry[2] = HSV_QUANTIZE_SV(hsv.V);
             }
-            else
+        }
+    }
+}
+
+/// @brief Looks up the HSV values of rows of Y, U & V planes, in place of converting them to RGB & then HSV.
+/// @param chroma_shift 0 if the U & V planes have a row for every row of Y (4:2:2), 1 for every other row (4:2:0).
+void _planes_to_hsv(const unsigned char *col_y, const unsigned char *col_u, const unsigned char *col_v,
+    int width, int start_row, int end_row, int chroma_shift, const Hsv_Planes *hsv)
+{
+    for (int row = start_row; row < end_row; row++)
+    {
+        const unsigned char 
+            *row_y = col_y + row * width,
+            *row_u = col_u + (row >> chroma_shift) * width / 2,
+            *row_v = col_v + (row >> chroma_shift) * width / 2;
+        unsigned char 
+            *row_h = hsv->h + row * hsv->pitch,
+            *row_s = hsv->s + row * hsv->pitch,
+            *row_val = hsv->v + row * hsv->pitch;
+
+        for (int i = 0; i < width; i++)
+        {
+            const unsigned char *entry = &ycc_lut[_ycc_lut_index(row_y[i], row_u[i / 2], row_v[i / 2]) * 3];
+            row_h[i] = entry[0];
+            row_s[i] = entry[1];
+            row_val[i] = entry[2];
+        }
+    }
+}
+
+int find_laser_dot_ycc(
+    const Img_Fmt *fmt, unsigned char *mjpeg, unsigned int mjpeg_size, 
+    AABB roi, bool cropped, bool draw, 
+    RGB *rgb, Vec2 *pos, float *confidence)
+{
+    *pos = (Vec2){0,0};
+    *confidence = -1;
+
+    pthread_once(&ycc_lut_once, _build_ycc_lut);
+    Hsv_Planes *hsv = _scratch_hsv(fmt);
+    if (ycc_lut == NULL || hsv == NULL)
+    {
+        printf("Failed to allocate scan buffers!\n");
+        return -1;
+    }
+
+    unsigned char *planes[3];
+    int chroma_shift;
+    if (_decode_mjpeg_roi(mjpeg, mjpeg_size, roi, cropped, fmt, planes, &chroma_shift) == -1)
+        return -1;
+
+    timer_begin_measure(T_CONVERSION);
+    Hsv_Planes roi_hsv = _hsv_from_row(hsv, roi.n);
+    Planes_Task task = {
+        .planes = { planes[0], planes[1], planes[2] },
+        .width = fmt->width,
+        .row_count = roi.s - roi.n,
+        .chroma_shift = chroma_shift,
+        .hsv = &roi_hsv,
+        // The window still shows the frame itself.
+        .rgb = draw ? rgb + roi.n * fmt->width : NULL
+    };
+    pool_run(STAGE_CONVERSION, fmt->thread_count, _convert_planes_task, &task);
+    timer_end_measure(T_CONVERSION);
+
+    return _find_laser_dot_hsv(fmt, hsv, roi, pos, confidence);
+}
+
+
+/// @brief A frame that is converted band by band while it is decoded, & scored in chunks of rows
+/// as soon as the rows within scan_rad of them are converted.
+typedef struct Band_Stream
+{
+    const Img_Fmt *fmt;
+    unsigned char *mjpeg;
+    unsigned int mjpeg_size;
+    jpeg_decoder *decoder;
+    int ctype, height;
+    int result;
+    AABB roi;
+    int first_row; // Full-frame row of the first decoded row, the top of roi for frames cropped at the sensor.
+    unsigned char *planes[3];
+    int chroma_shift;
+    bool lut, draw;
+    RGB *rgb;
+    const Hsv_Planes *hsv;
+
+    pthread_mutex_t lock;
+    pthread_cond_t converted_cond;
+    int converted; // Full-frame row up to which hsv is filled.
+    bool decoded; // Set once decoding has ended, whether it succeeded or not.
+    int next_chunk;
+
+    // Decoding on a single thread, the decoding thread scores every chunk as soon as it can, into these.
+    bool inline_scan;
+    float *best_str;
+    int *best_i;
+} Band_Stream;
+
+/// @brief Converts full-frame rows of the decoded planes to HSV, & to RGB if needed.
+void _convert_band(Band_Stream *stream, int start_row, int end_row)
+{
+    const int width = stream->fmt->width;
+    const int plane_start = start_row - stream->first_row;
+    const int plane_end = end_row - stream->first_row;
+    unsigned char **planes = stream->planes;
+    RGB *rgb = stream->rgb + stream->first_row * width;
+
+    if (stream->lut)
+    {
+        Hsv_Planes frame_hsv = _hsv_from_row(stream->hsv, stream->first_row);
+        _planes_to_hsv(planes[0], planes[1], planes[2], width, plane_start, plane_end, stream->chroma_shift, &frame_hsv);
+        if (stream->draw)
+            _planes_to_rgb(planes[0], planes[1], planes[2], width, plane_start, plane_end, stream->chroma_shift, rgb);
+        return;
+    }
+
+    _planes_to_rgb(planes[0], planes[1], planes[2], width, plane_start, plane_end, stream->chroma_shift, rgb);
+    for (int y = start_row; y < end_row; y++)
+        _row_to_hsv(stream->fmt, stream->rgb, stream->hsv, y, 0, width);
+}
+
+/// @brief Scores chunks of rows until none are left, or until the next one is not converted yet.
+/// @param wait Whether to wait for the rows of the next chunk to be converted, instead of returning.
+void _scan_bands(Band_Stream *stream, bool wait, float *res_str, int *res_i)
+{
+    const Img_Fmt *fmt = stream->fmt;
+    const AABB roi = stream->roi;
+    const Scan_Filter filter = _scan_filter(fmt);
+
+    while (true)
+    {
+        int start_row, end_row;
+        bool ready;
+
+        pthread_mutex_lock(&stream->lock);
+        while (true)
+        {
+            start_row = roi.n + stream->next_chunk * BAND_SCAN_ROWS;
+            end_row = MIN(start_row + BAND_SCAN_ROWS, (int)roi.s);
+            // Pixels are scored on the rows up to scan_rad below them.
+            int needed_row = MIN(end_row + (int)fmt->scan_rad, (int)roi.s);
+
+            ready = start_row < (int)roi.s && stream->converted >= needed_row;
+            if (ready || !wait || stream->decoded || start_row >= (int)roi.s)
+                break;
+            pthread_cond_wait(&stream->converted_cond, &stream->lock);
+        }
+        if (ready)
+            stream->next_chunk++;
+        pthread_mutex_unlock(&stream->lock);
+
+        if (!ready)
+            return;
+
+        for (int y = start_row; y < end_row; y++)
+        {
+            for (int x = _next_candidate(&filter, stream->hsv, y, 0, fmt->width); x < (int)fmt->width; 
+                x = _next_candidate(&filter, stream->hsv, y, x + 1, fmt->width))
+            {
+                x += _compare_strength(
+                    fmt, stream->hsv, roi, x, y, 
+                    res_str, res_i, 
+                    NULL
+                );
+            }
+        }
+    }
+}
+
+/// @brief Called by the decoder after every band of rows, converts the new rows of roi.
+void _band_decoded(int rows, void *user)
+{
+    Band_Stream *stream = (Band_Stream*)user;
+
+    // Only the decoding thread writes converted.
+    const int start_row = stream->converted;
+    const int end_row = MIN(stream->first_row + rows, (int)stream->roi.s);
+    if (end_row <= start_row)
+        return;
+
+    _convert_band(stream, start_row, end_row);
+
+    pthread_mutex_lock(&stream->lock);
+    stream->converted = end_row;
+    pthread_cond_broadcast(&stream->converted_cond);
+    pthread_mutex_unlock(&stream->lock);
+
+    // The band is still in cache.
+    if (stream->inline_scan)
+        _scan_bands(stream, false, &stream->best_str[0], &stream->best_i[0]);
+}
+
+void _band_stream_task(void *arg, int t_id, int t_count)
+{
+    Band_Stream *stream = (Band_Stream*)arg;
+    stream->best_str[t_id] = -1.0f;
+    stream->best_i[t_id] = -1;
+
+    // The first slot decodes & converts, the others score the converted rows in the meantime.
+    // It always runs on the calling thread, the decoder belongs to it.
+    if (t_id == 0)
+    {
+        stream->result = decode_jpeg_raw_bands(
+            stream->decoder, stream->mjpeg, stream->mjpeg_size, stream->ctype, stream->fmt->width, stream->height, 
+            stream->planes[0], stream->planes[1], stream->planes[2], 
+            _band_decoded, stream);
+
+        pthread_mutex_lock(&stream->lock);
+        stream->decoded = true;
+        pthread_cond_broadcast(&stream->converted_cond);
+        pthread_mutex_unlock(&stream->lock);
+    }
+
+    _scan_bands(stream, true, &stream->best_str[t_id], &stream->best_i[t_id]);
+}
+
+int find_laser_dot_bands(
+    const Img_Fmt *fmt, unsigned char *mjpeg, unsigned int mjpeg_size, 
+    AABB roi, bool cropped, bool draw, 
+    RGB *rgb, Vec2 *pos, float *confidence)
+{
+    *pos = (Vec2){0,0};
+    *confidence = -1;
+
+    const bool lut = fmt->ycc_detector == 1.0f;
+    if (lut)
+        pthread_once(&ycc_lut_once, _build_ycc_lut);
+
+    jpeg_decoder *decoder = _scratch_decoder();
+    unsigned char *col_y = _scratch_yuv(fmt);
+    Hsv_Planes *hsv = _scratch_hsv(fmt);
+    if (decoder == NULL || col_y == NULL || hsv == NULL || (lut && ycc_lut == NULL))
+    {
+        printf("Failed to allocate scan buffers!\n");
+        return -1;
+    }
+
+    const int thread_count = MAX(1, (int)fmt->thread_count);
+    float best_str[thread_count];
+    int best_i[thread_count];
+
+    const int ctype = jpeg_native_chroma(mjpeg, mjpeg_size);
+    Band_Stream stream = {
+        .fmt = fmt,
+        .mjpeg = mjpeg,
+        .mjpeg_size = mjpeg_size,
+        .decoder = decoder,
+        .ctype = ctype,
+        .height = cropped ? roi.s - roi.n : fmt->height,
+        .roi = roi,
+        .first_row = cropped ? roi.n : 0,
+        .planes = { col_y, col_y + fmt->size, col_y + fmt->size * 2 },
+        .chroma_shift = (ctype == Y4M_CHROMA_422) ? 0 : 1,
+        .lut = lut,
+        .draw = draw,
+        .rgb = rgb,
+        .hsv = hsv,
+        .converted = roi.n,
+        .inline_scan = thread_count == 1,
+        .best_str = best_str,
+        .best_i = best_i
+    };
+    pthread_mutex_init(&stream.lock, NULL);
+    pthread_cond_init(&stream.converted_cond, NULL);
+
+    timer_begin_measure(T_SCAN);
+    pool_run(STAGE_BANDS, thread_count, _band_stream_task, &stream);
+    timer_end_measure(T_SCAN);
+    int result = stream.result;
+
+    pthread_cond_destroy(&stream.converted_cond);
+    pthread_mutex_destroy(&stream.lock);
+
+    if (result != 0)
+        printf("Error in decode_jpeg_raw: %d\n",result);
+    if (result == -1)
+        return -1;
+
+    float r_str = -1.0f;
+    int r_i = -1;
+    for (int i = 0; i < thread_count; i++)
+    {
+        if (best_str[i] > r_str)
+        {
+            r_str = best_str[i];
+            r_i = best_i[i];
+        }
+    }
+
+    if (r_i == -1)
+        return -1;
+
+    *pos = (Vec2){r_i % fmt->width, r_i / fmt->width};
+    *confidence = r_str;
+    return 0;
+}
+
+
+/// @brief A bright spot of the coarse image, in coarse pixels.
+typedef struct Coarse_Candidate
+{
+    int x, y;
+    int prominence; // How much brighter it is than its surroundings.
+} Coarse_Candidate;
+
+/// @brief Converts a single pixel, the same way as the full-frame conversions.
+RGB _ycc_to_rgb(const unsigned char *ycc)
+{
+    RGB pair[2];
+    _yuyv_to_rgb(ycc[0], ycc[1], ycc[0], ycc[2], pair);
+    return pair[0];
+}
+
+/// @brief Brightness of a coarse pixel, its largest channel like the V of HSV.
+int _coarse_brightness(const unsigned char *coarse, int width, int x, int y)
+{
+    RGB px = _ycc_to_rgb(&coarse[(y * width + x) * 3]);
+    return MAX(px.R, MAX(px.G, px.B));
+}
+
+/// @brief Finds the coarse pixels that stand out the most from their surroundings, most prominent first.
+/// A dot only covers part of a coarse pixel, so it is found by contrast rather than by brightness alone.
+/// @param first_row Rows above it are outside of the region of interest.
+/// @return The amount of candidates found, up to COARSE_CANDIDATES.
+int _find_coarse_candidates(const unsigned char *coarse, int width, int height, int first_row, Coarse_Candidate candidates[])
+{
+    int candidate_c = 0;
+
+    for (int y = first_row; y < height; y++)
+    {
+        for (int x = 0; x < width; x++)
+        {
+            int brightness = _coarse_brightness(coarse, width, x, y);
+            int surrounding = 0, surrounding_c = 0;
+
+            for (int o_y = MAX(y - 1, first_row); o_y <= MIN(y + 1, height - 1); o_y++)
             {
-                rgb[i] = (RGB){
-                    .R = (unsigned char)(out_hsv.H * 255.0f), 
-                    .G = (unsigned char)(out_hsv.S * 255.0f), 
-                    .B = (unsigned char)(out_hsv.V * 255.0f) 
-                };
+                for (int o_x = MAX(x - 1, 0); o_x <= MIN(x + 1, width - 1); o_x++)
+                {
+                    if (o_x == x && o_y == y)
+                        continue;
+
+                    surrounding += _coarse_brightness(coarse, width, o_x, o_y);
+                    surrounding_c++;
+                }
             }
 
-            i += skip;
+            int prominence = brightness - surrounding / MAX(1, surrounding_c);
+            if (prominence <= 0 || 
+                (candidate_c == COARSE_CANDIDATES && prominence <= candidates[candidate_c - 1].prominence))
+                continue;
+
+            // Insert sorted, dropping the least prominent candidate if full.
+            int i = MIN(candidate_c, COARSE_CANDIDATES - 1);
+            for (; i > 0 && candidates[i - 1].prominence < prominence; i--)
+                candidates[i] = candidates[i - 1];
+
+            candidates[i] = (Coarse_Candidate){ x, y, prominence };
+            candidate_c = MIN(candidate_c + 1, COARSE_CANDIDATES);
         }
     }
+
+    return candidate_c;
 }
 
+/// @brief Decodes regions of an MJPEG frame at full size & scores their pixels like a full scan would.
+/// Pixels sample their surroundings up to scan_rad away, so a margin around the regions is decoded as well.
+/// @param frame_top The full-frame row of the frame's first row, if it was cropped at the sensor.
+/// @param scored Regions in full-frame pixels, inside of roi.
+int _score_jpeg_regions(
+    const Img_Fmt *fmt, unsigned char *mjpeg, unsigned int mjpeg_size, 
+    AABB roi, int frame_top, const AABB scored[], int region_c, 
+    RGB *rgb, int *res_i, float *res_str)
+{
+    const int width = fmt->width;
+    const int margin = (int)ceilf(fmt->scan_rad) + 1;
 
-int find_laser_dot(const Img_Fmt *fmt, const RGB *rgb, Vec2 *pos, float *confidence)
+    *res_str = -1.0f;
+    *res_i = -1;
+
+    jpeg_decoder *decoder = _scratch_decoder();
+    Hsv_Planes *hsv = _scratch_hsv(fmt);
+    if (decoder == NULL || hsv == NULL)
+    {
+        printf("Failed to allocate scan buffers!\n");
+        return -1;
+    }
+
+    AABB decoded[COARSE_CANDIDATES];
+    int rows[COARSE_CANDIDATES * 2];
+    int row_c = 0;
+    int x0 = width, x1 = 0;
+
+    region_c = MIN(region_c, COARSE_CANDIDATES);
+    for (int i = 0; i < region_c; i++)
+    {
+        decoded[i] = (AABB){
+            .w = MAX(0, scored[i].w - margin),
+            .n = MAX((int)roi.n, scored[i].n - margin),
+            .e = MIN(width, scored[i].e + margin),
+            .s = MIN((int)roi.s, scored[i].s + margin)
+        };
+
+        x0 = MIN(x0, decoded[i].w);
+        x1 = MAX(x1, decoded[i].e);
+
+        // Keep the row ranges sorted, in rows of the frame.
+        int j = row_c;
+        for (; j > 0 && rows[(j - 1) * 2] > decoded[i].n - frame_top; j--)
+        {
+            rows[j * 2] = rows[(j - 1) * 2];
+            rows[j * 2 + 1] = rows[(j - 1) * 2 + 1];
+        }
+        rows[j * 2] = decoded[i].n - frame_top;
+        rows[j * 2 + 1] = decoded[i].s - frame_top;
+        row_c++;
+    }
+
+    // Merge overlapping row ranges.
+    int merged_c = 0;
+    for (int i = 0; i < row_c; i++)
+    {
+        if (merged_c > 0 && rows[i * 2] <= rows[(merged_c - 1) * 2 + 1])
+        {
+            rows[(merged_c - 1) * 2 + 1] = MAX(rows[(merged_c - 1) * 2 + 1], rows[i * 2 + 1]);
+            continue;
+        }
+        rows[merged_c * 2] = rows[i * 2];
+        rows[merged_c * 2 + 1] = rows[i * 2 + 1];
+        merged_c++;
+    }
+
+    // The regions are decoded to YCbCr in place, then converted.
+    timer_begin_measure(DECODE);
+    int result = decode_jpeg_regions(
+        decoder, mjpeg, mjpeg_size, width, 
+        &x0, &x1, rows, merged_c, 
+        (unsigned char*)&rgb[frame_top * width]);
+    timer_end_measure(DECODE);
+
+    if (result == -1)
+    {
+        printf("Error in decode_jpeg_regions: %d\n", result);
+        return -1;
+    }
+
+    for (int r = 0; r < merged_c; r++)
+    {
+        for (int y = frame_top + rows[r * 2]; y < frame_top + rows[r * 2 + 1]; y++)
+            for (int x = x0; x < x1; x++)
+                rgb[y * width + x] = _ycc_to_rgb((unsigned char*)&rgb[y * width + x]);
+    }
+
+    timer_begin_measure(T_SCAN);
+    const Scan_Filter filter = _scan_filter(fmt);
+    for (int c = 0; c < region_c; c++)
+    {
+        for (int y = decoded[c].n; y < decoded[c].s; y++)
+            _row_to_hsv(fmt, rgb, hsv, y, decoded[c].w, decoded[c].e);
+
+        for (int y = scored[c].n; y < scored[c].s; y++)
+        {
+            for (int x = _next_candidate(&filter, hsv, y, scored[c].w, scored[c].e); x < (int)scored[c].e; 
+                x = _next_candidate(&filter, hsv, y, x + 1, scored[c].e))
+            {
+                x += _compare_strength(
+                    fmt, hsv, roi, x, y, 
+                    res_str, res_i, 
+                    NULL
+                );
+            }
+        }
+    }
+    timer_end_measure(T_SCAN);
+
+    return 0;
+}
+
+int find_laser_dot_coarse(
+    const Img_Fmt *fmt, unsigned char *mjpeg, unsigned int mjpeg_size, 
+    AABB roi, bool cropped, bool draw, 
+    RGB *rgb, Vec2 *pos, float *confidence)
 {
-    HSV hsv[fmt->size];
-    for (int i = 0; i < fmt->size; i++)
+    *pos = (Vec2){0,0};
+    *confidence = -1;
+
+    jpeg_decoder *decoder = _scratch_decoder();
+    unsigned char *coarse = _scratch_yuv(fmt);
+    if (decoder == NULL || coarse == NULL)
+    {
+        printf("Failed to allocate scan buffers!\n");
+        return -1;
+    }
+
+    const int width = fmt->width;
+    const int scale = 1 << CLAMP((int)fmt->coarse_scale, 1, 3);
+    const int frame_top = cropped ? roi.n : 0; // The full-frame row of the frame's first row.
+
+    // Pass 1: decode at a fraction of the size.
+    int coarse_width, coarse_height;
+    timer_begin_measure(DECODE);
+    int result = decode_jpeg_scaled(
+        decoder, mjpeg, mjpeg_size, scale, 
+        &coarse_width, &coarse_height, 
+        coarse, fmt->size * 3);
+    timer_end_measure(DECODE);
+
+    if (result == -1)
+    {
+        printf("Error in decode_jpeg_scaled: %d\n", result);
+        return -1;
+    }
+
+    Coarse_Candidate candidates[COARSE_CANDIDATES];
+    int candidate_c = _find_coarse_candidates(
+        coarse, coarse_width, coarse_height, 
+        (roi.n - frame_top) / scale, candidates);
+
+    // The window shows the coarse image, with the candidates' surroundings at full resolution.
+    if (draw)
+    {
+        for (int y = roi.n; y < roi.s; y++)
+        {
+            const unsigned char *coarse_row = &coarse[MIN((y - frame_top) / scale, coarse_height - 1) * coarse_width * 3];
+            for (int x = 0; x < width; x++)
+                rgb[y * width + x] = _ycc_to_rgb(&coarse_row[(x / scale) * 3]);
+        }
+    }
+
+    if (candidate_c == 0)
+        return -1;
+
+    // Pass 2: decode the block of every candidate & the blocks around it at full size.
+    AABB scored[COARSE_CANDIDATES];
+    for (int i = 0; i < candidate_c; i++)
     {
-        hsv[i] = rgb_to_hsv(rgb[i]);
+        scored[i] = (AABB){
+            .w = MAX(0, (candidates[i].x - 1) * scale),
+            .n = MAX((int)roi.n, frame_top + (candidates[i].y - 1) * scale),
+            .e = MIN(width, (candidates[i].x + 2) * scale),
+            .s = MIN((int)roi.s, frame_top + (candidates[i].y + 2) * scale)
+        };
     }
 
     float r_str;
     int r_i;
-    _scan_for_dot(fmt, hsv, &r_i, &r_str);
+    if (_score_jpeg_regions(fmt, mjpeg, mjpeg_size, roi, frame_top, scored, candidate_c, rgb, &r_i, &r_str) == -1)
+        return -1;
+
+    if (r_i == -1)
+        return -1;
+
+    *pos = (Vec2){r_i % width, r_i / width};
+    *confidence = r_str;
+    return 0;
+}
+
+int find_laser_dot_window(
+    const Img_Fmt *fmt, unsigned char *mjpeg, unsigned int mjpeg_size, 
+    AABB roi, bool cropped, AABB window, 
+    RGB *rgb, Vec2 *pos, float *confidence)
+{
+    *pos = (Vec2){0,0};
+    *confidence = -1;
+
+    const int frame_top = cropped ? roi.n : 0;
+    window.n = MAX(window.n, roi.n);
+    window.s = MIN(window.s, roi.s);
+    window.e = MIN(window.e, fmt->width);
+    if (window.n >= window.s || window.w >= window.e)
+        return -1;
+
+    float r_str;
+    int r_i;
+    if (_score_jpeg_regions(fmt, mjpeg, mjpeg_size, roi, frame_top, &window, 1, rgb, &r_i, &r_str) == -1)
+        return -1;
 
     if (r_i == -1)
-    {
-        *pos = (Vec2){0,0};
-        *confidence = -1;
         return -1;
-    }
 
     *pos = (Vec2){r_i % fmt->width, r_i / fmt->width};
     *confidence = r_str;
@@ -394,12 +1751,12 @@ int draw_box(const Img_Fmt *fmt, RGB *rgb, AABB box, int w, RGB col)
     // Ensure that the line-width does not exceed the size of the aabb.
     w = CLAMP(w, 1, MIN((box.e - box.w) / 2, (box.s - box.n) / 2));
 
-    #pragma omp parallel num_threads(4)
+    // The edges are a few thousand pixels at most, waking up threads for them costs more than it saves.
+    for (int edge = 0; edge < 4; edge++)
     {
-        unsigned int t_id = omp_get_thread_num();
         Vec2 top_left, bot_right;
 
-        switch (t_id)
+        switch (edge)
         {
         case 0: // Fill in northern edge.
             top_left =  (Vec2){ .x = box.w,      .y = box.n     };
@@ -439,14 +1796,13 @@ int draw_box(const Img_Fmt *fmt, RGB *rgb, AABB box, int w, RGB col)
 }
 
 
-int apply_img_effects(const Img_Fmt *fmt, RGB *rgb)
+int apply_img_effects(const Img_Fmt *fmt, RGB *rgb, AABB roi)
 {
-    HSV hsv[fmt->size];
-    for (int i = 0; i < fmt->size; i++)
-    {
-        hsv[i] = rgb_to_hsv(rgb[i]);
-    }
+    Hsv_Planes *hsv = _scratch_hsv(fmt);
+    if (hsv == NULL)
+        return -1;
 
-    _visualize_pixel_strengths(fmt, rgb, hsv);
+    _roi_to_hsv(fmt, rgb, roi, hsv);
+    _visualize_pixel_strengths(fmt, rgb, hsv, roi);
     return 0;
 }
@@ -0,0 +1,46 @@
+#ifndef INCLUDE_BUFFER_ARENA_H
+#define INCLUDE_BUFFER_ARENA_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+
+#define ARENA_MAX_BLOCKS 32
+
+
+/// @brief Equally sized, page aligned blocks of application-owned memory.
+/// Either one anonymous mapping (optionally backed by huge pages) or one DMA-BUF per block.
+typedef struct Buffer_Arena
+{
+    unsigned char *mem; // The mapping holding all blocks, NULL for DMA-BUF arenas.
+    size_t mapped_size;
+    size_t block_size; // Size of each block, rounded up to whole pages.
+    unsigned int block_count;
+
+    bool hugepages; // Whether the mapping is backed by huge pages (explicit or transparent).
+    bool dmabuf;
+
+    unsigned char *blocks[ARENA_MAX_BLOCKS];
+    int dmabuf_fds[ARENA_MAX_BLOCKS]; // -1 unless the arena is made of DMA-BUFs.
+} Buffer_Arena;
+
+
+/// @brief Allocates block_count blocks of at least block_size bytes from one anonymous mapping.
+/// @param hugepages Tries explicit huge pages first, then transparent huge pages.
+int arena_init(Buffer_Arena *arena, size_t block_size, unsigned int block_count, bool hugepages);
+
+/// @brief Allocates every block as its own DMA-BUF from the system DMA heap, mapped for CPU access.
+int arena_init_dmabuf(Buffer_Arena *arena, size_t block_size, unsigned int block_count);
+
+/// @brief Whether the arena can hold block_count blocks of block_size bytes without reallocating.
+bool arena_fits(const Buffer_Arena *arena, size_t block_size, unsigned int block_count);
+
+/// @brief Makes a block coherent for reading by the CPU. Only needed for DMA-BUF arenas.
+int arena_begin_access(Buffer_Arena *arena, unsigned int block);
+
+/// @brief Hands a block back to the device after arena_begin_access.
+int arena_end_access(Buffer_Arena *arena, unsigned int block);
+
+void arena_free(Buffer_Arena *arena);
+
+#endif
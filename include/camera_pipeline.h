@@ -0,0 +1,91 @@
+#ifndef INCLUDE_CAMERA_PIPELINE_H
+#define INCLUDE_CAMERA_PIPELINE_H
+
+#include "img_data.h"
+#include "aabb.h"
+#include "webcam_handler.h"
+
+#include <stdbool.h>
+
+
+#define MAX_CAMERAS 4
+
+
+typedef enum Direction
+{
+    DIR_IDLE,
+    DIR_LEFT,
+    DIR_RIGHT,
+    DIR_FORWARD,
+    DIR_BACK
+} Direction;
+
+typedef struct Detection
+{
+    int camera; // Index of the camera the frame came from.
+    unsigned int frame_num; // Amount of frames processed by the camera before this one.
+    unsigned int sequence; // The driver's sequence number of the frame.
+    double capture_time; // When the frame was captured, in CLOCK_MONOTONIC seconds.
+    Vec2 pos; // Position of the strongest dot candidate.
+    float confidence; // Strength above dot_threshold. Only a detection if positive.
+    Direction direction; // The decision made from the dot position.
+} Detection;
+
+/// @brief Follows a found dot from frame to frame, so that MJPEG frames only need a window around it decoded.
+typedef struct Dot_Tracker
+{
+    Vec2 pos; // Where the dot was last found.
+    Vec2 velocity; // How far it moved between the last two frames it was found in.
+    bool tracking; // Set while the dot was found in the last frame.
+    unsigned int frames_since_full; // Frames decoded only partially since the last full decode.
+} Dot_Tracker;
+
+/// @brief How far detections were off from the dots drawn by a synthetic camera.
+typedef struct Detection_Error
+{
+    unsigned int frame_count;
+    unsigned int detected_count; // Frames where a dot was drawn & detected.
+    unsigned int miss_count; // Frames where a dot was drawn but not detected.
+    unsigned int false_count; // Frames where no dot was drawn but one was detected.
+    double total; // Sum of the distances to the nearest dot, in pixels.
+    float max;
+} Detection_Error;
+
+
+/// @brief Decodes a frame, scans it for a laser dot & decides which direction to go.
+/// @param draw Whether to draw the detection overlay into rgb.
+/// @param tracker Follows the dot between frames of the same camera if track_radius is set. May be NULL.
+int process_image(const Img_Fmt *fmt, Webcam *cam, Frame *frame, RGB *rgb, bool draw, Dot_Tracker *tracker, Detection *detection);
+
+const char *direction_name(Direction direction);
+
+/// @brief Adds a detection to the stream shared by all cameras.
+int publish_detection(const Detection *detection);
+
+/// @brief Takes the oldest detection from the shared stream.
+/// @return 1 if a detection was taken, 0 if the stream is empty.
+int poll_detection(Detection *detection);
+
+/// @brief Starts processing a camera on a background thread.
+/// @param camera_c The total amount of cameras, used to share thread_count between them.
+int pipeline_start(Webcam *cam, int camera, int camera_c, const Img_Fmt *fmt);
+
+/// @brief Stops all background pipelines. Their cameras are left open.
+int pipeline_stop_all();
+
+/// @brief Must be held while changing the settings passed to pipeline_start, as pipelines copy them every frame.
+void pipeline_lock_settings();
+
+void pipeline_unlock_settings();
+
+/// @brief Measures the aggregate frame rate when running 1 to device_c cameras at once.
+/// For synthetic cameras, the detection error is measured as well.
+int pipeline_benchmark(const char *devices[], int device_c, const Img_Fmt *fmt, float seconds);
+
+/// @brief Measures the MJPEG decode throughput of 1 to all CPU cores, each decoding with its own decoder.
+/// Up to 64 frames are copied out of the device first, so the capture does not limit the measurement.
+/// Also compares decoding with a reused decoder to creating one for every frame, and decoding frames whole
+/// to splitting them at their restart markers.
+int decode_benchmark(const char *device, const Img_Fmt *fmt, float seconds);
+
+#endif
@@ -0,0 +1,36 @@
+#ifndef INCLUDE_HSV_CONVERT_H
+#define INCLUDE_HSV_CONVERT_H
+
+#include "img_data.h"
+
+
+/// @brief Picks the widest HSV kernel the CPU supports (AVX-512, AVX2, SSE2 or scalar), using cpuid.
+/// Called on first use otherwise.
+int hsv_convert_init();
+
+/// @brief Name of the kernel picked by hsv_convert_init.
+const char *hsv_kernel_name();
+
+/// @brief Converts count pixels like rgb_to_hsv into a row of Hsv_Planes, with the kernel picked by hsv_convert_init.
+/// @param h, s, v The first pixel of the row in every plane.
+/// @param lut Look up H, S & V in tables indexed by the 8-bit max, min & channel differences instead,
+/// within HSV_LUT_MAX_ERROR of rgb_to_hsv before quantizing. The tables are built on first use.
+void rgb_to_hsv_batch(const RGB *rgb, unsigned char *h, unsigned char *s, unsigned char *v, int count, bool lut);
+
+/// @brief Compares every kernel the CPU supports and the tables to rgb_to_hsv on all 2^24 colors, printing
+/// the largest difference of every channel before & after quantizing to Hsv_Planes, and measures how many
+/// pixels per second each converts into planes.
+/// @param seconds Time to measure each kernel for.
+/// @return 0 if all conversions are within their bound of rgb_to_hsv, -1 otherwise.
+int hsv_benchmark(float seconds);
+
+// Largest difference of H (in degrees), S or V to rgb_to_hsv that hsv_benchmark accepts.
+#define HSV_MAX_ERROR 1e-4f
+// Same for the tables. S & V are exact, the hue of the tables is rounded once from 60 * difference / (max - min),
+// which rgb_to_hsv computes from channels already rounded to floats.
+#define HSV_LUT_MAX_ERROR 1e-3f
+// Largest difference of the values read back from Hsv_Planes, half a step of the quantization.
+#define HSV_PLANE_MAX_ERROR_H (180.0f / 256.0f + HSV_MAX_ERROR)
+#define HSV_PLANE_MAX_ERROR_SV (0.5f / 255.0f + HSV_MAX_ERROR)
+
+#endif
@@ -25,7 +25,13 @@ typedef struct Img_Fmt
         dot_threshold, alt_weights, 
         h_str, s_str, v_str,
         h_white_penalty, h_white_falloff, h_white_curve,
-        compare_threading, thread_count;
+        compare_threading, thread_count, coarse_scale,
+        track_radius, track_refresh, ycc_detector, band_stream, hsv_lut,
+        buffer_count, queue_policy, capture_timeout,
+        pixel_format, target_fps, latency_target, decode_backend,
+        capture_memory, hugepages,
+        roi_top, sensor_crop, replay_speed,
+        benchmark, decode_benchmark, hsv_benchmark;
 } Img_Fmt;
 
 typedef struct RGB
@@ -42,6 +48,22 @@ typedef struct HSV
     float V; // Value (0-1)
 } HSV;
 
+/// @brief A frame of HSV values in one plane per channel, a byte per pixel each.
+typedef struct Hsv_Planes
+{
+    unsigned char *h; // Hue in steps of 360/256 degrees, wrapping around to 0.
+    unsigned char *s; // Saturation in steps of 1/255.
+    unsigned char *v; // Value in steps of 1/255, exact for values converted from RGB.
+    int pitch; // Bytes from the start of a row to the next, a multiple of HSV_PLANE_ALIGN.
+} Hsv_Planes;
+
+#define HSV_PLANE_ALIGN 64 // Every row of the planes starts on a cache line.
+
+#define HSV_QUANTIZE_H(h) ((unsigned char)((int)((h) * (256.0f / 360.0f) + 0.5f) & 255))
+#define HSV_QUANTIZE_SV(x) ((unsigned char)((x) * 255.0f + 0.5f))
+#define HSV_PLANE_H(q) ((q) * (360.0f / 256.0f))
+#define HSV_PLANE_SV(q) ((q) * (1.0f / 255.0f))
+
 
 HSV rgb_to_hsv(RGB rgb);
 
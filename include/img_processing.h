@@ -5,11 +5,47 @@
 #include "aabb.h"
 
 
-int mjpeg_to_rgb(unsigned char *mjpeg, unsigned int mjpeg_size, const Img_Fmt *format, RGB *rgb);
+/// @brief Converts the rows of roi into their place in the full-frame rgb. Rows outside of it are left untouched.
+/// @param cropped Set if the frame holds only the rows of roi, cropped at the sensor.
+int mjpeg_to_rgb(unsigned char *mjpeg, unsigned int mjpeg_size, AABB roi, bool cropped, const Img_Fmt *format, RGB *rgb);
+int yuyv_to_rgb(const unsigned char *yuyv, unsigned int size, unsigned int stride, AABB roi, bool cropped, const Img_Fmt *format, RGB *rgb);
+int nv12_to_rgb(const unsigned char *nv12, unsigned int size, unsigned int stride, AABB roi, bool cropped, const Img_Fmt *format, RGB *rgb);
 
 int draw_circle(const Img_Fmt *format, RGB *rgb, Vec2 pos, int r, int w, RGB col);
 int draw_box(const Img_Fmt *format, RGB *rgb, AABB box, int w, RGB col);
 
-int find_laser_dot(const Img_Fmt *fmt, const RGB *rgb, Vec2 *pos, float *confidence);
-int apply_img_effects(const Img_Fmt *format, RGB *rgb);
+/// @brief Scans the rows of roi for the strongest dot. The position is in full-frame pixels.
+int find_laser_dot(const Img_Fmt *fmt, const RGB *rgb, AABB roi, Vec2 *pos, float *confidence);
+/// @brief Scans the rows of roi of an MJPEG frame for the strongest dot, like find_laser_dot, but looks up the
+/// HSV values of the decoded Y, U & V planes in a table instead of converting them to RGB & then HSV.
+/// @param draw Whether to convert the frame into rgb as well, for display.
+int find_laser_dot_ycc(
+    const Img_Fmt *fmt, unsigned char *mjpeg, unsigned int mjpeg_size, 
+    AABB roi, bool cropped, bool draw, 
+    RGB *rgb, Vec2 *pos, float *confidence);
+/// @brief Scans an MJPEG frame like find_laser_dot_ycc, but converts every band of rows as soon as it is decoded,
+/// while it is still in cache, and scores the rows whose surroundings (scan_rad) are converted while the rest of
+/// the frame is still being decoded, on the other threads. Uses the YCbCr table if ycc_detector is set.
+int find_laser_dot_bands(
+    const Img_Fmt *fmt, unsigned char *mjpeg, unsigned int mjpeg_size, 
+    AABB roi, bool cropped, bool draw, 
+    RGB *rgb, Vec2 *pos, float *confidence);
+/// @brief Finds the dot in an MJPEG frame without decoding all of it. The frame is decoded at 1/2, 1/4 or 1/8
+/// of its size first (coarse_scale), then only the surroundings of its most prominent bright spots are decoded & scored.
+/// @param draw Whether to fill rgb with the coarse image, otherwise only the decoded surroundings are written.
+int find_laser_dot_coarse(
+    const Img_Fmt *fmt, unsigned char *mjpeg, unsigned int mjpeg_size, 
+    AABB roi, bool cropped, bool draw, 
+    RGB *rgb, Vec2 *pos, float *confidence);
+/// @brief Finds the dot in an MJPEG frame by decoding & scanning only a window of it, in full-frame pixels.
+/// Used to follow a dot that was already found.
+int find_laser_dot_window(
+    const Img_Fmt *fmt, unsigned char *mjpeg, unsigned int mjpeg_size, 
+    AABB roi, bool cropped, AABB window, 
+    RGB *rgb, Vec2 *pos, float *confidence);
+int apply_img_effects(const Img_Fmt *format, RGB *rgb, AABB roi);
+
+/// @brief Prints the average CPU time every slot of the multi-threaded scans spent scanning so far, 
+/// & how evenly the work was spread over them.
+int scan_report();
 #endif
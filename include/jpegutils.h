@@ -39,6 +39,18 @@
 #define 	Y4M_CHROMA_444ALPHA   7 /** 4:4:4 with an alpha channel */
 
  /*
+ * Decoder context, holding the decompressor and its row buffers.
+ * Decoders are not shared: every thread decoding at the same time needs its
+ * own, but any number of them can be used concurrently.
+ */
+
+typedef struct jpeg_decoder jpeg_decoder;
+
+jpeg_decoder *jpeg_decoder_create (void);
+void jpeg_decoder_destroy (jpeg_decoder *dec);
+
+ /*
+ * dec:             decoder context, see jpeg_decoder_create
  * jpeg_data:       buffer with input / output jpeg
  * len:             Length of jpeg buffer
  * itype:           Y4M_ILACE_NONE: Not interlaced
@@ -53,8 +65,86 @@
  * height           height of Y channel (height of U/V is height/2)
  */
 
-int decode_jpeg_raw (unsigned char *jpeg_data, int len,
+int decode_jpeg_raw (jpeg_decoder *dec, unsigned char *jpeg_data, int len,
                      int itype, int ctype, int width, int height,
                      unsigned char *raw0, unsigned char *raw1,
                      unsigned char *raw2);
+
+ /*
+ * Decodes a frame that is not interlaced like decode_jpeg_raw, calling
+ * band_done(rows, user) after every band of 8 or 16 rows with the amount of
+ * rows of the Y plane (and their U & V rows) that are complete, so they can
+ * be used while the rest of the frame is still being decoded.
+ */
+
+int decode_jpeg_raw_bands (jpeg_decoder *dec, unsigned char *jpeg_data, int len,
+                           int ctype, int width, int height,
+                           unsigned char *raw0, unsigned char *raw1,
+                           unsigned char *raw2,
+                           void (*band_done) (int rows, void *user), void *user);
+
+ /*
+ * Decodes a JPEG at 1/scale_denom (1, 2, 4 or 8) of its size into
+ * interleaved YCbCr. width & height receive the scaled size.
+ */
+
+int decode_jpeg_scaled (jpeg_decoder *dec, unsigned char *jpeg_data, int len, int scale_denom,
+                        int *width, int *height,
+                        unsigned char *ycc, int capacity);
+
+ /*
+ * Decodes only the given row ranges & columns of a JPEG at full size, into
+ * their place in an interleaved YCbCr image of the full size. The columns
+ * x0 to x1 are widened to whole blocks, as they were decoded.
+ * rows holds count pairs of first & end row, sorted and not overlapping.
+ */
+
+int decode_jpeg_regions (jpeg_decoder *dec, unsigned char *jpeg_data, int len, int width,
+                         int *x0, int *x1, const int *rows, int count,
+                         unsigned char *ycc);
+
+ /*
+ * A horizontal band of a frame that starts at a restart marker, so that it
+ * can be decoded on its own. Its header holds the tables of the frame, with
+ * the height of the part.
+ */
+
+#define JPEG_MAX_PARTS 16
+#define JPEG_PART_HEADER_MAX 1024
+
+typedef struct jpeg_part {
+   unsigned char header[JPEG_PART_HEADER_MAX];
+   int header_len;
+   const unsigned char *data;   /* entropy-coded data, points into the frame */
+   int data_len;
+   int first_row, end_row;      /* rows of the frame the part decodes to */
+} jpeg_part;
+
+ /*
+ * Returns the chroma type to decode a frame with, without resampling its
+ * chroma vertically: Y4M_CHROMA_420JPEG or Y4M_CHROMA_422.
+ */
+
+int jpeg_native_chroma (unsigned char *jpeg_data, int len);
+
+int split_jpeg_restarts (unsigned char *jpeg_data, int len, int max_parts,
+                         jpeg_part *parts);
+
+int decode_jpeg_part (jpeg_decoder *dec, const jpeg_part *part,
+                      int ctype, int width,
+                      unsigned char *raw0, unsigned char *raw1,
+                      unsigned char *raw2);
+
+ /*
+ * Decodes a frame into planes laid out like those of decode_jpeg_raw for
+ * ctype Y4M_CHROMA_422 or Y4M_CHROMA_420JPEG, using TurboJPEG if built with
+ * USE_TURBOJPEG (and -lturbojpeg). jpeg_turbo_available returns whether it was.
+ */
+
+int jpeg_turbo_available (void);
+
+int decode_jpeg_turbo (jpeg_decoder *dec, unsigned char *jpeg_data, int len,
+                       int ctype, int width, int height,
+                       unsigned char *raw0, unsigned char *raw1,
+                       unsigned char *raw2);
 #endif
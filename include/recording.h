@@ -0,0 +1,53 @@
+#ifndef INCLUDE_RECORDING_H
+#define INCLUDE_RECORDING_H
+
+#include "img_data.h"
+#include "webcam_handler.h"
+#include "input_handler.h"
+
+#include <stdbool.h>
+
+
+/// @brief Appends frames & settings changes to a recording file.
+/// The file holds the raw frames back to back, followed by an index written when closed.
+typedef struct Recorder Recorder;
+
+/// @brief Plays back a recording file, memory-mapped, as a frame source.
+typedef struct Replay Replay;
+
+
+/// @brief Creates a recording file. The initial value of every setting is recorded right away.
+int recorder_open(Recorder **rec, const char *path, const Img_Fmt *format, const Key_Mapping mappings[], int m_count);
+
+/// @brief Appends the raw bytes of a frame, with its capture timestamp & sequence number.
+int recorder_add_frame(Recorder *rec, const Frame *frame);
+
+/// @brief Records every setting that changed since the last call, applied from the next frame on.
+int recorder_add_settings(Recorder *rec, const Key_Mapping mappings[], int m_count);
+
+/// @brief Writes the index and closes the file. Recordings that were never closed cannot be replayed.
+int recorder_close(Recorder *rec);
+
+
+/// @brief Reads the frame size of a recording.
+int replay_probe(const char *path, unsigned int *width, unsigned int *height);
+
+/// @brief Opens a recording for playback.
+/// @param speed 1 plays back in real time, 0 as fast as possible, anything else scales the real time.
+int replay_open(Replay **replay, const char *path, const Img_Fmt *format, float speed);
+
+/// @brief Waits until the next recorded frame is due. Playback restarts after the last frame.
+/// @return 0 on success, -1 on failure.
+int replay_next_frame(Replay *replay);
+
+/// @brief Gets the frame acquired by replay_next_frame. Its data points into the mapped file.
+int replay_get_frame(Replay *replay, Frame *frame);
+
+int replay_close_frame(Replay *replay, Frame *frame);
+
+/// @brief Applies the settings changes recorded up to the current frame.
+int replay_apply_settings(Replay *replay, const Key_Mapping mappings[], int m_count);
+
+int replay_close(Replay *replay);
+
+#endif
@@ -0,0 +1,39 @@
+#ifndef INCLUDE_SYNTHETIC_CAMERA_H
+#define INCLUDE_SYNTHETIC_CAMERA_H
+
+#include "img_data.h"
+#include "webcam_handler.h"
+
+
+#define SYNTHETIC_MAX_DOTS 8
+
+
+typedef struct Synthetic_Dot
+{
+    float x, y; // Sub-pixel center of the dot.
+    float radius;
+    float intensity; // 0-1, blended over the background.
+} Synthetic_Dot;
+
+/// @brief Generates frames with laser dots at known positions, in place of a camera device.
+typedef struct Synthetic Synthetic;
+
+
+/// @brief Renders a loop of frames in the pixel format requested by format->pixel_format.
+/// @param spec "synthetic", optionally followed by ":name=value,..." options. For example:
+/// "synthetic:dots=2,radius=4,intensity=0.8,noise=6,whites=2,texture=1,frames=60,seed=1,speed=3,restart=1,chroma=420"
+int synthetic_open(Synthetic **syn, const char *spec, const Img_Fmt *format);
+
+/// @brief Acquires the next frame, paced to format->target_fps if set and as fast as possible otherwise.
+int synthetic_next_frame(Synthetic *syn);
+
+int synthetic_get_frame(Synthetic *syn, Frame *frame);
+
+int synthetic_close_frame(Synthetic *syn, Frame *frame);
+
+/// @brief The dots drawn into the acquired frame, strongest first.
+int synthetic_truth(Synthetic *syn, const Synthetic_Dot **dots, int *dot_c);
+
+int synthetic_close(Synthetic *syn);
+
+#endif
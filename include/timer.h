@@ -1,22 +1,30 @@
 #ifndef INCLUDE_TIMER_H
 #define INCLUDE_TIMER_H
 
-enum timer_type 
+enum timer_type
 {
 	FRAME = 1,
 	MANIPULATION = 2,
 	CONVERSION = 3,
     T_CONVERSION = 4,
 	SCAN = 5,
-    T_SCAN = 6
+    T_SCAN = 6,
+    DECODE = 7,
+
+    TIMER_TYPE_COUNT
 };
 
 
 int timer_begin_measure(enum timer_type type);
 int timer_end_measure(enum timer_type type);
 
+/// @brief Records the latency from a frame's capture to its decision being output, now.
+/// Gaps in a camera's sequence numbers are counted as dropped frames.
+/// @param capture_time When the frame was captured, in CLOCK_MONOTONIC seconds.
+int timer_record_latency(int camera, unsigned int sequence, double capture_time);
+
 int timer_init();
 int timer_quit();
 int timer_conclude();
 
-#endif
\ No newline at end of file
+#endif
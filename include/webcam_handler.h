@@ -2,16 +2,82 @@
 #define INCLUDE_WEBCAM_HANDLER_H
 
 #include "img_data.h"
+#include "aabb.h"
 
 
-int webcam_init(const Img_Fmt *format);
+typedef enum Queue_Policy
+{
+    QUEUE_LATEST = 0, // Always hand over the newest frame, requeueing frames that were never picked up.
+    QUEUE_NO_DROP = 1 // Hand over every captured frame in order. Used for recording & benchmarking.
+} Queue_Policy;
 
-int next_frame();
+typedef enum Pixel_Format
+{
+    PIX_AUTO = 0, // Let the camera handler pick the cheapest format to process.
+    PIX_MJPEG = 1, // JPEG compressed frames, decoded before conversion.
+    PIX_YUYV = 2, // Packed 4:2:2, Y0 U Y1 V.
+    PIX_NV12 = 3 // Planar 4:2:0, a Y plane followed by an interleaved UV plane.
+} Pixel_Format;
 
-int get_frame(unsigned char **mjpeg, unsigned int *mjpeg_size);
+typedef enum Capture_Memory
+{
+    CAPTURE_MMAP = 0, // Buffers allocated by the driver & mapped read-only.
+    CAPTURE_USERPTR = 1, // Buffers from an application-owned arena, optionally backed by huge pages.
+    CAPTURE_DMABUF = 2 // Buffers from application-owned DMA-BUFs, imported by the driver.
+} Capture_Memory;
 
-int close_frame();
+typedef struct Frame
+{
+    unsigned char *data; // Image data of the frame. Owned by the capture ring or its arena.
+    unsigned int size; // Amount of bytes used in data.
+    Pixel_Format format;
+    unsigned int stride; // Bytes per row of the (first) plane.
+    double timestamp; // When the frame was captured, in CLOCK_MONOTONIC seconds.
+    unsigned int sequence; // The driver's frame counter. Restarts when the device is recovered.
+    int slot; // The ring slot holding the frame, -1 if released.
+    AABB roi; // The region of the full frame to process. Always spans the full width.
+    bool cropped; // Set if data holds only the rows of roi, cropped by the sensor.
+} Frame;
 
-int webcam_close(const Img_Fmt *format);
+/// @brief Handle to an open camera: its device, negotiated format, buffer ring & capture thread.
+typedef struct Webcam Webcam;
+
+typedef struct Replay Replay;
+typedef struct Synthetic Synthetic;
+
+
+/// @brief The region of interest set by roi_top, in full-frame pixels.
+/// The top is aligned to 16 rows, so it starts on a chroma row & JPEG block row.
+AABB webcam_roi(const Img_Fmt *format);
+
+/// @brief Finds the frame size a device offers closest to the requested one, without streaming.
+/// Recordings report the size they were recorded at, synthetic cameras accept any size.
+/// @param required_fps If above 0, picks the largest size some pixel format reaches this frame rate at instead,
+/// falling back to the requested size if none does.
+int webcam_negotiate_size(const char *device, unsigned int *width, unsigned int *height, float required_fps);
+
+/// @brief Opens a camera device and starts streaming from it on a dedicated capture thread.
+/// If device is a regular file, it is opened as a recording to be played back instead.
+/// If device starts with "synthetic", frames with known laser dots are generated instead.
+/// @param cam Receives the handle, or NULL on failure.
+int webcam_init(Webcam **cam, const char *device, const Img_Fmt *format);
+
+/// @brief Waits up to capture_timeout ms for the next frame and acquires its ring slot.
+/// @return 0 on success, 1 if no frame arrived in time, -1 on failure.
+int next_frame(Webcam *cam);
+
+/// @brief Gets the frame whose ring slot was acquired by next_frame.
+int get_frame(Webcam *cam, Frame *frame);
+
+/// @brief Releases an acquired ring slot back to the camera device.
+int close_frame(Webcam *cam, Frame *frame);
+
+int webcam_close(Webcam *cam);
+
+/// @brief The recording played back by the handle, NULL if it is a camera device.
+Replay *webcam_replay(Webcam *cam);
+
+/// @brief The frame generator behind the handle, NULL if it is not synthetic.
+Synthetic *webcam_synthetic(Webcam *cam);
 
 #endif
@@ -0,0 +1,50 @@
+#ifndef INCLUDE_WORKER_POOL_H
+#define INCLUDE_WORKER_POOL_H
+
+
+#define POOL_MAX_THREADS 64
+
+
+/// @brief The parallel stages of frame processing, for the fork/join overhead report.
+enum pool_stage
+{
+    STAGE_DECODE = 0,
+    STAGE_CONVERSION = 1,
+    STAGE_SCAN = 2,
+    STAGE_BANDS = 3,
+    STAGE_VISUALIZE = 4,
+
+    POOL_STAGE_COUNT
+};
+
+/// @brief Work split into t_count slots, each run once with its t_id, on any thread of the pool.
+typedef void (*pool_task)(void *arg, int t_id, int t_count);
+
+
+/// @brief Amount of threads worth running: one per physical core the process may run on,
+/// limited by the CPU quota of its cgroup.
+int pool_auto_size();
+
+/// @brief Starts the long-lived workers, pinned to one core each, shared by all stages & cameras.
+/// @param thread_count Threads working on a stage, including the calling thread, at most POOL_MAX_THREADS.
+/// 0 uses pool_auto_size.
+int pool_init(int thread_count);
+
+/// @brief Starts or retires workers. Running stages are not waited for, retired workers exit once idle.
+/// @param thread_count Clamped to 1-POOL_MAX_THREADS, like in pool_init.
+int pool_resize(int thread_count);
+
+/// @brief Threads working on a stage, including the calling thread.
+int pool_size();
+
+/// @brief Runs task for every t_id of 0 to t_count-1 & returns once all of them are done.
+/// The calling thread runs t_id 0 itself, and any others no worker picked up by the time it is done.
+/// Runs everything on the calling thread if the pool was not started.
+int pool_run(enum pool_stage stage, int t_count, pool_task task, void *arg);
+
+/// @brief Prints the average fork & join latency of every stage run so far.
+int pool_report();
+
+int pool_quit();
+
+#endif
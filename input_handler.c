@@ -55,6 +55,10 @@ int handle_keypresses(const Key_Mapping mappings[], int m_count, const Uint8 *st
 
     for (int i = 0; i < m_count; i++)
     {
+        // Skip launch options, which can only be set through command-line arguments.
+        if (mappings[i].SDL_key == SDL_SCANCODE_UNKNOWN)
+            continue;
+
         // Skip if the key to this mapping is not being pressed.
         if (state[mappings[i].SDL_key] != 1)
             continue;
@@ -35,6 +35,10 @@
 #include <jerror.h>
 #include <assert.h>
 
+#ifdef USE_TURBOJPEG
+#include <turbojpeg.h>
+#endif
+
 #include "include/jpegutils.h"
 
  /*
@@ -58,6 +62,7 @@
 
 static void jpeg_buffer_src  (j_decompress_ptr cinfo, unsigned char *buffer,long num);
 static void jpeg_skip_ff (j_decompress_ptr cinfo);
+static void std_huff_tables (j_decompress_ptr dinfo);
 
 /*******************************************************************
  *                                                                 *
@@ -220,14 +225,192 @@ static void my_emit_message (j_common_ptr cinfo, int msg_level)
    (myerr->original_emit_message)(cinfo, msg_level);
 }
 
-#define MAX_LUMA_WIDTH   4096
-#define MAX_CHROMA_WIDTH 2048
+/*
+ * Decoder context: the decompressor, its error handler and the row buffers,
+ * so that every thread can decode with its own. The decompressor is created
+ * once and only reset between frames, which keeps its memory pools, source
+ * manager and Huffman tables. Row buffers are allocated as one block and
+ * grown to the widest image decoded so far.
+ */
+
+struct jpeg_decoder {
+   struct jpeg_decompress_struct dinfo;
+   struct my_error_mgr jerr;
+
+   /* The standard tables, restored before every frame in case the last
+      one brought its own */
+   JHUFF_TBL std_dc_tables[2];
+   JHUFF_TBL std_ac_tables[2];
+
+   int row_buffer_width;
+   unsigned char *row_buffer;
+
+   /* Chroma rows at full width, for 4:4:4 images only */
+   int row_444_width;
+   unsigned char *row_444_buffer;
+   unsigned char *buf1_444[16];
+   unsigned char *buf2_444[16];
+
+   /* The part being decoded by decode_jpeg_part, NULL otherwise */
+   const jpeg_part *part;
+   int part_data_served;
+
+   /* Called by decode_jpeg_raw_bands after every band, NULL otherwise */
+   void (*band_done) (int rows, void *user);
+   void *band_user;
+
+#ifdef USE_TURBOJPEG
+   /* TurboJPEG instance of decode_jpeg_turbo, created on first use */
+   tjhandle turbo;
+#endif
+
+   unsigned char *buf0[16];
+   unsigned char *buf1[8];
+   unsigned char *buf2[8];
+   unsigned char *chr1[8];
+   unsigned char *chr2[8];
+};
+
+static int grow_row_buffers (jpeg_decoder *dec, int luma_width)
+{
+   int chroma_width, y;
+   unsigned char *p;
+
+   /* libjpeg writes whole MCUs, so leave room for a partial one at the end of each row */
+   luma_width = ((luma_width + 15) & ~15) + 16;
+   chroma_width = luma_width / 2;
+
+   if (luma_width <= dec->row_buffer_width)
+      return 0;
+
+   p = (unsigned char *)realloc(dec->row_buffer, 16 * luma_width + 32 * chroma_width);
+   if (p == NULL)
+      return -1;
+
+   dec->row_buffer = p;
+   dec->row_buffer_width = luma_width;
+
+   for (y = 0; y < 16; y++, p += luma_width)
+      dec->buf0[y] = p;
+   for (y = 0; y < 8; y++, p += chroma_width)
+      dec->buf1[y] = p;
+   for (y = 0; y < 8; y++, p += chroma_width)
+      dec->buf2[y] = p;
+   for (y = 0; y < 8; y++, p += chroma_width)
+      dec->chr1[y] = p;
+   for (y = 0; y < 8; y++, p += chroma_width)
+      dec->chr2[y] = p;
+
+   return 0;
+}
+
+static int grow_444_buffers (jpeg_decoder *dec, int width)
+{
+   int y;
+   unsigned char *p;
+
+   if (width <= dec->row_444_width)
+      return 0;
 
-static unsigned char buf0[16][MAX_LUMA_WIDTH];
-static unsigned char buf1[8][MAX_CHROMA_WIDTH];
-static unsigned char buf2[8][MAX_CHROMA_WIDTH];
-static unsigned char chr1[8][MAX_CHROMA_WIDTH];
-static unsigned char chr2[8][MAX_CHROMA_WIDTH];
+   mjpeg_info("YUV 4:4:4 sampling encountered ! Allocating special row buffer\n");
+   p = (unsigned char *)realloc(dec->row_444_buffer, 32 * width);
+   if (p == NULL)
+      return -1;
+
+   dec->row_444_buffer = p;
+   dec->row_444_width = width;
+
+   for (y = 0; y < 16; y++, p += width)
+      dec->buf1_444[y] = p;
+   for (y = 0; y < 16; y++, p += width)
+      dec->buf2_444[y] = p;
+
+   return 0;
+}
+
+/*
+ * Fill the input buffer while decoding a part --- the part's header is
+ * followed by its entropy-coded data, which is followed by EOI.
+ */
+
+static boolean fill_part_buffer (j_decompress_ptr cinfo)
+{
+   /* The decompressor is the first member of its decoder */
+   jpeg_decoder *dec = (jpeg_decoder *) cinfo;
+
+   if (dec->part_data_served)
+      return fill_input_buffer (cinfo);
+
+   dec->part_data_served = 1;
+   cinfo->src->next_input_byte = dec->part->data;
+   cinfo->src->bytes_in_buffer = dec->part->data_len;
+   return TRUE;
+}
+
+/*
+ * Readies the decompressor for the next frame. Frames from webcams leave out
+ * the Huffman tables, so the standard ones are put back in case the last
+ * frame replaced them.
+ */
+
+static void reset_decompress (jpeg_decoder *dec)
+{
+   int i;
+
+   dec->jerr.warning_seen = 0;
+   jpeg_abort_decompress (&dec->dinfo);
+
+   for (i = 0; i < 2; i++) {
+      *dec->dinfo.dc_huff_tbl_ptrs[i] = dec->std_dc_tables[i];
+      *dec->dinfo.ac_huff_tbl_ptrs[i] = dec->std_ac_tables[i];
+   }
+}
+
+jpeg_decoder *jpeg_decoder_create (void)
+{
+   int i;
+   jpeg_decoder *dec = (jpeg_decoder *)calloc(1, sizeof(jpeg_decoder));
+   if (dec == NULL)
+      return NULL;
+
+   /* We set up the normal JPEG error routines, then override error_exit. */
+   dec->dinfo.err = jpeg_std_error (&dec->jerr.pub);
+   dec->jerr.pub.error_exit = my_error_exit;
+   /* also hook the emit_message routine to note corrupt-data warnings */
+   dec->jerr.original_emit_message = dec->jerr.pub.emit_message;
+   dec->jerr.pub.emit_message = my_emit_message;
+
+   if (setjmp (dec->jerr.setjmp_buffer)) {
+      jpeg_destroy_decompress (&dec->dinfo);
+      free(dec);
+      return NULL;
+   }
+
+   jpeg_create_decompress (&dec->dinfo);
+
+   /* The tables live in the permanent pool, so they outlast every frame */
+   std_huff_tables (&dec->dinfo);
+   for (i = 0; i < 2; i++) {
+      dec->std_dc_tables[i] = *dec->dinfo.dc_huff_tbl_ptrs[i];
+      dec->std_ac_tables[i] = *dec->dinfo.ac_huff_tbl_ptrs[i];
+   }
+   return dec;
+}
+
+void jpeg_decoder_destroy (jpeg_decoder *dec)
+{
+   if (dec == NULL)
+      return;
+
+   jpeg_destroy_decompress (&dec->dinfo);
+#ifdef USE_TURBOJPEG
+   if (dec->turbo != NULL)
+      tjDestroy (dec->turbo);
+#endif
+   free(dec->row_444_buffer);
+   free(dec->row_buffer);
+   free(dec);
+}
 
 #if 1  /* generation of 'std' Huffman tables... */
 
@@ -331,17 +514,6 @@ static void std_huff_tables (j_decompress_ptr dinfo)
 		 bits_ac_chrominance, val_ac_chrominance);
 }
 
-static void guarantee_huff_tables(j_decompress_ptr dinfo)
-{
-  if ( (dinfo->dc_huff_tbl_ptrs[0] == NULL) &&
-       (dinfo->dc_huff_tbl_ptrs[1] == NULL) &&
-       (dinfo->ac_huff_tbl_ptrs[0] == NULL) &&
-       (dinfo->ac_huff_tbl_ptrs[1] == NULL) ) {
-    mjpeg_debug( "Generating standard Huffman tables for this frame.");
-    std_huff_tables(dinfo);
-  }
-}
-
 #endif /* ...'std' Huffman table generation */
 
 /*
@@ -360,7 +532,7 @@ static void guarantee_huff_tables(j_decompress_ptr dinfo)
  *	
  */
 
-int decode_jpeg_raw (unsigned char *jpeg_data, int len,
+int decode_jpeg_raw (jpeg_decoder *dec, unsigned char *jpeg_data, int len,
                      int itype, int ctype, int width, int height,
                      unsigned char *raw0, unsigned char *raw1,
                      unsigned char *raw2)
@@ -375,64 +547,48 @@ int decode_jpeg_raw (unsigned char *jpeg_data, int len,
       xs, xd,
       hdown;
 
-   JSAMPROW row0[16] = { 
-      buf0[0], buf0[1], buf0[2], buf0[3],
-      buf0[4], buf0[5], buf0[6], buf0[7],
-      buf0[8], buf0[9], buf0[10], buf0[11],
-      buf0[12], buf0[13], buf0[14], buf0[15]
-   };
-   JSAMPROW row1[8] = { 
-      buf1[0], buf1[1], buf1[2], buf1[3],
-      buf1[4], buf1[5], buf1[6], buf1[7]   
-   };
-   JSAMPROW row2[16] = { 
-      buf2[0], buf2[1], buf2[2], buf2[3],
-      buf2[4], buf2[5], buf2[6], buf2[7]  
-   };
+   /* Pointed at the row buffers once the image width is known */
+   JSAMPROW row0[16];
+   JSAMPROW row1[8];
+   JSAMPROW row2[16];
    JSAMPROW row1_444[16], row2_444[16];
    JSAMPARRAY scanarray[3] = { row0, row1, row2 };
-   struct jpeg_decompress_struct dinfo;
-   struct my_error_mgr jerr;
-
-   /* We set up the normal JPEG error routines, then override error_exit. */
-   dinfo.err = jpeg_std_error (&jerr.pub);
-   jerr.pub.error_exit = my_error_exit;
-   /* also hook the emit_message routine to note corrupt-data warnings */
-   jerr.original_emit_message = jerr.pub.emit_message;
-   jerr.pub.emit_message = my_emit_message;
-   jerr.warning_seen = 0;
+   struct jpeg_decompress_struct *dinfo = &dec->dinfo;
 
    /* Establish the setjmp return context for my_error_exit to use. */
-   if (setjmp (jerr.setjmp_buffer)) {
+   if (setjmp (dec->jerr.setjmp_buffer)) {
       /* If we get here, the JPEG code has signaled an error. */
-      jpeg_destroy_decompress (&dinfo);
+      jpeg_abort_decompress (dinfo);
       return -1;
    }
 
-   jpeg_create_decompress (&dinfo);
+   reset_decompress (dec);
 
-   jpeg_buffer_src (&dinfo, jpeg_data, len);
+   jpeg_buffer_src (dinfo, jpeg_data, len);
+   if (dec->part != NULL) {
+      dinfo->src->fill_input_buffer = fill_part_buffer;
+      dec->part_data_served = 0;
+   }
 
    /* Read header, make some checks and try to figure out what the
       user really wants */
 
-   jpeg_read_header (&dinfo, TRUE);
-   dinfo.raw_data_out = TRUE;
-   dinfo.do_fancy_upsampling = FALSE;
-   dinfo.out_color_space = JCS_YCbCr;
-   dinfo.dct_method = JDCT_IFAST;
-   guarantee_huff_tables(&dinfo);
-   jpeg_start_decompress (&dinfo);
+   jpeg_read_header (dinfo, TRUE);
+   dinfo->raw_data_out = TRUE;
+   dinfo->do_fancy_upsampling = FALSE;
+   dinfo->out_color_space = JCS_YCbCr;
+   dinfo->dct_method = JDCT_IFAST;
+   jpeg_start_decompress (dinfo);
 
-   if (dinfo.output_components != 3) {
+   if (dinfo->output_components != 3) {
       mjpeg_error( "Output components of JPEG image = %d, must be 3",
-               dinfo.output_components);
+               dinfo->output_components);
       goto ERR_EXIT;
    }
 
    for (i = 0; i < 3; i++) {
-      hsf[i] = dinfo.comp_info[i].h_samp_factor;
-      vsf[i] = dinfo.comp_info[i].v_samp_factor;
+      hsf[i] = dinfo->comp_info[i].h_samp_factor;
+      vsf[i] = dinfo->comp_info[i].v_samp_factor;
    }
 
    if ((hsf[0] != 2 && hsf[0] != 1) || hsf[1] != 1 || hsf[2] != 1 ||
@@ -449,47 +605,56 @@ int decode_jpeg_raw (unsigned char *jpeg_data, int len,
 	   goto ERR_EXIT;	   
 	 }
 
-       mjpeg_info("YUV 4:4:4 sampling encountered ! Allocating special row buffer\n");
-       for (y = 0; y < 16; y++) // allocate a special buffer for the extra sampling depth
+       if (grow_444_buffers (dec, dinfo->output_width) != 0)
 	 {
-	   //mjpeg_info("YUV 4:4:4 %d.\n",y);
-	   row1_444[y] = (unsigned char *)malloc(dinfo.output_width * sizeof(char));
-	   row2_444[y] = (unsigned char *)malloc(dinfo.output_width * sizeof(char));
+	   mjpeg_error( "Failed to allocate 4:4:4 row buffers for width %d", dinfo->output_width);
+	   goto ERR_EXIT;
+	 }
+       for (y = 0; y < 16; y++) // a special buffer for the extra sampling depth
+	 {
+	   row1_444[y] = dec->buf1_444[y];
+	   row2_444[y] = dec->buf2_444[y];
 	 }
-       //mjpeg_info("YUV 4:4:4 sampling encountered ! Allocating done.\n");
        scanarray[1] = row1_444; 
        scanarray[2] = row2_444; 
      }
 
    /* Height match image height or be exact twice the image height */
 
-   if (dinfo.output_height == height) {
+   if (dinfo->output_height == height) {
       numfields = 1;
-   } else if (2 * dinfo.output_height == height) {
+   } else if (2 * dinfo->output_height == height) {
       numfields = 2;
    } else {
       mjpeg_error(
                "Read JPEG: requested height = %d, height of image = %d",
-               height, dinfo.output_height);
+               height, dinfo->output_height);
       goto ERR_EXIT;
    }
 
    /* Width is more flexible */
 
-   if (dinfo.output_width > MAX_LUMA_WIDTH) {
-      mjpeg_error( "Image width of %d exceeds max",
-               dinfo.output_width);
+   if (grow_row_buffers (dec, (int)dinfo->output_width > width ? (int)dinfo->output_width : width) != 0) {
+      mjpeg_error( "Failed to allocate row buffers for width %d",
+               dinfo->output_width);
       goto ERR_EXIT;
    }
-   if (width < 2 * dinfo.output_width / 3) {
+   for (y = 0; y < 16; y++)
+      row0[y] = dec->buf0[y];
+   for (y = 0; y < 8; y++) {
+      row1[y] = dec->buf1[y];
+      row2[y] = dec->buf2[y];
+   }
+   y = 0;
+   if (width < 2 * dinfo->output_width / 3) {
       /* Downsample 2:1 */
 
       hdown = 1;
-      if (2 * width < dinfo.output_width)
-         xsl = (dinfo.output_width - 2 * width) / 2;
+      if (2 * width < dinfo->output_width)
+         xsl = (dinfo->output_width - 2 * width) / 2;
       else
          xsl = 0;
-   } else if (width == 2 * dinfo.output_width / 3) {
+   } else if (width == 2 * dinfo->output_width / 3) {
       /* special case of 3:2 downsampling */
 
       hdown = 2;
@@ -498,8 +663,8 @@ int decode_jpeg_raw (unsigned char *jpeg_data, int len,
       /* No downsampling */
 
       hdown = 0;
-      if (width < dinfo.output_width)
-         xsl = (dinfo.output_width - width) / 2;
+      if (width < dinfo->output_width)
+         xsl = (dinfo->output_width - width) / 2;
       else
          xsl = 0;
    }
@@ -513,12 +678,12 @@ int decode_jpeg_raw (unsigned char *jpeg_data, int len,
 
    for (field = 0; field < numfields; field++) {
       if (field > 0) {
-         jpeg_read_header (&dinfo, TRUE);
-         dinfo.raw_data_out = TRUE;
-         dinfo.do_fancy_upsampling = FALSE;
-         dinfo.out_color_space = JCS_YCbCr;
-         dinfo.dct_method = JDCT_IFAST;
-         jpeg_start_decompress (&dinfo);
+         jpeg_read_header (dinfo, TRUE);
+         dinfo->raw_data_out = TRUE;
+         dinfo->do_fancy_upsampling = FALSE;
+         dinfo->out_color_space = JCS_YCbCr;
+         dinfo->dct_method = JDCT_IFAST;
+         jpeg_start_decompress (dinfo);
       }
 
       if (numfields == 2) {
@@ -537,9 +702,9 @@ int decode_jpeg_raw (unsigned char *jpeg_data, int len,
       } else
          yl = yc = 0;
 
-      while (dinfo.output_scanline < dinfo.output_height) {
+      while (dinfo->output_scanline < dinfo->output_height) {
 	/* read raw data */
-	jpeg_read_raw_data (&dinfo, scanarray, 8 * vsf[0]);
+	jpeg_read_raw_data (dinfo, scanarray, 8 * vsf[0]);
 
          for (y = 0; y < 8 * vsf[0]; yl += numfields, y++) {
             xd = yl * width;
@@ -574,19 +739,19 @@ int decode_jpeg_raw (unsigned char *jpeg_data, int len,
             xs = xsc;
             if (hdown == 0)
                for (x = 0; x < width / 2; x++, xs++) {
-		 chr1[y][x] = row1[y][xs];
-		 chr2[y][x] = row2[y][xs];
+		 dec->chr1[y][x] = row1[y][xs];
+		 dec->chr2[y][x] = row2[y][xs];
             } else if (hdown == 1)
                for (x = 0; x < width / 2; x++, xs += 2) {
-                  chr1[y][x] = (row1[y][xs] + row1[y][xs + 1]) >> 1;
-                  chr2[y][x] = (row2[y][xs] + row2[y][xs + 1]) >> 1;
+                  dec->chr1[y][x] = (row1[y][xs] + row1[y][xs + 1]) >> 1;
+                  dec->chr2[y][x] = (row2[y][xs] + row2[y][xs + 1]) >> 1;
             } else
                for (x = 0; x < width / 2; x += 2, xs += 3) {
-                  chr1[y][x] = (2 * row1[y][xs] + row1[y][xs + 1]) / 3;
-                  chr1[y][x + 1] =
+                  dec->chr1[y][x] = (2 * row1[y][xs] + row1[y][xs + 1]) / 3;
+                  dec->chr1[y][x + 1] =
                       (2 * row1[y][xs + 2] + row1[y][xs + 1]) / 3;
-                  chr2[y][x] = (2 * row2[y][xs] + row2[y][xs + 1]) / 3;
-                  chr2[y][x + 1] =
+                  dec->chr2[y][x] = (2 * row2[y][xs] + row2[y][xs + 1]) / 3;
+                  dec->chr2[y][x + 1] =
                       (2 * row2[y][xs + 2] + row2[y][xs + 1]) / 3;
                }
          }
@@ -600,8 +765,8 @@ int decode_jpeg_raw (unsigned char *jpeg_data, int len,
 	     for (y = 0; y < 8 /*&& yc < height */; y++, yc += numfields) {
 	       xd = yc * width / 2;
 	       for (x = 0; x < width / 2; x++, xd++) {
-		 raw1[xd] = chr1[y][x];
-		 raw2[xd] = chr2[y][x];
+		 raw1[xd] = dec->chr1[y][x];
+		 raw2[xd] = dec->chr2[y][x];
 	       }
 	     }
 	   } else {
@@ -609,14 +774,14 @@ int decode_jpeg_raw (unsigned char *jpeg_data, int len,
 	     for (y = 0; y < 8 /*&& yc < height */; y++) {
 	       xd = yc * width / 2;
 	       for (x = 0; x < width / 2; x++, xd++) {
-		 raw1[xd] = chr1[y][x];
-		 raw2[xd] = chr2[y][x];
+		 raw1[xd] = dec->chr1[y][x];
+		 raw2[xd] = dec->chr2[y][x];
 	       }
 	       yc += numfields;
 	       xd = yc * width / 2;
 	       for (x = 0; x < width / 2; x++, xd++) {
-		 raw1[xd] = chr1[y][x];
-		 raw2[xd] = chr2[y][x];
+		 raw1[xd] = dec->chr1[y][x];
+		 raw2[xd] = dec->chr2[y][x];
 	       }
 	       yc += numfields;
 	     }
@@ -634,8 +799,8 @@ int decode_jpeg_raw (unsigned char *jpeg_data, int len,
 	       xd = yc * width / 2;
 	       for (x = 0; x < width / 2; x++, xd++) {
 		 assert(xd < (width * height / 4));
-		 raw1[xd] = (chr1[y][x] + chr1[y + 1][x]) >> 1;
-		 raw2[xd] = (chr2[y][x] + chr2[y + 1][x]) >> 1;
+		 raw1[xd] = (dec->chr1[y][x] + dec->chr1[y + 1][x]) >> 1;
+		 raw2[xd] = (dec->chr2[y][x] + dec->chr2[y + 1][x]) >> 1;
 	       }
 	     }
 
@@ -644,37 +809,472 @@ int decode_jpeg_raw (unsigned char *jpeg_data, int len,
 	     for (y = 0; y < 8 /*&& yc < height/2 */; y++, yc += numfields) {
 	       xd = yc * width / 2;
 	       for (x = 0; x < width / 2; x++, xd++) {
-		 raw1[xd] = chr1[y][x];
-		 raw2[xd] = chr2[y][x];
+		 raw1[xd] = dec->chr1[y][x];
+		 raw2[xd] = dec->chr2[y][x];
 	       }
 	     }
 	   }
 	   break;
 	 }
+
+         /* The rows decoded so far are complete, in all three planes */
+         if (dec->band_done != NULL && numfields == 1)
+            dec->band_done (yl < height ? yl : height, dec->band_user);
       }
 
-      (void) jpeg_finish_decompress (&dinfo);
+      (void) jpeg_finish_decompress (dinfo);
       if (field == 0 && numfields > 1)
-         jpeg_skip_ff (&dinfo);
+         jpeg_skip_ff (dinfo);
    }
 
-   if (hsf[0] == 1)
-     {
-       //mjpeg_info("YUV 4:4:4 sampling encountered ! Deallocating special row buffer\n");
-       for (y = 0; y < 16; y++) // allocate a special buffer for the extra sampling depth
-	 {
-	   free(row1_444[y]);
-	   free(row2_444[y]);
-	 }
-     }
-
-   jpeg_destroy_decompress (&dinfo);
-   if(jerr.warning_seen)
+   if(dec->jerr.warning_seen)
 	   return 1;
    else
 	   return 0;
 
  ERR_EXIT:
-   jpeg_destroy_decompress (&dinfo);
+   jpeg_abort_decompress (dinfo);
+   return -1;
+}
+
+/*
+ * Sets up a decompressor for interleaved YCbCr output at 1/scale_denom of
+ * the full size. Must be called after reset_decompress, with the
+ * error handler in place.
+ */
+
+static void start_ycc_decompress (j_decompress_ptr dinfo,
+                                  unsigned char *jpeg_data, int len,
+                                  int scale_denom)
+{
+   jpeg_buffer_src (dinfo, jpeg_data, len);
+   jpeg_read_header (dinfo, TRUE);
+   dinfo->out_color_space = JCS_YCbCr;
+   dinfo->scale_num = 1;
+   dinfo->scale_denom = scale_denom;
+   dinfo->do_fancy_upsampling = FALSE;
+   dinfo->dct_method = JDCT_IFAST;
+   jpeg_start_decompress (dinfo);
+}
+
+ /*
+ * jpeg_data:       buffer with input jpeg
+ * len:             Length of jpeg buffer
+ * scale_denom      1, 2, 4 or 8. At 1/8 only the DC coefficient of every
+ *                  block is used, which skips nearly all of the IDCT work.
+ * width, height    receive the scaled size
+ * ycc              buffer for the interleaved YCbCr output
+ * capacity         size of ycc in bytes
+ */
+
+int decode_jpeg_scaled (jpeg_decoder *dec, unsigned char *jpeg_data, int len, int scale_denom,
+                        int *width, int *height,
+                        unsigned char *ycc, int capacity)
+{
+   JSAMPROW row;
+   struct jpeg_decompress_struct *dinfo = &dec->dinfo;
+
+   if (setjmp (dec->jerr.setjmp_buffer)) {
+      jpeg_abort_decompress (dinfo);
+      return -1;
+   }
+
+   reset_decompress (dec);
+   start_ycc_decompress (dinfo, jpeg_data, len, scale_denom);
+
+   if ((long) dinfo->output_width * dinfo->output_height * 3 > capacity) {
+      mjpeg_error ("Scaled JPEG of %dx%d does not fit in %d bytes\n",
+                   dinfo->output_width, dinfo->output_height, capacity);
+      goto ERR_EXIT;
+   }
+
+   while (dinfo->output_scanline < dinfo->output_height) {
+      row = ycc + (long) dinfo->output_scanline * dinfo->output_width * 3;
+      jpeg_read_scanlines (dinfo, &row, 1);
+   }
+
+   *width = dinfo->output_width;
+   *height = dinfo->output_height;
+
+   (void) jpeg_finish_decompress (dinfo);
+   return dec->jerr.warning_seen ? 1 : 0;
+
+ ERR_EXIT:
+   jpeg_abort_decompress (dinfo);
+   return -1;
+}
+
+ /*
+ * jpeg_data:       buffer with input jpeg
+ * len:             Length of jpeg buffer
+ * width            width of the image, in pixels per row of ycc
+ * x0, x1           first & end column to decode, widened to whole blocks
+ *                  on return
+ * rows             count pairs of first & end row to decode, sorted and
+ *                  not overlapping. Rows in between are skipped without
+ *                  running the IDCT, the rows after the last are never read.
+ * ycc              interleaved YCbCr output of the full image, only the
+ *                  decoded rows & columns are written
+ */
+
+int decode_jpeg_regions (jpeg_decoder *dec, unsigned char *jpeg_data, int len, int width,
+                         int *x0, int *x1, const int *rows, int count,
+                         unsigned char *ycc)
+{
+   int i, start, end;
+   JDIMENSION xoffset, crop_width;
+   JSAMPROW row;
+   struct jpeg_decompress_struct *dinfo = &dec->dinfo;
+
+   if (setjmp (dec->jerr.setjmp_buffer)) {
+      jpeg_abort_decompress (dinfo);
+      return -1;
+   }
+
+   reset_decompress (dec);
+   start_ycc_decompress (dinfo, jpeg_data, len, 1);
+
+   if ((int) dinfo->output_width != width || *x0 < 0 || *x1 > width || *x0 >= *x1) {
+      mjpeg_error ("Read JPEG: requested columns %d-%d of width %d, width of image = %d\n",
+                   *x0, *x1, width, dinfo->output_width);
+      goto ERR_EXIT;
+   }
+
+   xoffset = *x0;
+   crop_width = *x1 - *x0;
+   jpeg_crop_scanline (dinfo, &xoffset, &crop_width);
+   *x0 = xoffset;
+   *x1 = xoffset + crop_width;
+
+   for (i = 0; i < count; i++) {
+      start = rows[2 * i] < (int) dinfo->output_height ?
+         rows[2 * i] : (int) dinfo->output_height;
+      end = rows[2 * i + 1] < (int) dinfo->output_height ?
+         rows[2 * i + 1] : (int) dinfo->output_height;
+
+      if (start > (int) dinfo->output_scanline)
+         jpeg_skip_scanlines (dinfo, start - dinfo->output_scanline);
+
+      while ((int) dinfo->output_scanline < end) {
+         row = ycc + ((long) dinfo->output_scanline * width + xoffset) * 3;
+         jpeg_read_scanlines (dinfo, &row, 1);
+      }
+   }
+
+   /* The remaining rows are not needed */
+   jpeg_abort_decompress (dinfo);
+   return dec->jerr.warning_seen ? 1 : 0;
+
+ ERR_EXIT:
+   jpeg_abort_decompress (dinfo);
    return -1;
-}
\ No newline at end of file
+}
+
+ /*
+ * Returns Y4M_CHROMA_420JPEG for frames with chroma subsampled 2x2, which
+ * decode_jpeg_raw can output without upsampling the chroma, and
+ * Y4M_CHROMA_422 for all others. Only the markers up to SOF are read.
+ */
+
+int jpeg_native_chroma (unsigned char *jpeg_data, int len)
+{
+   int pos, seglen, marker;
+
+   for (pos = 2; pos + 4 <= len && jpeg_data[pos] == 0xFF; pos += 2 + seglen) {
+      marker = jpeg_data[pos + 1];
+      if (marker == 0xFF) {
+         seglen = -1;           /* fill byte */
+         continue;
+      }
+      seglen = (jpeg_data[pos + 2] << 8) | jpeg_data[pos + 3];
+
+      if (marker == 0xC0 || marker == 0xC1 || marker == 0xC2) {
+         /* The sampling factors of luma, with chroma at 1x1 */
+         if (pos + 18 <= len && jpeg_data[pos + 9] == 3 && jpeg_data[pos + 11] == 0x22 &&
+             jpeg_data[pos + 14] == 0x11 && jpeg_data[pos + 17] == 0x11)
+            return Y4M_CHROMA_420JPEG;
+         break;
+      }
+      if (marker == 0xDA)
+         break;
+   }
+   return Y4M_CHROMA_422;
+}
+
+/*******************************************************************
+ *                                                                 *
+ *    Splitting a frame at its restart markers, so that its parts  *
+ *    can be decoded at the same time                              *
+ *                                                                 *
+ *******************************************************************/
+
+static int gcd (int a, int b)
+{
+   while (b != 0) {
+      int t = a % b;
+      a = b;
+      b = t;
+   }
+   return a;
+}
+
+/*
+ * jpeg_data:       buffer with input jpeg
+ * len:             Length of jpeg buffer
+ * max_parts        most parts to split into, at most JPEG_MAX_PARTS
+ * parts            receives the parts, in the order of their rows
+ * returns:
+ *      the number of parts, 1 if the frame cannot be split: it has no
+ *      restart markers, is not a baseline frame with a single interleaved
+ *      scan, or its tables do not fit JPEG_PART_HEADER_MAX.
+ */
+
+int split_jpeg_restarts (unsigned char *jpeg_data, int len, int max_parts,
+                         jpeg_part *parts)
+{
+   int pos, seglen, marker, i, p,
+      hlen = 0, sof_pos = -1, restart_interval = 0,
+      width = 0, height = 0, ncomps = 0, hmax = 1, vmax = 1,
+      mcus_per_row, mcu_rows, mcu_height,
+      interval_step, row_step, candidates, part_c,
+      restart_c, data_end, scan_start;
+   int starts[JPEG_MAX_PARTS + 1];
+   unsigned char *header = parts[0].header;
+   unsigned char *found;
+
+   if (max_parts < 2 || len < 4 || jpeg_data[0] != 0xFF || jpeg_data[1] != 0xD8)
+      return 1;
+   if (max_parts > JPEG_MAX_PARTS)
+      max_parts = JPEG_MAX_PARTS;
+
+   header[hlen++] = 0xFF;
+   header[hlen++] = 0xD8;
+
+   /* Copy the tables & frame header, leaving out APPn & COM segments */
+   for (pos = 2; ; pos += 2 + seglen) {
+      if (pos + 4 > len || jpeg_data[pos] != 0xFF)
+         return 1;
+      marker = jpeg_data[pos + 1];
+      if (marker == 0xFF) {
+         seglen = -1;           /* fill byte */
+         continue;
+      }
+      seglen = (jpeg_data[pos + 2] << 8) | jpeg_data[pos + 3];
+      if (pos + 2 + seglen > len)
+         return 1;
+
+      if (marker == 0xC0 || marker == 0xC1) {
+         if (seglen < 8)
+            return 1;
+         sof_pos = hlen + 5;
+         height = (jpeg_data[pos + 5] << 8) | jpeg_data[pos + 6];
+         width = (jpeg_data[pos + 7] << 8) | jpeg_data[pos + 8];
+         ncomps = jpeg_data[pos + 9];
+         if (height == 0 || seglen < 8 + 3 * ncomps)
+            return 1;
+         for (i = 0; i < ncomps; i++) {
+            int factors = jpeg_data[pos + 11 + 3 * i];
+            if ((factors >> 4) > hmax)
+               hmax = factors >> 4;
+            if ((factors & 15) > vmax)
+               vmax = factors & 15;
+         }
+      } else if (marker >= 0xC2 && marker <= 0xCF && marker != 0xC4 && marker != 0xCC) {
+         return 1;              /* progressive, lossless or arithmetic */
+      } else if (marker == 0xDD) {
+         if (seglen < 4)
+            return 1;
+         restart_interval = (jpeg_data[pos + 4] << 8) | jpeg_data[pos + 5];
+      } else if (marker != 0xDB && marker != 0xC4 && marker != 0xDA) {
+         continue;              /* APPn, COM & anything else not needed */
+      }
+
+      if (hlen + 2 + seglen > JPEG_PART_HEADER_MAX)
+         return 1;
+      memcpy (header + hlen, jpeg_data + pos, 2 + seglen);
+      hlen += 2 + seglen;
+
+      if (marker == 0xDA)
+         break;
+   }
+
+   /* A single scan holding all components */
+   scan_start = pos + 2 + seglen;
+   if (sof_pos < 0 || restart_interval == 0 || jpeg_data[pos + 4] != ncomps ||
+       scan_start >= len - 1)
+      return 1;
+
+   mcus_per_row = (width + 8 * hmax - 1) / (8 * hmax);
+   mcu_height = 8 * vmax;
+   mcu_rows = (height + mcu_height - 1) / mcu_height;
+
+   /* Parts start after a restart marker numbered 7 (or at the start of the
+      data), so the markers within each part count up from 0 as libjpeg
+      expects, and at the start of a row of MCUs. */
+   interval_step = mcus_per_row / gcd (restart_interval, mcus_per_row);
+   interval_step = interval_step * 8 / gcd (interval_step, 8);
+   row_step = interval_step * restart_interval / mcus_per_row;
+   candidates = (mcu_rows + row_step - 1) / row_step;
+   part_c = candidates < max_parts ? candidates : max_parts;
+   if (part_c < 2)
+      return 1;
+
+   for (p = 0; p < part_c; p++)
+      starts[p] = (int) ((long) candidates * p / part_c) * interval_step;
+   starts[part_c] = -1;
+
+   /* Find the restart markers ending the interval before each part. Bytes
+      of 0xFF in the data are followed by 0x00, a restart marker or EOI. */
+   parts[0].data = jpeg_data + scan_start;
+   restart_c = 0;
+   data_end = len;
+   p = 1;
+   for (pos = scan_start;
+        (found = memchr (jpeg_data + pos, 0xFF, len - 1 - pos)) != NULL;
+        pos++) {
+      pos = found - jpeg_data;
+      marker = jpeg_data[pos + 1];
+      if (marker >= 0xD0 && marker <= 0xD7) {
+         restart_c++;
+         if (p < part_c && restart_c == starts[p]) {
+            parts[p - 1].data_len = pos - (int) (parts[p - 1].data - jpeg_data);
+            parts[p].data = jpeg_data + pos + 2;
+            p++;
+         }
+      } else if (marker == 0xD9) {
+         data_end = pos;
+         break;
+      }
+      if (pos + 2 >= len)
+         break;
+   }
+   if (p < part_c)
+      return 1;                 /* fewer restart markers than the frame needs */
+   parts[part_c - 1].data_len = data_end - (int) (parts[part_c - 1].data - jpeg_data);
+
+   for (p = 0; p < part_c; p++) {
+      int first = starts[p] * restart_interval / mcus_per_row * mcu_height;
+      int end = (p + 1 < part_c) ?
+         starts[p + 1] * restart_interval / mcus_per_row * mcu_height : height;
+
+      if (p > 0)
+         memcpy (parts[p].header, header, hlen);
+      parts[p].header_len = hlen;
+      parts[p].header[sof_pos] = (end - first) >> 8;
+      parts[p].header[sof_pos + 1] = (end - first) & 0xFF;
+      parts[p].first_row = first;
+      parts[p].end_row = end;
+   }
+
+   return part_c;
+}
+
+ /*
+ * Decodes a part found by split_jpeg_restarts, like decode_jpeg_raw
+ * decodes a whole frame. raw0, raw1 & raw2 point at the first row of the
+ * part in the planes.
+ */
+
+int decode_jpeg_part (jpeg_decoder *dec, const jpeg_part *part,
+                      int ctype, int width,
+                      unsigned char *raw0, unsigned char *raw1,
+                      unsigned char *raw2)
+{
+   int result;
+
+   dec->part = part;
+   result = decode_jpeg_raw (dec, (unsigned char *) part->header, part->header_len,
+                             0, ctype, width, part->end_row - part->first_row,
+                             raw0, raw1, raw2);
+   dec->part = NULL;
+   return result;
+}
+
+ /*
+ * Decodes a frame like decode_jpeg_raw, calling band_done with the amount
+ * of rows of the Y plane that are complete after every band of 8 or 16
+ * rows, while the rest of the frame is still to be decoded.
+ */
+
+int decode_jpeg_raw_bands (jpeg_decoder *dec, unsigned char *jpeg_data, int len,
+                           int ctype, int width, int height,
+                           unsigned char *raw0, unsigned char *raw1,
+                           unsigned char *raw2,
+                           void (*band_done) (int rows, void *user), void *user)
+{
+   int result;
+
+   dec->band_done = band_done;
+   dec->band_user = user;
+   result = decode_jpeg_raw (dec, jpeg_data, len, 0, ctype, width, height,
+                             raw0, raw1, raw2);
+   dec->band_done = NULL;
+   dec->band_user = NULL;
+   return result;
+}
+
+/*******************************************************************
+ *                                                                 *
+ *    TurboJPEG backend                                            *
+ *                                                                 *
+ *******************************************************************/
+
+int jpeg_turbo_available (void)
+{
+#ifdef USE_TURBOJPEG
+   return 1;
+#else
+   return 0;
+#endif
+}
+
+ /*
+ * Decodes a frame straight into the planes with the TurboJPEG API, skipping
+ * the row buffers & copies of decode_jpeg_raw. Frames of another size, or
+ * whose chroma subsampling does not match ctype (Y4M_CHROMA_422 or
+ * Y4M_CHROMA_420JPEG), are passed on to decode_jpeg_raw, as are all frames
+ * if built without USE_TURBOJPEG.
+ * returns:
+ *	-1 on fatal error
+ *	0 on success
+ *	1 on corrupt data, "a damaged output image is likely."
+ */
+
+int decode_jpeg_turbo (jpeg_decoder *dec, unsigned char *jpeg_data, int len,
+                       int ctype, int width, int height,
+                       unsigned char *raw0, unsigned char *raw1,
+                       unsigned char *raw2)
+{
+#ifdef USE_TURBOJPEG
+   int jpeg_width, jpeg_height, subsamp, colorspace;
+   unsigned char *planes[3] = { raw0, raw1, raw2 };
+   int strides[3] = { width, width / 2, width / 2 };
+
+   if (dec->turbo == NULL && (dec->turbo = tjInitDecompress ()) == NULL) {
+      mjpeg_error ("tjInitDecompress failed: %s\n", tjGetErrorStr2 (NULL));
+      return -1;
+   }
+
+   if (tjDecompressHeader3 (dec->turbo, jpeg_data, len, &jpeg_width,
+                            &jpeg_height, &subsamp, &colorspace) != 0) {
+      mjpeg_error ("TurboJPEG: %s\n", tjGetErrorStr2 (dec->turbo));
+      return -1;
+   }
+
+   if (jpeg_width == width && jpeg_height == height &&
+       subsamp == (ctype == Y4M_CHROMA_422 ? TJSAMP_422 : TJSAMP_420)) {
+      /* Same IDCT as decode_jpeg_raw, so both give the same planes */
+      if (tjDecompressToYUVPlanes (dec->turbo, jpeg_data, len, planes, width,
+                                   strides, height, TJFLAG_FASTDCT) == 0)
+         return 0;
+
+      if (tjGetErrorCode (dec->turbo) == TJERR_WARNING)
+         return 1;
+      mjpeg_error ("TurboJPEG: %s\n", tjGetErrorStr2 (dec->turbo));
+      return -1;
+   }
+#endif
+
+   return decode_jpeg_raw (dec, jpeg_data, len, 0, ctype,
+                           width, height, raw0, raw1, raw2);
+}
@@ -1,21 +1,28 @@
-// gcc -Wall -g main.c jpegutils.c timer.c img_data.c aabb.c  webcam_handler.c img_processing.c input_handler.c -o release -O0 -ljpeg -lm -lSDL2 -fopenmp -lpthread
+// gcc -Wall -g main.c jpegutils.c timer.c img_data.c aabb.c webcam_handler.c buffer_arena.c recording.c synthetic_camera.c camera_pipeline.c worker_pool.c hsv_convert.c img_processing.c input_handler.c -o release -O0 -ljpeg -lm -lSDL2 -fopenmp -lpthread
 // valgrind --leak-check=full --track-origins=yes -s ./release
 
-// gcc -Wall -g main.c jpegutils.c timer.c img_data.c aabb.c webcam_handler.c img_processing.c input_handler.c -o release -ljpeg -lm -lSDL2 -fopenmp -lpthread
+// gcc -Wall -g main.c jpegutils.c timer.c img_data.c aabb.c webcam_handler.c buffer_arena.c recording.c synthetic_camera.c camera_pipeline.c worker_pool.c hsv_convert.c img_processing.c input_handler.c -o release -ljpeg -lm -lSDL2 -fopenmp -lpthread
 // ./release
+// Add -DUSE_TURBOJPEG -lturbojpeg for the TurboJPEG decode backend.
 
 
 #define STB_IMAGE_WRITE_IMPLEMENTATION
 #include "include/stb_image_write.h"
 #include "include/timer.h"
+#include "include/worker_pool.h"
+#include "include/hsv_convert.h"
 #include "include/img_data.h"
 #include "include/webcam_handler.h"
+#include "include/camera_pipeline.h"
 #include "include/img_processing.h"
 #include "include/aabb.h"
 #include "include/input_handler.h"
+#include "include/recording.h"
+#include "include/jpegutils.h"
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <strings.h>
 #include <stdbool.h>
 #include <string.h>
 
@@ -24,76 +31,9 @@
 #include <pthread.h>
 
 
-#define IMG_WIDTH 640 // 320 640 800 1280
-#define IMG_HEIGHT 480 // 240 480 600 720
-#define IMG_SIZE IMG_WIDTH * IMG_HEIGHT
-
-
-int process_image(const Img_Fmt *fmt, RGB *rgb)
-{
-    unsigned char *mjpeg = NULL;
-    unsigned int mjpeg_size;
-
-    int result = get_frame(&mjpeg, &mjpeg_size);
-    if (result == -1)
-        return -1;
-
-    result = mjpeg_to_rgb(mjpeg, mjpeg_size, fmt, rgb);
-    if (result == -1)
-        return -1;
-
-    if (fmt->visualize == 1.0f)
-    {
-        result = apply_img_effects(fmt, rgb);
-        if (result == -1)
-            return -1;
-    }
-    else
-    {
-        Vec2 dot_pos;
-        float confidence = 0.0f;
-        
-        result = find_laser_dot(fmt, rgb, &dot_pos, &confidence);
-
-        confidence -= fmt->dot_threshold;
-        if (confidence > 0)
-            draw_circle(fmt, rgb, dot_pos, 10, CLAMP((int)(log2f(confidence + 1.0f)) + confidence / 10.0f, 1, 50), (RGB){0,0,255});
-
-        AABB 
-            left_select = (AABB){0, 0, fmt->width/5, fmt->height},
-            right_select = (AABB){fmt->width*4/5, 0, fmt->width, fmt->height},
-            fwd_select = (AABB){fmt->width/5, 0, fmt->width*4/5, fmt->height/3},
-            back_select = (AABB){fmt->width/5, fmt->height*2/3, fmt->width*4/5, fmt->height};
-
-        bool 
-            go_left = point_intersect(dot_pos, left_select) && confidence > 0, 
-            go_right = point_intersect(dot_pos, right_select) && confidence > 0, 
-            go_fwd = point_intersect(dot_pos, fwd_select) && confidence > 0, 
-            go_back = point_intersect(dot_pos, back_select) && confidence > 0;
-
-        draw_box(fmt, rgb, left_select, 1, go_left ? (RGB){0, 255, 0} : (RGB){255, 0, 0});
-        draw_box(fmt, rgb, right_select, 1, go_right ? (RGB){0, 255, 0} : (RGB){255, 0, 0});
-        draw_box(fmt, rgb, fwd_select, 1, go_fwd ? (RGB){0, 255, 0} : (RGB){255, 0, 0});
-        draw_box(fmt, rgb, back_select, 1, go_back ? (RGB){0, 255, 0} : (RGB){255, 0, 0});
-
-        if (fmt->verbose == 1.0f)
-        {
-            if (go_left)
-                printf("Turning left...");
-            else if (go_right)
-                printf("Turning right...");
-            else if (go_fwd)
-                printf("Going forward...");
-            else if (go_back)
-                printf("Going back...");
-            else
-                printf("Idling...");
-            printf("\n");
-        }
-    }
-    
-    return 0;
-}
+#define DEFAULT_WIDTH 640
+#define DEFAULT_HEIGHT 480
+#define MAX_WINDOW_WIDTH 1280 // Larger frames are shown scaled down.
 
 
 typedef struct Save_Img_Thread_Data
@@ -101,7 +41,8 @@ typedef struct Save_Img_Thread_Data
     pthread_t identifier;
     bool complete;
 
-    RGB rgb_copy[IMG_SIZE];
+    RGB *rgb_copy; // Freed by the thread once saved.
+    unsigned int width, height;
     unsigned int frame_num;
 } Save_Img_Thread_Data;
 
@@ -113,13 +54,15 @@ void *threaded_save_png(void *input)
     int name_length = snprintf(NULL, 0, "Frame %d.png", t_data->frame_num);
 
     // Write the name to a string using sprintf.
-    char img_name[name_length];
+    char img_name[name_length + 1];
     sprintf(img_name, "Frame %d.png", t_data->frame_num);
 
     int write_result = stbi_write_png(img_name, 
-        IMG_WIDTH, IMG_HEIGHT, 
-        3, t_data->rgb_copy, IMG_WIDTH * 3);
+        t_data->width, t_data->height, 
+        3, t_data->rgb_copy, t_data->width * 3);
 
+    free(t_data->rgb_copy);
+    t_data->rgb_copy = NULL;
     t_data->complete = true;
 
     if (write_result != 1)
@@ -133,12 +76,103 @@ void *threaded_save_png(void *input)
 }
 
 
+/// @brief Parses a resolution given as [width]x[height] or as a preset like 720p, 1080p or 4k.
+int parse_resolution(const char *value, unsigned int *width, unsigned int *height)
+{
+    static const struct
+    {
+        const char *name;
+        unsigned int width, height;
+    } presets[] = {
+        { "480p", 640, 480 },
+        { "720p", 1280, 720 },
+        { "1080p", 1920, 1080 },
+        { "1440p", 2560, 1440 },
+        { "2160p", 3840, 2160 },
+        { "4k", 3840, 2160 },
+    };
+
+    for (int i = 0; i < (int)(sizeof(presets) / sizeof(presets[0])); i++)
+    {
+        if (strcasecmp(value, presets[i].name) != 0)
+            continue;
+
+        *width = presets[i].width;
+        *height = presets[i].height;
+        return 0;
+    }
+
+    // Pixels are converted in pairs, so the width has to be even.
+    unsigned int w, h;
+    if (sscanf(value, "%ux%u", &w, &h) != 2 || w == 0 || h == 0 || w % 2 != 0)
+    {
+        printf("Invalid resolution %s, expected [width]x[height] with an even width, or a preset like 1080p.\n", value);
+        return -1;
+    }
+
+    *width = w;
+    *height = h;
+    return 0;
+}
+
+
 int start_snatching(int argc, const char *argv[])
 {
+    // Cameras are given as device=[path], once per camera. The first one is shown in the window.
+    // Recordings can be given as a device as well, and are played back instead.
+    const char *devices[MAX_CAMERAS] = { "/dev/video0" };
+    int device_c = 0;
+
+    // The first camera is recorded to record=[path].
+    const char *record_path = NULL;
+
+    // The resolution is requested as resolution=[width]x[height], the first device decides what it gets.
+    unsigned int width = DEFAULT_WIDTH, height = DEFAULT_HEIGHT;
+    bool resolution_given = false;
+    // Without a resolution, latency_target=[ms] picks the largest frame size fast enough. Also read as a setting below.
+    float latency_target = 0.0f;
+    // hsv_benchmark=[s] needs no camera. Also read as a setting below.
+    bool hsv_benchmark_only = false;
+
+    for (int i = 0; i < argc; i++)
+    {
+        if (strncmp(argv[i], "device=", 7) == 0)
+        {
+            if (device_c < MAX_CAMERAS)
+                devices[device_c++] = &argv[i][7];
+            else
+                printf("Ignoring %s, at most %d cameras are supported.\n", argv[i], MAX_CAMERAS);
+        }
+        else if (strncmp(argv[i], "record=", 7) == 0)
+        {
+            record_path = &argv[i][7];
+        }
+        else if (strncmp(argv[i], "resolution=", 11) == 0)
+        {
+            if (parse_resolution(&argv[i][11], &width, &height) == -1)
+                return -1;
+            resolution_given = true;
+        }
+        else if (strncmp(argv[i], "latency_target=", 15) == 0)
+        {
+            latency_target = strtof(&argv[i][15], NULL);
+        }
+        else if (strncmp(argv[i], "hsv_benchmark=", 14) == 0)
+        {
+            hsv_benchmark_only = strtof(&argv[i][14], NULL) > 0.0f;
+        }
+    }
+    device_c = MAX(device_c, 1);
+
+    float required_fps = (!resolution_given && latency_target > 0.0f) ? 1000.0f / latency_target : 0.0f;
+    if (!hsv_benchmark_only && webcam_negotiate_size(devices[0], &width, &height, required_fps) == -1)
+        return -1;
+    printf("Resolution: %ux%u\n", width, height);
+
     Img_Fmt fmt = (Img_Fmt){ 
-        .width = IMG_WIDTH,
-        .height = IMG_HEIGHT,
-        .size = IMG_SIZE,
+        .width = width,
+        .height = height,
+        .size = width * height,
 
         .visualize = 0.0f,
         .greyscale = 0.0f,
@@ -148,7 +182,7 @@ int start_snatching(int argc, const char *argv[])
         .filter_sat = 0.97f,
         .filter_val = 0.99f,
 
-        .scan_rad = MAX(1.2f, IMG_HEIGHT / 80.0f),
+        .scan_rad = MAX(1.2f, height / 80.0f),
         .skip_len = 1.0f,
         .sample_step = 0.0f,
 
@@ -164,7 +198,30 @@ int start_snatching(int argc, const char *argv[])
         .h_white_curve = 1.0f,
 
         .compare_threading = 1.0f,
-        .thread_count = 4.0f,
+        .thread_count = 0.0f,
+        .coarse_scale = 0.0f,
+        .track_radius = 0.0f,
+        .track_refresh = 15.0f,
+        .ycc_detector = 0.0f,
+        .band_stream = 0.0f,
+        .hsv_lut = 0.0f,
+
+        .buffer_count = 4.0f,
+        .queue_policy = 0.0f,
+        .capture_timeout = 1000.0f,
+        .pixel_format = 0.0f,
+        .target_fps = 0.0f,
+        .latency_target = 0.0f,
+        .decode_backend = 0.0f,
+        .capture_memory = 0.0f,
+        .hugepages = 0.0f,
+        .roi_top = 0.0f,
+        .sensor_crop = 1.0f,
+        .replay_speed = 1.0f,
+
+        .benchmark = 0.0f,
+        .decode_benchmark = 0.0f,
+        .hsv_benchmark = 0.0f,
     };
 
     const Key_Mapping mappings[] = {
@@ -180,6 +237,10 @@ int start_snatching(int argc, const char *argv[])
         { &fmt.filter_hue, "filter_hue", SDL_SCANCODE_R, CONTINUOUS, 0.05f },
         { &fmt.filter_sat, "filter_sat", SDL_SCANCODE_T, CONTINUOUS, 0.05f },
         { &fmt.filter_val, "filter_val", SDL_SCANCODE_Y, CONTINUOUS, 0.05f },
+        // Convert & score MJPEG frames band by band while they are decoded.
+        { &fmt.band_stream, "band_stream", SDL_SCANCODE_U, TOGGLE },
+        // Look up HSV values in tables indexed by the max, min & channel differences instead of converting them.
+        { &fmt.hsv_lut, "hsv_lut", SDL_SCANCODE_I, TOGGLE },
 
         // Radius of surrounding pixel scan.
         { &fmt.scan_rad, "scan_rad", SDL_SCANCODE_A, CONTINUOUS, 0.2f },
@@ -206,12 +267,58 @@ int start_snatching(int argc, const char *argv[])
 
         { &fmt.compare_threading, "compare_threading", SDL_SCANCODE_M, TOGGLE },
         { &fmt.thread_count, "thread_count", SDL_SCANCODE_COMMA, STEPWISE, 1.0f },
+        // 0: Decode & scan MJPEG frames whole. 1-3: Find candidates at 1/2, 1/4 or 1/8 size first.
+        { &fmt.coarse_scale, "coarse_scale", SDL_SCANCODE_H, STEPWISE, 1.0f },
+        // Pixels around the predicted position of a found dot that are decoded in the next frame. 0 disables.
+        { &fmt.track_radius, "track_radius", SDL_SCANCODE_J, CONTINUOUS, 4.0f },
+        // Frames between full decodes while following a dot, which find new dots.
+        { &fmt.track_refresh, "track_refresh", SDL_SCANCODE_K, STEPWISE, 1.0f },
+        // Look up the HSV values of decoded MJPEG frames in a YCbCr table instead of converting to RGB first.
+        { &fmt.ycc_detector, "ycc_detector", SDL_SCANCODE_L, TOGGLE },
+
+        // Launch options. These have no key and are only read when the camera is opened.
+        // Amount of capture buffers in the ring shared by the driver and the capture thread.
+        { &fmt.buffer_count, "buffer_count", SDL_SCANCODE_UNKNOWN, STEPWISE, 1.0f },
+        // 0: Always process the latest frame. 1: Process every frame, never dropping any.
+        { &fmt.queue_policy, "queue_policy", SDL_SCANCODE_UNKNOWN, TOGGLE },
+        // Milliseconds without a frame before the camera is considered stalled and restarted.
+        { &fmt.capture_timeout, "capture_timeout", SDL_SCANCODE_UNKNOWN, CONTINUOUS },
+        // 0: Cheapest format the camera offers. 1: MJPEG. 2: YUYV. 3: NV12.
+        { &fmt.pixel_format, "pixel_format", SDL_SCANCODE_UNKNOWN, STEPWISE, 1.0f },
+        // Frame rate to request from the camera. 0 requests the fastest available.
+        { &fmt.target_fps, "target_fps", SDL_SCANCODE_UNKNOWN, CONTINUOUS },
+        // Milliseconds a frame may take to arrive. Picks the cheapest pixel format fast enough. 0 disables.
+        { &fmt.latency_target, "latency_target", SDL_SCANCODE_UNKNOWN, CONTINUOUS },
+        // 0 decodes MJPEG with libjpeg, 1 with TurboJPEG if built with USE_TURBOJPEG.
+        { &fmt.decode_backend, "decode_backend", SDL_SCANCODE_UNKNOWN, TOGGLE },
+        // 0: Driver buffers (MMAP). 1: Application-owned arena (USERPTR). 2: Application-owned DMA-BUFs.
+        { &fmt.capture_memory, "capture_memory", SDL_SCANCODE_UNKNOWN, STEPWISE, 1.0f },
+        // Back the USERPTR arena with huge pages.
+        { &fmt.hugepages, "hugepages", SDL_SCANCODE_UNKNOWN, TOGGLE },
+        // Fraction of the frame height at the top that is neither captured nor scanned.
+        { &fmt.roi_top, "roi_top", SDL_SCANCODE_UNKNOWN, CONTINUOUS },
+        // Crop the region of interest at the sensor if the driver supports it, in software otherwise.
+        { &fmt.sensor_crop, "sensor_crop", SDL_SCANCODE_UNKNOWN, TOGGLE },
+        // Playback speed of recordings given as device. 1: Real time. 0: As fast as possible.
+        { &fmt.replay_speed, "replay_speed", SDL_SCANCODE_UNKNOWN, CONTINUOUS },
+        // Seconds to run each step of the multi-camera benchmark. 0 opens the window as usual.
+        { &fmt.benchmark, "benchmark", SDL_SCANCODE_UNKNOWN, CONTINUOUS },
+        // Seconds to run each step of the MJPEG decode benchmark, on frames of the first device.
+        { &fmt.decode_benchmark, "decode_benchmark", SDL_SCANCODE_UNKNOWN, CONTINUOUS },
+        // Seconds to measure each HSV conversion kernel for, after checking them against rgb_to_hsv.
+        { &fmt.hsv_benchmark, "hsv_benchmark", SDL_SCANCODE_UNKNOWN, CONTINUOUS },
     };
     int mapping_c = sizeof(mappings) / sizeof(Key_Mapping);
 
 
     for (int i = 0; i < argc; i++)
     {
+        // Already handled above.
+        if (strncmp(argv[i], "device=", 7) == 0 ||
+            strncmp(argv[i], "record=", 7) == 0 ||
+            strncmp(argv[i], "resolution=", 11) == 0)
+            continue;
+
         int equals_index;
         for (equals_index = 0; ; equals_index++)
         {
@@ -239,7 +346,40 @@ int start_snatching(int argc, const char *argv[])
     }
     
 
-    if (webcam_init(&fmt) == -1) 
+    // 0 sizes the worker pool from the CPU quota & topology.
+    if (fmt.thread_count < 1.0f)
+        fmt.thread_count = (float)pool_auto_size();
+    fmt.thread_count = MIN(fmt.thread_count, (float)POOL_MAX_THREADS);
+    pool_init((int)fmt.thread_count);
+    printf("Worker pool: %d threads\n", pool_size());
+    hsv_convert_init();
+    printf("HSV kernel: %s\n", hsv_kernel_name());
+
+    if (fmt.decode_backend == 1.0f && !jpeg_turbo_available())
+        printf("Built without USE_TURBOJPEG, decoding with libjpeg.\n");
+
+    if (fmt.benchmark > 0.0f)
+        return pipeline_benchmark(devices, device_c, &fmt, fmt.benchmark);
+    if (fmt.decode_benchmark > 0.0f)
+        return decode_benchmark(devices[0], &fmt, fmt.decode_benchmark);
+    if (fmt.hsv_benchmark > 0.0f)
+        return hsv_benchmark(fmt.hsv_benchmark);
+
+    Webcam *cams[MAX_CAMERAS] = { NULL };
+    for (int i = 0; i < device_c; i++)
+    {
+        if (webcam_init(&cams[i], devices[i], &fmt) == -1) 
+            return -1;
+
+        // Every camera but the first is processed in the background.
+        if (i > 0 && pipeline_start(cams[i], i, device_c, &fmt) == -1)
+            return -1;
+    }
+    Webcam *main_cam = cams[0];
+    Replay *replay = webcam_replay(main_cam);
+
+    Recorder *recorder = NULL;
+    if (record_path != NULL && recorder_open(&recorder, record_path, &fmt, mappings, mapping_c) == -1)
         return -1;
 
     printf("\nOpening Window...\n");
@@ -249,7 +389,15 @@ int start_snatching(int argc, const char *argv[])
         return -1;
     }
 
-    SDL_Window *g_window = SDL_CreateWindow("SDL Window", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, IMG_WIDTH, IMG_HEIGHT, SDL_WINDOW_OPENGL | SDL_WINDOW_SHOWN);
+    // The frame is scaled to fit the window.
+    int window_width = fmt.width, window_height = fmt.height;
+    while (window_width > MAX_WINDOW_WIDTH)
+    {
+        window_width /= 2;
+        window_height /= 2;
+    }
+
+    SDL_Window *g_window = SDL_CreateWindow("SDL Window", SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED, window_width, window_height, SDL_WINDOW_OPENGL | SDL_WINDOW_SHOWN);
     if (g_window == NULL)
     {
         printf("ERROR: %s\n", SDL_GetError());
@@ -263,7 +411,7 @@ int start_snatching(int argc, const char *argv[])
         return -1;
     }
     
-    SDL_Texture *g_stream_texture = SDL_CreateTexture(g_renderer, SDL_PIXELFORMAT_RGB24, SDL_TEXTUREACCESS_STREAMING, IMG_WIDTH, IMG_HEIGHT);
+    SDL_Texture *g_stream_texture = SDL_CreateTexture(g_renderer, SDL_PIXELFORMAT_RGB24, SDL_TEXTUREACCESS_STREAMING, fmt.width, fmt.height);
     if (g_stream_texture == NULL)
     {
         printf("ERROR: %s\n", SDL_GetError());
@@ -279,7 +427,18 @@ int start_snatching(int argc, const char *argv[])
     const Uint8 *state = SDL_GetKeyboardState(&key_c);
     Uint8 l_state[key_c];
 
+    // Holds the current frame. Too large for the stack at higher resolutions.
+    RGB *rgb = malloc(fmt.size * sizeof(RGB));
+    if (rgb == NULL)
+    {
+        printf("Failed to allocate frame buffer!\n");
+        return -1;
+    }
+
     bool escape = false;
+    Frame frame = { .slot = -1 };
+    Dot_Tracker tracker = { 0 };
+    unsigned int frame_num = 0;
 
     timer_init();
     while (!escape)
@@ -291,13 +450,41 @@ int start_snatching(int argc, const char *argv[])
             l_state[i] = state[i];
         SDL_PumpEvents();
 
+        // Background pipelines copy the settings every frame, so they may only change under the lock.
+        pipeline_lock_settings();
         if (handle_keypresses(mappings, mapping_c, state, l_state) == 1)
             escape = true;
+        pipeline_unlock_settings();
 
         // Update webcam handler.
-        if (next_frame() == -1) 
+        int frame_result = next_frame(main_cam);
+        if (frame_result == -1) 
             return -1;
 
+        // Settings changed while recording are played back on the same frame.
+        if (frame_result == 0 && replay != NULL)
+        {
+            pipeline_lock_settings();
+            replay_apply_settings(replay, mappings, mapping_c);
+            pipeline_unlock_settings();
+        }
+
+        if (frame_result == 0 && recorder != NULL)
+            recorder_add_settings(recorder, mappings, mapping_c);
+
+        // Workers are started or retired as thread_count changes, without waiting for running stages.
+        // Compared at the pool's limit, so thread_count raised past it does not resize on every frame.
+        int thread_count = CLAMP((int)fmt.thread_count, 1, POOL_MAX_THREADS);
+        if (thread_count != pool_size())
+            pool_resize(thread_count);
+
+        // No frame arrived in time. Keep handling input while the camera recovers.
+        if (frame_result == 1)
+        {
+            timer_end_measure(FRAME);
+            continue;
+        }
+
         void *window_pixels;
         int pitch;
         if (SDL_LockTexture(g_stream_texture, NULL, &window_pixels, &pitch) < 0) 
@@ -309,11 +496,30 @@ int start_snatching(int argc, const char *argv[])
         // Begin image manipulation.
         timer_begin_measure(MANIPULATION);
 
-        // Create an array and write the current frame's pixel data to it.
-        RGB rgb[IMG_SIZE];
-        if (process_image(&fmt, rgb) == -1) 
+        // Write the current frame's pixel data to the frame buffer.
+        Detection detection = { .camera = 0, .frame_num = frame_num++ };
+        if (process_image(&fmt, main_cam, &frame, rgb, true, &tracker, &detection) == -1) 
             return -1;
 
+        if (fmt.visualize != 1.0f)
+            publish_detection(&detection);
+
+        if (recorder != NULL)
+            recorder_add_frame(recorder, &frame);
+
+        // Report the decisions of all cameras.
+        while (poll_detection(&detection) == 1)
+        {
+            timer_record_latency(detection.camera, detection.sequence, detection.capture_time);
+
+            if (fmt.verbose != 1.0f)
+                continue;
+
+            if (device_c > 1)
+                printf("Camera %d: ", detection.camera);
+            printf("%s\n", direction_name(detection.direction));
+        }
+
         // Checks if space was pressed this frame.
         if (state[SDL_SCANCODE_SPACE] == 1 && l_state[SDL_SCANCODE_SPACE] == 0)
         {
@@ -342,13 +548,22 @@ int start_snatching(int argc, const char *argv[])
 
             printf("Saving Frame %d...\n", img_num);
 
+            RGB *rgb_copy = malloc(fmt.size * sizeof(RGB));
+            if (rgb_copy == NULL)
+            {
+                printf("Failed to allocate frame copy. Saving frame aborted.\n");
+                img_save_th[img_save_i].complete = true; // Leaves the slot free for the next save.
+                goto skip_save;
+            }
+            memcpy(rgb_copy, rgb, fmt.size * sizeof(RGB));
+
             img_save_th[img_save_i] = (Save_Img_Thread_Data){
                 .complete = false,
+                .rgb_copy = rgb_copy,
+                .width = fmt.width,
+                .height = fmt.height,
                 .frame_num = img_num++ 
             };
-
-            for (int i = 0; i < IMG_SIZE; i++)
-                img_save_th[img_save_i].rgb_copy[i] = rgb[i];
             
             // Create a detached thread that tries to save a copy of the current frame.
             pthread_create(&img_save_th[img_save_i].identifier, NULL, threaded_save_png, &img_save_th[img_save_i]);
@@ -356,18 +571,15 @@ int start_snatching(int argc, const char *argv[])
         }
     skip_save:
         
-        // Write the pixel data to the window.
-        for (int i = 0; i < IMG_SIZE; i++)
-        {
-            RGB *window_rgb = &((RGB*)window_pixels)[i];
-            *window_rgb = rgb[i];
-        }
+        // Write the pixel data to the window. Texture rows may be padded.
+        for (int y = 0; y < fmt.height; y++)
+            memcpy((unsigned char*)window_pixels + y * pitch, &rgb[y * fmt.width], fmt.width * sizeof(RGB));
 
         timer_end_measure(MANIPULATION); 
         // End image manipulation.
 
         // Update webcam handler.
-        if (close_frame() == -1) 
+        if (close_frame(main_cam, &frame) == -1) 
             return -1;
 
         SDL_UnlockTexture(g_stream_texture);
@@ -401,6 +613,8 @@ int start_snatching(int argc, const char *argv[])
         }
     }
 
+    free(rgb);
+
     printf("Closing Window...\n");
     SDL_DestroyRenderer(g_renderer);
     
@@ -413,8 +627,12 @@ int start_snatching(int argc, const char *argv[])
     }
     SDL_Quit();
 
-    // Close webcam device.
-    webcam_close(&fmt);
+    recorder_close(recorder);
+
+    // Close webcam devices.
+    pipeline_stop_all();
+    for (int i = 0; i < device_c; i++)
+        webcam_close(cams[i]);
     return 0;
 }
 
@@ -422,7 +640,7 @@ int start_snatching(int argc, const char *argv[])
 int main(int argc, const char *argv[])
 {
     printf("\nInfo:\n");
-    printf("\t[Q]-[Y], [A]-[H], [Z]-[,] can be used to change settings.\n");
+    printf("\t[Q]-[I], [A]-[L], [Z]-[,] can be used to change settings.\n");
     printf("\t[Tab] prints the name and value of all settings.\n");
     printf("\t[Esc] closes out of the program.\n\n");
 
@@ -439,6 +657,10 @@ int main(int argc, const char *argv[])
 
     printf("\n------Out-----------------------\n");
     timer_conclude();
+    printf("\n");
+    pool_report();
+    scan_report();
+    pool_quit();
     printf("\nHandler Output: %i\n", handlerOut);
     printf("--------------------------------\n\n");
 
@@ -0,0 +1,481 @@
+#include "include/recording.h"
+
+#include "include/img_data.h"
+#include "include/webcam_handler.h"
+#include "include/input_handler.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <math.h>
+#include <time.h>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+#define RECORDING_MAGIC "LSRREC01"
+#define RECORDING_ALIGNMENT 64 // Frames start on cache line boundaries in the file.
+#define SETTING_NAME_LENGTH 32
+#define MAX_SETTINGS 64
+
+
+typedef struct Recording_Header
+{
+    char magic[8];
+    uint32_t width, height;
+    uint32_t pixel_format; // Pixel_Format of all frames.
+    uint32_t stride;
+    uint64_t index_offset; // Where the frame & setting entries begin, 0 until the recording is closed.
+    uint32_t frame_count;
+    uint32_t setting_count;
+    uint32_t crop_top; // First row held by the frames if they were cropped at the sensor, 0 otherwise.
+} Recording_Header;
+
+typedef struct Recording_Frame_Entry
+{
+    uint64_t offset;
+    uint32_t size;
+    uint32_t sequence;
+    double timestamp; // When the frame was captured, in CLOCK_MONOTONIC seconds.
+} Recording_Frame_Entry;
+
+typedef struct Recording_Setting_Entry
+{
+    uint32_t frame; // The first frame the value applies to.
+    float value;
+    char name[SETTING_NAME_LENGTH];
+} Recording_Setting_Entry;
+
+
+struct Recorder
+{
+    FILE *file;
+    Recording_Header header;
+    uint64_t offset; // Where the next frame is written.
+
+    Recording_Frame_Entry *frames;
+    unsigned int frame_capacity;
+
+    Recording_Setting_Entry *settings;
+    unsigned int setting_capacity;
+
+    float last_values[MAX_SETTINGS]; // The value of every mapping when last recorded.
+};
+
+struct Replay
+{
+    unsigned char *mem;
+    size_t mem_size;
+
+    const Recording_Header *header;
+    const Recording_Frame_Entry *frames;
+    const Recording_Setting_Entry *settings;
+
+    float speed;
+    AABB roi;
+    unsigned int current; // Index of the frame handed out by replay_next_frame.
+    unsigned int next_setting; // Index of the first setting not applied yet.
+    unsigned int sequence; // Keeps counting over restarts, so restarts are not seen as drops.
+    bool held;
+    bool started;
+
+    double start_time; // When the first frame of the current pass was handed out.
+};
+
+
+/// @brief Returns the current monotonic time in seconds.
+double _recording_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/// @brief Sleeps until a given monotonic time.
+void _sleep_until(double time)
+{
+    struct timespec ts = {
+        .tv_sec = (time_t)time,
+        .tv_nsec = (long)((time - (double)(time_t)time) * 1e9)
+    };
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0)
+        continue;
+}
+
+/// @brief Writes zeros up to the next aligned offset.
+int _write_padding(Recorder *rec)
+{
+    static const unsigned char padding[RECORDING_ALIGNMENT] = { 0 };
+    size_t pad = (RECORDING_ALIGNMENT - rec->offset % RECORDING_ALIGNMENT) % RECORDING_ALIGNMENT;
+
+    if (fwrite(padding, 1, pad, rec->file) != pad)
+        return -1;
+
+    rec->offset += pad;
+    return 0;
+}
+
+/// @brief Grows an entry array to hold at least one more entry.
+int _reserve_entry(void **entries, unsigned int *capacity, unsigned int count, size_t entry_size)
+{
+    if (count < *capacity)
+        return 0;
+
+    unsigned int new_capacity = MAX(64, *capacity * 2);
+    void *new_entries = realloc(*entries, new_capacity * entry_size);
+    if (new_entries == NULL)
+    {
+        printf("Failed to grow the recording index!\n");
+        return -1;
+    }
+
+    *entries = new_entries;
+    *capacity = new_capacity;
+    return 0;
+}
+
+
+int recorder_open(Recorder **out_rec, const char *path, const Img_Fmt *format, const Key_Mapping mappings[], int m_count)
+{
+    *out_rec = NULL;
+
+    Recorder *rec = calloc(1, sizeof(Recorder));
+    if (rec == NULL)
+        return -1;
+
+    rec->file = fopen(path, "wb");
+    if (rec->file == NULL)
+    {
+        printf("Failed to create recording %s!\n", path);
+        free(rec);
+        return -1;
+    }
+
+    memcpy(rec->header.magic, RECORDING_MAGIC, sizeof(rec->header.magic));
+    rec->header.width = format->width;
+    rec->header.height = format->height;
+
+    // Written again with the index offset once closed.
+    if (fwrite(&rec->header, sizeof(Recording_Header), 1, rec->file) != 1)
+    {
+        printf("Failed to write recording header!\n");
+        fclose(rec->file);
+        free(rec);
+        return -1;
+    }
+    rec->offset = sizeof(Recording_Header);
+
+    // Record every initial value, so playback starts from the same settings.
+    for (int i = 0; i < MAX_SETTINGS; i++)
+        rec->last_values[i] = NAN;
+    recorder_add_settings(rec, mappings, m_count);
+
+    printf("Recording to %s.\n", path);
+    *out_rec = rec;
+    return 0;
+}
+
+int recorder_add_frame(Recorder *rec, const Frame *frame)
+{
+    if (frame->data == NULL)
+        return -1;
+
+    if (_reserve_entry((void**)&rec->frames, &rec->frame_capacity, rec->header.frame_count, sizeof(Recording_Frame_Entry)) == -1)
+        return -1;
+
+    // The format is only known once the first frame arrives.
+    if (rec->header.frame_count == 0)
+    {
+        rec->header.pixel_format = frame->format;
+        rec->header.stride = frame->stride;
+        rec->header.crop_top = frame->cropped ? frame->roi.n : 0;
+    }
+
+    if (_write_padding(rec) == -1 ||
+        fwrite(frame->data, 1, frame->size, rec->file) != frame->size)
+    {
+        printf("Failed to write frame %u to the recording!\n", rec->header.frame_count);
+        return -1;
+    }
+
+    rec->frames[rec->header.frame_count++] = (Recording_Frame_Entry){
+        .offset = rec->offset,
+        .size = frame->size,
+        .sequence = frame->sequence,
+        .timestamp = frame->timestamp
+    };
+    rec->offset += frame->size;
+    return 0;
+}
+
+int recorder_add_settings(Recorder *rec, const Key_Mapping mappings[], int m_count)
+{
+    for (int i = 0; i < MIN(m_count, MAX_SETTINGS); i++)
+    {
+        float value = *(float*)mappings[i].ptr;
+
+        // NaN never compares equal, so the first call records everything.
+        if (value == rec->last_values[i])
+            continue;
+
+        if (_reserve_entry((void**)&rec->settings, &rec->setting_capacity, rec->header.setting_count, sizeof(Recording_Setting_Entry)) == -1)
+            return -1;
+
+        Recording_Setting_Entry *entry = &rec->settings[rec->header.setting_count++];
+        memset(entry, 0, sizeof(Recording_Setting_Entry));
+        entry->frame = rec->header.frame_count;
+        entry->value = value;
+        snprintf(entry->name, sizeof(entry->name), "%s", mappings[i].name);
+
+        rec->last_values[i] = value;
+    }
+
+    return 0;
+}
+
+int recorder_close(Recorder *rec)
+{
+    if (rec == NULL)
+        return -1;
+
+    int result = 0;
+
+    // The index is read in place from the mapped file, so it has to be aligned as well.
+    if (_write_padding(rec) == -1)
+        result = -1;
+    rec->header.index_offset = rec->offset;
+
+    if (result == -1 ||
+        fwrite(rec->frames, sizeof(Recording_Frame_Entry), rec->header.frame_count, rec->file) != rec->header.frame_count ||
+        fwrite(rec->settings, sizeof(Recording_Setting_Entry), rec->header.setting_count, rec->file) != rec->header.setting_count ||
+        fseek(rec->file, 0, SEEK_SET) != 0 ||
+        fwrite(&rec->header, sizeof(Recording_Header), 1, rec->file) != 1)
+    {
+        printf("Failed to write the recording index!\n");
+        result = -1;
+    }
+
+    if (fclose(rec->file) != 0)
+        result = -1;
+
+    printf("Recorded %u frames & %u settings changes.\n", rec->header.frame_count, rec->header.setting_count);
+
+    free(rec->frames);
+    free(rec->settings);
+    free(rec);
+    return result;
+}
+
+
+int replay_probe(const char *path, unsigned int *width, unsigned int *height)
+{
+    FILE *file = fopen(path, "rb");
+    if (file == NULL)
+    {
+        printf("Failed to open recording %s!\n", path);
+        return -1;
+    }
+
+    Recording_Header header;
+    size_t read = fread(&header, sizeof(Recording_Header), 1, file);
+    fclose(file);
+
+    if (read != 1 || memcmp(header.magic, RECORDING_MAGIC, sizeof(header.magic)) != 0)
+    {
+        printf("%s is not a recording!\n", path);
+        return -1;
+    }
+
+    *width = header.width;
+    *height = header.height;
+    return 0;
+}
+
+int replay_open(Replay **out_replay, const char *path, const Img_Fmt *format, float speed)
+{
+    *out_replay = NULL;
+
+    int fd = open(path, O_RDONLY);
+    if (fd == -1)
+    {
+        printf("Failed to open recording %s!\n", path);
+        return -1;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(Recording_Header))
+    {
+        printf("%s is not a recording!\n", path);
+        close(fd);
+        return -1;
+    }
+
+    unsigned char *mem = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd); // The mapping stays valid on its own.
+    if (mem == MAP_FAILED)
+    {
+        printf("mmap of recording %s failed!\n", path);
+        return -1;
+    }
+
+    const Recording_Header *header = (const Recording_Header*)mem;
+    size_t index_size = header->frame_count * sizeof(Recording_Frame_Entry) +
+        header->setting_count * sizeof(Recording_Setting_Entry);
+
+    if (memcmp(header->magic, RECORDING_MAGIC, sizeof(header->magic)) != 0 ||
+        header->index_offset == 0 || header->index_offset % RECORDING_ALIGNMENT != 0 || header->frame_count == 0 ||
+        header->index_offset + index_size > (size_t)st.st_size)
+    {
+        printf("%s is not a complete recording!\n", path);
+        goto open_failed;
+    }
+
+    if (header->width != format->width || header->height != format->height)
+    {
+        printf("%s was recorded at %ux%u, expected %ux%u!\n", path,
+            header->width, header->height, format->width, format->height);
+        goto open_failed;
+    }
+
+    const Recording_Frame_Entry *frames = (const Recording_Frame_Entry*)(mem + header->index_offset);
+    for (unsigned int i = 0; i < header->frame_count; i++)
+    {
+        if (frames[i].offset + frames[i].size > header->index_offset)
+        {
+            printf("%s has a corrupt index at frame %u!\n", path, i);
+            goto open_failed;
+        }
+    }
+
+    Replay *replay = calloc(1, sizeof(Replay));
+    if (replay == NULL)
+        goto open_failed;
+
+    replay->mem = mem;
+    replay->mem_size = st.st_size;
+    replay->header = header;
+    replay->frames = frames;
+    replay->settings = (const Recording_Setting_Entry*)(frames + header->frame_count);
+    replay->speed = MAX(0.0f, speed);
+    replay->roi = webcam_roi(format);
+
+    // Touch the file in advance, so playback measures processing rather than disk reads.
+    madvise(mem, st.st_size, MADV_WILLNEED);
+
+    double duration = frames[header->frame_count - 1].timestamp - frames[0].timestamp;
+    printf("Replaying %s: %u frames over %.1f s, %u settings changes, %s.\n", path,
+        header->frame_count, duration, header->setting_count,
+        replay->speed == 0.0f ? "as fast as possible" : "in real time");
+
+    *out_replay = replay;
+    return 0;
+
+open_failed:
+    munmap(mem, st.st_size);
+    return -1;
+}
+
+int replay_next_frame(Replay *replay)
+{
+    if (replay->held)
+        return 0;
+
+    if (replay->started)
+        replay->current++;
+
+    // Start over, from the initial settings again.
+    if (!replay->started || replay->current >= replay->header->frame_count)
+    {
+        replay->current = 0;
+        replay->next_setting = 0;
+        replay->start_time = _recording_now();
+        replay->started = true;
+    }
+
+    if (replay->speed > 0.0f)
+    {
+        double offset = replay->frames[replay->current].timestamp - replay->frames[0].timestamp;
+        _sleep_until(replay->start_time + offset / replay->speed);
+    }
+
+    replay->held = true;
+    return 0;
+}
+
+int replay_get_frame(Replay *replay, Frame *frame)
+{
+    if (!replay->held)
+    {
+        printf("get_frame called without an acquired frame!\n");
+        return -1;
+    }
+
+    const Recording_Frame_Entry *entry = &replay->frames[replay->current];
+
+    frame->slot = (int)replay->current;
+    frame->data = replay->mem + entry->offset;
+    frame->size = entry->size;
+    frame->format = (Pixel_Format)replay->header->pixel_format;
+    frame->stride = replay->header->stride;
+    frame->sequence = replay->sequence++;
+
+    // Frames cropped at the sensor stay cropped, otherwise the region of interest is cropped in software.
+    frame->cropped = replay->header->crop_top != 0;
+    frame->roi = frame->cropped ?
+        (AABB){ .w = 0, .n = replay->header->crop_top, .e = replay->header->width, .s = replay->header->height } :
+        replay->roi;
+
+    // Latency is measured from when the frame is played back, not when it was recorded.
+    frame->timestamp = _recording_now();
+    return 0;
+}
+
+int replay_close_frame(Replay *replay, Frame *frame)
+{
+    if (!replay->held || frame->slot != (int)replay->current)
+        return -1;
+
+    replay->held = false;
+    frame->slot = -1;
+    frame->data = NULL;
+    return 0;
+}
+
+int replay_apply_settings(Replay *replay, const Key_Mapping mappings[], int m_count)
+{
+    while (replay->next_setting < replay->header->setting_count)
+    {
+        const Recording_Setting_Entry *entry = &replay->settings[replay->next_setting];
+        if (entry->frame > replay->current)
+            break;
+
+        for (int i = 0; i < m_count; i++)
+        {
+            if (strncmp(mappings[i].name, entry->name, SETTING_NAME_LENGTH) != 0)
+                continue;
+
+            // Launch options only take effect when a camera is opened.
+            if (mappings[i].SDL_key != SDL_SCANCODE_UNKNOWN)
+                *(float*)mappings[i].ptr = entry->value;
+            break;
+        }
+        replay->next_setting++;
+    }
+
+    return 0;
+}
+
+int replay_close(Replay *replay)
+{
+    if (replay == NULL)
+        return -1;
+
+    munmap(replay->mem, replay->mem_size);
+    free(replay);
+    return 0;
+}
@@ -0,0 +1,554 @@
+#include "include/synthetic_camera.h"
+
+#include "include/img_data.h"
+#include "include/webcam_handler.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <stdbool.h>
+#include <math.h>
+#include <time.h>
+
+#include <jpeglib.h>
+
+
+#define SYNTHETIC_MAX_WHITES 8
+#define SYNTHETIC_MAX_MEMORY (512u * 1024u * 1024u) // Upper bound for all pre-rendered frames.
+#define SYNTHETIC_JPEG_QUALITY 85
+
+
+typedef struct Synthetic_Config
+{
+    int dots; // Amount of dots, each one dimmer than the last.
+    float radius;
+    float intensity;
+    float noise; // Amplitude of the per-pixel noise, 0-255.
+    int whites; // Amount of overexposed white regions.
+    float texture; // Strength of the background pattern, 0-1.
+    int frames; // Length of the rendered loop.
+    unsigned int seed;
+    float speed; // Pixels the dots move per frame.
+    int restart; // MCU rows per JPEG restart interval, 0 for none.
+    int chroma; // JPEG chroma subsampling, 422 or 420.
+} Synthetic_Config;
+
+typedef struct Synthetic_White
+{
+    float x, y;
+    float rx, ry; // Radii of the ellipse.
+} Synthetic_White;
+
+struct Synthetic
+{
+    const Img_Fmt *format;
+    Synthetic_Config config;
+    Pixel_Format pixel_format;
+    unsigned int stride;
+
+    unsigned char **frames; // The rendered loop, in pixel_format.
+    unsigned int *sizes;
+    Synthetic_Dot (*truths)[SYNTHETIC_MAX_DOTS]; // The dots drawn into each frame.
+    int frame_c;
+
+    Synthetic_White whites[SYNTHETIC_MAX_WHITES];
+    float phases[SYNTHETIC_MAX_DOTS * 2]; // Motion phases of every dot along x & y.
+    float texture_phases[4];
+    uint32_t rng;
+
+    int current;
+    unsigned int sequence;
+    bool held;
+    double next_time; // When the next frame is due, if paced.
+};
+
+
+/// @brief Returns the current monotonic time in seconds.
+double _synthetic_now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/// @brief Xorshift random number in 0-1. Deterministic for a given seed.
+float _synthetic_random(Synthetic *syn)
+{
+    syn->rng ^= syn->rng << 13;
+    syn->rng ^= syn->rng >> 17;
+    syn->rng ^= syn->rng << 5;
+    return (float)(syn->rng & 0xFFFFFF) / (float)0x1000000;
+}
+
+/// @brief Parses the ":name=value,..." options following "synthetic".
+int _parse_synthetic_spec(Synthetic_Config *config, const char *spec)
+{
+    *config = (Synthetic_Config){
+        .dots = 1,
+        .radius = 4.0f,
+        .intensity = 1.0f,
+        .noise = 4.0f,
+        .whites = 0,
+        .texture = 0.5f,
+        .frames = 60,
+        .seed = 1,
+        .speed = 3.0f,
+        .restart = 0,
+        .chroma = 422,
+    };
+
+    const char *options = strchr(spec, ':');
+    if (options == NULL)
+        return 0;
+
+    char copy[256];
+    snprintf(copy, sizeof(copy), "%s", options + 1);
+
+    for (char *option = strtok(copy, ","); option != NULL; option = strtok(NULL, ","))
+    {
+        char name[32];
+        float value;
+        if (sscanf(option, "%31[^=]=%f", name, &value) != 2)
+        {
+            printf("Invalid synthetic camera option: %s\n", option);
+            return -1;
+        }
+
+        if      (strcmp(name, "dots") == 0)       config->dots = CLAMP((int)value, 0, SYNTHETIC_MAX_DOTS);
+        else if (strcmp(name, "radius") == 0)     config->radius = MAX(0.5f, value);
+        else if (strcmp(name, "intensity") == 0)  config->intensity = CLAMP(value, 0.0f, 1.0f);
+        else if (strcmp(name, "noise") == 0)      config->noise = CLAMP(value, 0.0f, 255.0f);
+        else if (strcmp(name, "whites") == 0)     config->whites = CLAMP((int)value, 0, SYNTHETIC_MAX_WHITES);
+        else if (strcmp(name, "texture") == 0)    config->texture = CLAMP(value, 0.0f, 1.0f);
+        else if (strcmp(name, "frames") == 0)     config->frames = MAX(1, (int)value);
+        else if (strcmp(name, "seed") == 0)       config->seed = MAX(1u, (unsigned int)value);
+        else if (strcmp(name, "speed") == 0)      config->speed = MAX(0.0f, value);
+        else if (strcmp(name, "restart") == 0)    config->restart = CLAMP((int)value, 0, 65535);
+        else if (strcmp(name, "chroma") == 0)     config->chroma = ((int)value == 420) ? 420 : 422;
+        else
+        {
+            printf("Unknown synthetic camera option: %s\n", name);
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+
+/// @brief Blends a color over a pixel by a factor of t (0-1).
+void _blend_pixel(RGB *pixel, float r, float g, float b, float t)
+{
+    t = CLAMP(t, 0.0f, 1.0f);
+    pixel->R = (unsigned char)CLAMP(pixel->R + (r - pixel->R) * t, 0.0f, 255.0f);
+    pixel->G = (unsigned char)CLAMP(pixel->G + (g - pixel->G) * t, 0.0f, 255.0f);
+    pixel->B = (unsigned char)CLAMP(pixel->B + (b - pixel->B) * t, 0.0f, 255.0f);
+}
+
+/// @brief Draws a textured background with overexposed white regions.
+void _render_background(Synthetic *syn, RGB *rgb)
+{
+    const Img_Fmt *fmt = syn->format;
+    float texture = syn->config.texture;
+    const float *p = syn->texture_phases;
+
+    for (unsigned int y = 0; y < fmt->height; y++)
+    {
+        for (unsigned int x = 0; x < fmt->width; x++)
+        {
+            float u = (float)x / fmt->width, v = (float)y / fmt->height;
+
+            // A soft gradient with a few overlapping waves, in muted indoor colors.
+            float pattern =
+                sinf(u * 11.0f + p[0]) * sinf(v * 7.0f + p[1]) +
+                0.5f * sinf((u + v) * 23.0f + p[2]) +
+                0.25f * sinf(u * 53.0f - v * 41.0f + p[3]);
+
+            float base = 70.0f + 60.0f * v + 35.0f * texture * pattern;
+            rgb[y * fmt->width + x] = (RGB){
+                (unsigned char)CLAMP(base * 0.95f, 0.0f, 255.0f),
+                (unsigned char)CLAMP(base * 1.00f + 10.0f * texture * pattern, 0.0f, 255.0f),
+                (unsigned char)CLAMP(base * 0.90f + 20.0f * v, 0.0f, 255.0f)
+            };
+        }
+    }
+
+    // Lamps & reflections, clipped to pure white like the core of a laser dot.
+    for (int i = 0; i < syn->config.whites; i++)
+    {
+        const Synthetic_White *white = &syn->whites[i];
+        int
+            x0 = MAX(0, (int)(white->x - white->rx - 2)),
+            x1 = MIN((int)fmt->width - 1, (int)(white->x + white->rx + 2)),
+            y0 = MAX(0, (int)(white->y - white->ry - 2)),
+            y1 = MIN((int)fmt->height - 1, (int)(white->y + white->ry + 2));
+
+        for (int y = y0; y <= y1; y++)
+        {
+            for (int x = x0; x <= x1; x++)
+            {
+                float dx = (x - white->x) / white->rx, dy = (y - white->y) / white->ry;
+                float d = sqrtf(dx * dx + dy * dy);
+
+                _blend_pixel(&rgb[y * fmt->width + x], 255.0f, 255.0f, 255.0f, (1.0f - d) * 4.0f);
+            }
+        }
+    }
+}
+
+/// @brief Draws an anti-aliased laser dot: a clipped white core, a red disk and a red glow.
+void _render_dot(Synthetic *syn, RGB *rgb, const Synthetic_Dot *dot)
+{
+    const Img_Fmt *fmt = syn->format;
+    float reach = dot->radius * 2.5f + 1.0f;
+
+    int
+        x0 = MAX(0, (int)floorf(dot->x - reach)),
+        x1 = MIN((int)fmt->width - 1, (int)ceilf(dot->x + reach)),
+        y0 = MAX(0, (int)floorf(dot->y - reach)),
+        y1 = MIN((int)fmt->height - 1, (int)ceilf(dot->y + reach));
+
+    for (int y = y0; y <= y1; y++)
+    {
+        for (int x = x0; x <= x1; x++)
+        {
+            // Pixel centers are at half coordinates.
+            float dx = (x + 0.5f) - dot->x, dy = (y + 0.5f) - dot->y;
+            float d = sqrtf(dx * dx + dy * dy);
+            RGB *pixel = &rgb[y * fmt->width + x];
+
+            float glow = expf(-(d - dot->radius) * (d - dot->radius) / (dot->radius * dot->radius));
+            if (d > dot->radius)
+                _blend_pixel(pixel, 255.0f, 20.0f, 30.0f, glow * 0.5f * dot->intensity);
+
+            float coverage = dot->radius + 0.5f - d;
+            _blend_pixel(pixel, 255.0f, 35.0f, 40.0f, coverage * dot->intensity);
+
+            float core = dot->radius * 0.45f + 0.5f - d;
+            _blend_pixel(pixel, 255.0f, 255.0f, 255.0f, core * dot->intensity);
+        }
+    }
+}
+
+/// @brief Adds uniform per-pixel noise.
+void _render_noise(Synthetic *syn, RGB *rgb)
+{
+    if (syn->config.noise <= 0.0f)
+        return;
+
+    for (unsigned int i = 0; i < syn->format->size; i++)
+    {
+        float n = (_synthetic_random(syn) * 2.0f - 1.0f) * syn->config.noise;
+        rgb[i].R = (unsigned char)CLAMP(rgb[i].R + n, 0.0f, 255.0f);
+        rgb[i].G = (unsigned char)CLAMP(rgb[i].G + n, 0.0f, 255.0f);
+        rgb[i].B = (unsigned char)CLAMP(rgb[i].B + n, 0.0f, 255.0f);
+    }
+}
+
+/// @brief Positions the dots of a frame along looping Lissajous paths.
+void _place_dots(Synthetic *syn, int frame, Synthetic_Dot *dots)
+{
+    const Img_Fmt *fmt = syn->format;
+    float margin = syn->config.radius * 3.0f;
+    float ax = fmt->width / 2.0f - margin, ay = fmt->height / 2.0f - margin;
+
+    // One full loop of the path per frame loop, so playback has no jumps.
+    // The path length roughly matches speed pixels per frame.
+    float loops = (syn->config.speed == 0.0f) ? 0.0f :
+        MAX(1.0f, roundf(syn->config.speed * syn->frame_c / (2.0f * PI * MAX(ax, ay))));
+    float t = 2.0f * PI * frame / syn->frame_c;
+
+    for (int i = 0; i < syn->config.dots; i++)
+    {
+        dots[i] = (Synthetic_Dot){
+            .x = fmt->width / 2.0f + ax * sinf(t * loops + syn->phases[i * 2]),
+            .y = fmt->height / 2.0f + ay * sinf(t * (loops + 1.0f) + syn->phases[i * 2 + 1]),
+            .radius = syn->config.radius,
+            .intensity = syn->config.intensity * (1.0f - 0.2f * i),
+        };
+    }
+}
+
+
+/// @brief Converts RGB to studio-range YUV, the inverse of the conversion in img_processing.
+void _rgb_to_yuv(RGB rgb, unsigned char *y, int *u, int *v)
+{
+    *y = (unsigned char)(((66 * rgb.R + 129 * rgb.G + 25 * rgb.B + 128) >> 8) + 16);
+    *u = ((-38 * rgb.R - 74 * rgb.G + 112 * rgb.B + 128) >> 8) + 128;
+    *v = ((112 * rgb.R - 94 * rgb.G - 18 * rgb.B + 128) >> 8) + 128;
+}
+
+void _encode_yuyv(const Img_Fmt *fmt, const RGB *rgb, unsigned char *yuyv)
+{
+    for (unsigned int i = 0; i < fmt->size; i += 2)
+    {
+        unsigned char y1, y2;
+        int u1, v1, u2, v2;
+        _rgb_to_yuv(rgb[i], &y1, &u1, &v1);
+        _rgb_to_yuv(rgb[i + 1], &y2, &u2, &v2);
+
+        yuyv[i * 2 + 0] = y1;
+        yuyv[i * 2 + 1] = (unsigned char)((u1 + u2) / 2);
+        yuyv[i * 2 + 2] = y2;
+        yuyv[i * 2 + 3] = (unsigned char)((v1 + v2) / 2);
+    }
+}
+
+void _encode_nv12(const Img_Fmt *fmt, const RGB *rgb, unsigned char *nv12)
+{
+    unsigned char *uv_plane = nv12 + fmt->size;
+
+    for (unsigned int y = 0; y < fmt->height; y += 2)
+    {
+        for (unsigned int x = 0; x < fmt->width; x += 2)
+        {
+            int u_sum = 0, v_sum = 0;
+            for (int j = 0; j < 4; j++)
+            {
+                unsigned int i = (y + j / 2) * fmt->width + x + j % 2;
+                int u, v;
+                _rgb_to_yuv(rgb[i], &nv12[i], &u, &v);
+                u_sum += u;
+                v_sum += v;
+            }
+
+            uv_plane[(y / 2) * fmt->width + x] = (unsigned char)(u_sum / 4);
+            uv_plane[(y / 2) * fmt->width + x + 1] = (unsigned char)(v_sum / 4);
+        }
+    }
+}
+
+/// @brief Compresses a frame to JPEG with 4:2:2 chroma like most MJPEG webcams, or 4:2:0 if configured.
+/// @return The size of the JPEG, or 0 on failure. The data is allocated & stored in out.
+unsigned int _encode_mjpeg(const Img_Fmt *fmt, const Synthetic_Config *config, const RGB *rgb, unsigned char **out)
+{
+    struct jpeg_compress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+    unsigned long size = 0;
+    *out = NULL;
+
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_compress(&cinfo);
+    jpeg_mem_dest(&cinfo, out, &size);
+
+    cinfo.image_width = fmt->width;
+    cinfo.image_height = fmt->height;
+    cinfo.input_components = 3;
+    cinfo.in_color_space = JCS_RGB;
+    jpeg_set_defaults(&cinfo);
+    jpeg_set_quality(&cinfo, SYNTHETIC_JPEG_QUALITY, TRUE);
+
+    cinfo.comp_info[0].h_samp_factor = 2;
+    cinfo.comp_info[0].v_samp_factor = (config->chroma == 420) ? 2 : 1;
+    cinfo.restart_in_rows = config->restart;
+
+    jpeg_start_compress(&cinfo, TRUE);
+    while (cinfo.next_scanline < cinfo.image_height)
+    {
+        JSAMPROW row = (JSAMPROW)&rgb[cinfo.next_scanline * fmt->width];
+        jpeg_write_scanlines(&cinfo, &row, 1);
+    }
+    jpeg_finish_compress(&cinfo);
+    jpeg_destroy_compress(&cinfo);
+
+    return (unsigned int)size;
+}
+
+/// @brief Renders a frame & stores it in the negotiated pixel format.
+int _render_frame(Synthetic *syn, RGB *rgb, int frame)
+{
+    const Img_Fmt *fmt = syn->format;
+    Synthetic_Dot *dots = syn->truths[frame];
+
+    _render_background(syn, rgb);
+    _place_dots(syn, frame, dots);
+
+    // Dimmer dots first, so the strongest one is drawn on top.
+    for (int i = syn->config.dots - 1; i >= 0; i--)
+        _render_dot(syn, rgb, &dots[i]);
+
+    _render_noise(syn, rgb);
+
+    switch (syn->pixel_format)
+    {
+    case PIX_MJPEG:
+        syn->sizes[frame] = _encode_mjpeg(fmt, &syn->config, rgb, &syn->frames[frame]);
+        return syn->sizes[frame] > 0 ? 0 : -1;
+
+    case PIX_NV12:
+        syn->sizes[frame] = fmt->size * 3 / 2;
+        syn->frames[frame] = malloc(syn->sizes[frame]);
+        if (syn->frames[frame] == NULL)
+            return -1;
+        _encode_nv12(fmt, rgb, syn->frames[frame]);
+        return 0;
+
+    case PIX_YUYV:
+    default:
+        syn->sizes[frame] = fmt->size * 2;
+        syn->frames[frame] = malloc(syn->sizes[frame]);
+        if (syn->frames[frame] == NULL)
+            return -1;
+        _encode_yuyv(fmt, rgb, syn->frames[frame]);
+        return 0;
+    }
+}
+
+
+int synthetic_open(Synthetic **out_syn, const char *spec, const Img_Fmt *format)
+{
+    *out_syn = NULL;
+
+    Synthetic *syn = calloc(1, sizeof(Synthetic));
+    if (syn == NULL)
+        return -1;
+
+    if (_parse_synthetic_spec(&syn->config, spec) == -1)
+    {
+        free(syn);
+        return -1;
+    }
+
+    syn->format = format;
+    syn->rng = syn->config.seed * 2654435761u;
+
+    // Raw frames are the cheapest to produce & process, MJPEG is only used if asked for.
+    syn->pixel_format = (format->pixel_format == PIX_MJPEG || format->pixel_format == PIX_NV12) ?
+        (Pixel_Format)format->pixel_format : PIX_YUYV;
+    syn->stride = (syn->pixel_format == PIX_YUYV) ? format->width * 2 : format->width;
+
+    unsigned int frame_bytes = (syn->pixel_format == PIX_YUYV) ? format->size * 2 : format->size * 3 / 2;
+    syn->frame_c = MIN(syn->config.frames, (int)MAX(1u, SYNTHETIC_MAX_MEMORY / frame_bytes));
+
+    for (int i = 0; i < SYNTHETIC_MAX_DOTS * 2; i++)
+        syn->phases[i] = _synthetic_random(syn) * 2.0f * PI;
+    for (int i = 0; i < 4; i++)
+        syn->texture_phases[i] = _synthetic_random(syn) * 2.0f * PI;
+
+    for (int i = 0; i < syn->config.whites; i++)
+    {
+        syn->whites[i] = (Synthetic_White){
+            .x = _synthetic_random(syn) * format->width,
+            .y = _synthetic_random(syn) * format->height,
+            .rx = format->width * (0.03f + 0.05f * _synthetic_random(syn)),
+            .ry = format->height * (0.03f + 0.05f * _synthetic_random(syn)),
+        };
+    }
+
+    syn->frames = calloc(syn->frame_c, sizeof(unsigned char*));
+    syn->sizes = calloc(syn->frame_c, sizeof(unsigned int));
+    syn->truths = calloc(syn->frame_c, sizeof(syn->truths[0]));
+    RGB *rgb = malloc(format->size * sizeof(RGB));
+
+    if (syn->frames == NULL || syn->sizes == NULL || syn->truths == NULL || rgb == NULL)
+    {
+        printf("Failed to allocate synthetic camera!\n");
+        free(rgb);
+        synthetic_close(syn);
+        return -1;
+    }
+
+    // Everything is rendered up front, so producing frames costs nothing while measuring.
+    for (int i = 0; i < syn->frame_c; i++)
+    {
+        if (_render_frame(syn, rgb, i) == -1)
+        {
+            printf("Failed to render synthetic frame %d!\n", i);
+            free(rgb);
+            synthetic_close(syn);
+            return -1;
+        }
+    }
+    free(rgb);
+
+    syn->current = -1;
+    syn->next_time = _synthetic_now();
+
+    printf("Synthetic camera: %ux%u %s, %d frames, %d dot(s) of radius %.1f, noise %.0f, %d white region(s).\n",
+        format->width, format->height,
+        syn->pixel_format == PIX_MJPEG ? "MJPEG" : (syn->pixel_format == PIX_NV12 ? "NV12" : "YUYV"),
+        syn->frame_c, syn->config.dots, syn->config.radius, syn->config.noise, syn->config.whites);
+
+    *out_syn = syn;
+    return 0;
+}
+
+int synthetic_next_frame(Synthetic *syn)
+{
+    if (syn->held)
+        return 0;
+
+    if (syn->format->target_fps > 0.0f)
+    {
+        struct timespec ts = {
+            .tv_sec = (time_t)syn->next_time,
+            .tv_nsec = (long)((syn->next_time - (double)(time_t)syn->next_time) * 1e9)
+        };
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) != 0)
+            continue;
+
+        syn->next_time = MAX(syn->next_time + 1.0 / syn->format->target_fps, _synthetic_now() - 1.0);
+    }
+
+    syn->current = (syn->current + 1) % syn->frame_c;
+    syn->held = true;
+    return 0;
+}
+
+int synthetic_get_frame(Synthetic *syn, Frame *frame)
+{
+    if (!syn->held)
+    {
+        printf("get_frame called without an acquired frame!\n");
+        return -1;
+    }
+
+    frame->slot = syn->current;
+    frame->data = syn->frames[syn->current];
+    frame->size = syn->sizes[syn->current];
+    frame->format = syn->pixel_format;
+    frame->stride = syn->stride;
+    frame->sequence = syn->sequence++;
+    frame->timestamp = _synthetic_now();
+    frame->roi = webcam_roi(syn->format);
+    frame->cropped = false;
+    return 0;
+}
+
+int synthetic_close_frame(Synthetic *syn, Frame *frame)
+{
+    if (!syn->held || frame->slot != syn->current)
+        return -1;
+
+    syn->held = false;
+    frame->slot = -1;
+    frame->data = NULL;
+    return 0;
+}
+
+int synthetic_truth(Synthetic *syn, const Synthetic_Dot **dots, int *dot_c)
+{
+    if (syn->current < 0)
+        return -1;
+
+    *dots = syn->truths[syn->current];
+    *dot_c = syn->config.dots;
+    return 0;
+}
+
+int synthetic_close(Synthetic *syn)
+{
+    if (syn == NULL)
+        return -1;
+
+    if (syn->frames != NULL)
+        for (int i = 0; i < syn->frame_c; i++)
+            free(syn->frames[i]);
+
+    free(syn->frames);
+    free(syn->sizes);
+    free(syn->truths);
+    free(syn);
+    return 0;
+}
@@ -2,13 +2,18 @@
 #include "include/timer.h"
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
+#include <time.h>
 
 #include <omp.h>
+#include <pthread.h>
 
 
 #define TIMED_FRAMES 256
+#define LATENCY_SAMPLES 4096
+#define MAX_SOURCES 8
 
 
 typedef struct Timer_Data
@@ -16,27 +21,23 @@ typedef struct Timer_Data
     double start_time;
     double stop_time;
 
+    // Indexed by timer_type.
+    double times[TIMER_TYPE_COUNT][TIMED_FRAMES];
+    unsigned short counts[TIMER_TYPE_COUNT];
 
-    double frame_times[TIMED_FRAMES];
-    double manipulation_times[TIMED_FRAMES];
-
-    double conversion_times[TIMED_FRAMES];
-    double t_conversion_times[TIMED_FRAMES];
-    
-    double scan_times[TIMED_FRAMES];
-    double t_scan_times[TIMED_FRAMES];
-
-
-    unsigned short frame_count;
-    unsigned short manipulation_count;
-    unsigned short conversion_count;
-    unsigned short t_conversion_count;
-    unsigned short scan_count;
-    unsigned short t_scan_count;
+    // Capture to decision latencies in ms.
+    double latencies[LATENCY_SAMPLES];
+    unsigned int latency_count;
 
+    // Last sequence number seen per camera, -1 if none.
+    long long last_sequence[MAX_SOURCES];
+    unsigned int dropped_count;
 
     bool initialized;
     bool stopped;
+
+    // Only the thread that initialized the timer is measured, other camera pipelines are ignored.
+    pthread_t owner;
 } Timer_Data;
 
 static Timer_Data timer;
@@ -47,43 +48,14 @@ int timer_begin_measure(enum timer_type type)
     if (!timer.initialized || timer.stopped)
         return -1;
 
-    unsigned short *count;
-    double *times;
+    if (!pthread_equal(pthread_self(), timer.owner))
+        return -1;
 
-    switch (type)
-    {
-    case FRAME:
-        count = &timer.frame_count;
-        times = timer.frame_times;
-        break;
-
-    case MANIPULATION:
-        count = &timer.manipulation_count;
-        times = timer.manipulation_times;
-        break;
-
-    case CONVERSION:
-        count = &timer.conversion_count;
-        times = timer.conversion_times;
-        break;
-
-    case T_CONVERSION:
-        count = &timer.t_conversion_count;
-        times = timer.t_conversion_times;
-        break;
-
-    case SCAN:
-        count = &timer.scan_count;
-        times = timer.scan_times;
-        break;
-
-    case T_SCAN:
-        count = &timer.t_scan_count;
-        times = timer.t_scan_times;
-        break;
-
-    default: return -1;
-    }
+    if (type < FRAME || type >= TIMER_TYPE_COUNT)
+        return -1;
+
+    unsigned short *count = &timer.counts[type];
+    double *times = timer.times[type];
 
     if (*count >= TIMED_FRAMES)
         return 1;
@@ -97,43 +69,14 @@ int timer_end_measure(enum timer_type type)
     if (!timer.initialized || timer.stopped)
         return -1;
 
-    unsigned short *count;
-    double *times;
+    if (!pthread_equal(pthread_self(), timer.owner))
+        return -1;
 
-    switch (type)
-    {
-    case FRAME:
-        count = &timer.frame_count;
-        times = timer.frame_times;
-        break;
-
-    case MANIPULATION:
-        count = &timer.manipulation_count;
-        times = timer.manipulation_times;
-        break;
-
-    case CONVERSION:
-        count = &timer.conversion_count;
-        times = timer.conversion_times;
-        break;
-
-    case T_CONVERSION:
-        count = &timer.t_conversion_count;
-        times = timer.t_conversion_times;
-        break;
-
-    case SCAN:
-        count = &timer.scan_count;
-        times = timer.scan_times;
-        break;
-
-    case T_SCAN:
-        count = &timer.t_scan_count;
-        times = timer.t_scan_times;
-        break;
-
-    default: return -1;
-    }
+    if (type < FRAME || type >= TIMER_TYPE_COUNT)
+        return -1;
+
+    unsigned short *count = &timer.counts[type];
+    double *times = timer.times[type];
 
     if (*count >= TIMED_FRAMES)
         return 1;
@@ -147,6 +90,37 @@ int timer_end_measure(enum timer_type type)
     return 0;
 }
 
+int timer_record_latency(int camera, unsigned int sequence, double capture_time)
+{
+    if (!timer.initialized || timer.stopped)
+        return -1;
+
+    if (!pthread_equal(pthread_self(), timer.owner))
+        return -1;
+
+    if (camera < 0 || camera >= MAX_SOURCES)
+        return -1;
+
+    // A lower sequence number means the device was recovered and its counter restarted.
+    long long last = timer.last_sequence[camera];
+    if (last >= 0 && sequence > last + 1)
+        timer.dropped_count += sequence - (unsigned int)last - 1;
+    timer.last_sequence[camera] = sequence;
+
+    if (timer.latency_count >= LATENCY_SAMPLES)
+        return 1;
+
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    double now = (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+
+    timer.latencies[timer.latency_count++] = (now - capture_time) * 1000.0;
+    if (timer.latency_count >= LATENCY_SAMPLES)
+        printf("Latency cap reached.\n");
+
+    return 0;
+}
+
 
 int timer_init()
 {
@@ -155,6 +129,10 @@ int timer_init()
 
     timer.initialized = true;
     timer.stopped = false;
+    timer.owner = pthread_self();
+
+    for (int i = 0; i < MAX_SOURCES; i++)
+        timer.last_sequence[i] = -1;
 
     timer.start_time = omp_get_wtime();
     return 0;
@@ -170,67 +148,75 @@ int timer_quit()
     return 0;
 }
 
-int timer_conclude()
+/// @brief Returns the average of all measurements of a type in ms, or 0 if there are none.
+double _timer_average(enum timer_type type)
 {
-    if (!timer.initialized || !timer.stopped)
-        return -1;
-
-    double tot_frame_time = 0;
-    for (int i = 0; i < timer.frame_count; i++)
-    {
-        tot_frame_time += timer.frame_times[i];
-    }
-    double avg_frame_time = (float)tot_frame_time / (float)timer.frame_count;
+    if (timer.counts[type] == 0)
+        return 0.0;
 
-    double tot_manipulation_time = 0;
-    for (int i = 0; i < timer.manipulation_count; i++)
+    double tot_time = 0;
+    for (int i = 0; i < timer.counts[type]; i++)
     {
-        tot_manipulation_time += timer.manipulation_times[i];
+        tot_time += timer.times[type][i];
     }
-    double avg_manipulation_time = (float)tot_manipulation_time / (float)timer.manipulation_count;
-
-
-    double tot_conversion_time = 0;
-    for (int i = 0; i < timer.conversion_count; i++)
-    {
-        tot_conversion_time += timer.conversion_times[i];
-    }
-    double avg_conversion_time = (float)tot_conversion_time / (float)timer.conversion_count;
+    return tot_time / (double)timer.counts[type];
+}
 
-    double tot_t_conversion_time = 0;
-    for (int i = 0; i < timer.t_conversion_count; i++)
-    {
-        tot_t_conversion_time += timer.t_conversion_times[i];
-    }
-    double avg_t_conversion_time = (float)tot_t_conversion_time / (float)timer.t_conversion_count;
+int _compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
 
+/// @brief Returns the p-th percentile (0-1) of sorted values.
+double _percentile(const double *sorted, unsigned int count, double p)
+{
+    unsigned int i = (unsigned int)(p * (count - 1) + 0.5);
+    return sorted[i];
+}
 
-    double tot_scan_time = 0;
-    for (int i = 0; i < timer.scan_count; i++)
-    {
-        tot_scan_time += timer.scan_times[i];
-    }
-    double avg_scan_time = (float)tot_scan_time / (float)timer.scan_count;
+int timer_conclude()
+{
+    if (!timer.initialized || !timer.stopped)
+        return -1;
 
-    double tot_t_scan_time = 0;
-    for (int i = 0; i < timer.t_scan_count; i++)
-    {
-        tot_t_scan_time += timer.t_scan_times[i];
-    }
-    double avg_t_scan_time = (float)tot_t_scan_time / (float)timer.t_scan_count;
+    double avg_frame_time = _timer_average(FRAME);
+    double avg_manipulation_time = _timer_average(MANIPULATION);
+    double avg_decode_time = _timer_average(DECODE);
+    double avg_conversion_time = _timer_average(CONVERSION);
+    double avg_t_conversion_time = _timer_average(T_CONVERSION);
+    double avg_scan_time = _timer_average(SCAN);
+    double avg_t_scan_time = _timer_average(T_SCAN);
 
 
     printf("Runtime Duration: %.0f ms\n", (float)((timer.stop_time - timer.start_time) * 1000.0));
-    printf("Frames Tracked: %d\n\n", (int)timer.frame_count);
-    
+    printf("Frames Tracked: %d\n\n", (int)timer.counts[FRAME]);
+
     printf("Avg. Frame: %.2f ms (%.2f fps)\n\n", avg_frame_time, (float)(1000.0 / avg_frame_time));
 
     printf("Avg. Manipulation: %.2f ms\n\n", avg_manipulation_time);
 
+    if (timer.counts[DECODE] > 0)
+        printf("Avg. Decode: %.3f ms\n\n", avg_decode_time);
+    else
+        printf("Avg. Decode: none (raw frames)\n\n");
+
     printf("Avg. Conversion: \nst: %.3f ms\nmt: %.3f ms\n\n", avg_conversion_time, avg_t_conversion_time);
 
     printf("Avg. Scan: \nst: %.3f ms\nmt: %.3f ms\n\n", avg_scan_time, avg_t_scan_time);
 
+    if (timer.latency_count > 0)
+    {
+        qsort(timer.latencies, timer.latency_count, sizeof(double), _compare_doubles);
+        printf("Capture to Decision (%u frames): \np50: %.2f ms\np90: %.2f ms\np99: %.2f ms\nmax: %.2f ms\n",
+            timer.latency_count,
+            _percentile(timer.latencies, timer.latency_count, 0.50),
+            _percentile(timer.latencies, timer.latency_count, 0.90),
+            _percentile(timer.latencies, timer.latency_count, 0.99),
+            timer.latencies[timer.latency_count - 1]);
+        printf("Dropped: %u frames without a decision\n\n", timer.dropped_count);
+    }
+
     printf("(st = single-threaded, mt = multi-threaded)\n");
     return 0;
 }
@@ -1,131 +1,653 @@
-
 #define USE_THREADS
 
 #include "include/webcam_handler.h"
 #include "include/img_data.h"
+#include "include/buffer_arena.h"
+#include "include/recording.h"
+#include "include/synthetic_camera.h"
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <errno.h>
+#include <time.h>
 
 #include <fcntl.h>
+#include <poll.h>
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
 #include <unistd.h>
+#include <pthread.h>
+#include <semaphore.h>
 
 #include <linux/videodev2.h>
 
 
-typedef struct Capture_Data
-{
-    int handle;
-    unsigned char *img_mem[2];
-} Capture_Data;
+#define MAX_BUFFERS 32 // Must be a power of two, as slots encode their index in the low bits.
+#define MIN_BUFFERS 2
+#define RING_SIZE (MAX_BUFFERS * 2) // Room for stale slots from a previous session during recovery.
+#define MAX_VIDEO_DEVICES 64
 
-static Capture_Data capture_data;
+// A slot encodes both the buffer index and the streaming session (generation) it belongs to,
+// so that frames captured before a device recovery are never requeued into the new session.
+#define SLOT_INDEX(slot) ((slot) & (MAX_BUFFERS - 1))
+#define SLOT_GEN(slot) (((unsigned int)(slot) / MAX_BUFFERS) & 0xFFFFFF)
+#define MAKE_SLOT(gen, index) ((int)(((gen) & 0xFFFFFF) * MAX_BUFFERS + (index)))
 
 
+/// @brief Lock-free single-producer single-consumer ring of buffer slots.
+typedef struct Slot_Ring
+{
+    atomic_int slots[RING_SIZE];
+    atomic_uint head; // Next index to be written by the producer.
+    atomic_uint tail; // Next index to be read by the consumer.
+} Slot_Ring;
+
 typedef struct V4L2_Container
 {
+    struct v4l2_capability capability;
     struct v4l2_format format;
     struct v4l2_requestbuffers buffer_request;
     struct v4l2_buffer query_buffer;
-    struct v4l2_buffer write_buffer;
-    struct v4l2_buffer queue_buffer;
 } V4L2_Container;
 
-static V4L2_Container v4l2_container;
+struct Webcam
+{
+    Replay *replay; // Set if frames come from a recording instead of a device.
+    Synthetic *synthetic; // Set if frames are generated instead of captured.
+
+    char device[64];
+    char bus_info[32]; // Used to find the same camera again if its device node changes.
+    const Img_Fmt *format;
+
+    int format_option; // Index of the negotiated entry in format_options.
+    Pixel_Format pixel_format;
+    unsigned int stride; // Bytes per row of the first plane.
+    float max_fps; // Highest frame rate offered for the negotiated format, 0 if unknown.
+    struct v4l2_fract fastest_interval; // The interval max_fps was taken from, 0/0 if unknown.
+    struct v4l2_fract frame_interval; // The interval the driver settled on, 0/0 if not adjustable.
+    AABB roi; // The region of interest, in full-frame pixels.
+    bool sensor_crop; // Set if the driver crops frames to roi, otherwise it is cropped in software.
+
+    Capture_Memory memory; // How buffers are allocated. Falls back to CAPTURE_MMAP if unsupported.
+    bool hugepages;
+    Buffer_Arena arena; // Buffer memory for CAPTURE_USERPTR & CAPTURE_DMABUF, kept across sessions.
+
+    int handle;
+    int wake_fd; // Wakes the capture thread when a buffer is released or on shutdown.
+    unsigned int requested_count;
+    unsigned int buffer_count;
+    unsigned char *img_mem[MAX_BUFFERS];
+    unsigned int img_len[MAX_BUFFERS]; // Mapped or allocated length of each buffer.
+    unsigned int img_used[MAX_BUFFERS]; // Bytes filled in each buffer by the last dequeue.
+    double img_timestamp[MAX_BUFFERS]; // When each buffer's frame was captured, CLOCK_MONOTONIC seconds.
+    unsigned int img_sequence[MAX_BUFFERS]; // The driver's sequence number of each buffer's frame.
+    unsigned int queued_count; // Buffers currently owned by the driver. Capture thread only.
+
+    Queue_Policy policy;
+    int timeout_ms;
+    Slot_Ring ready; // Filled buffers waiting to be processed (QUEUE_NO_DROP).
+    Slot_Ring released; // Buffers handed back by the consumer, requeued by the capture thread.
+    atomic_int latest; // The newest filled buffer, -1 if empty (QUEUE_LATEST).
+    sem_t frame_sem; // Posted once per frame made available to the consumer.
+
+    atomic_uint generation; // Incremented every time the streaming session is torn down.
+    atomic_int held; // The slot currently acquired by the consumer, -1 if none.
+
+    pthread_t thread;
+    atomic_bool running;
+    bool streaming;
+
+    atomic_uint captured_count; // Frames dequeued from the driver.
+    atomic_uint skipped_count; // Frames requeued without ever being handed over.
+    unsigned int lost_count; // Frames the driver dropped, from gaps in the sequence numbers.
+    long long last_sequence; // Sequence number of the last dequeued frame, -1 after (re)starting.
+    unsigned int stall_count; // Times the device produced no frame within the timeout.
+    unsigned int recovery_count; // Times the streaming session was successfully restarted.
+    double recovery_start; // When the current recovery began, 0 if not recovering.
+    double recovery_time_total; // Milliseconds from stall detection to the first new frame.
+    double recovery_time_max;
+    double first_frame_time; // When the first & latest frame were dequeued, for the achieved interval.
+    double last_frame_time;
+
+    V4L2_Container v4l2;
+};
+
+
+/// @brief Returns the current monotonic time in seconds.
+double _now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+/// @brief Pixel formats the processing pipeline can consume, from cheapest to most expensive.
+static const struct Format_Option
+{
+    unsigned int fourcc;
+    Pixel_Format format;
+    const char *name;
+    const char *path; // Description of the processing path used for the format.
+} format_options[] = {
+    { V4L2_PIX_FMT_NV12, PIX_NV12, "NV12", "raw, no decode, quarter-size chroma" },
+    { V4L2_PIX_FMT_YUYV, PIX_YUYV, "YUYV", "raw, no decode" },
+    { V4L2_PIX_FMT_MJPEG, PIX_MJPEG, "MJPEG", "JPEG decode" },
+};
+#define FORMAT_OPTION_COUNT (int)(sizeof(format_options) / sizeof(format_options[0]))
+
+
+/// @brief Checks whether the camera offers a pixel format at the given frame size.
+bool _supports_frame_size(Webcam *cam, unsigned int fourcc, unsigned int width, unsigned int height)
+{
+    struct v4l2_frmsizeenum size;
+    memset(&size, 0, sizeof(size));
+    size.pixel_format = fourcc;
+
+    for (size.index = 0; ioctl(cam->handle, VIDIOC_ENUM_FRAMESIZES, &size) == 0; size.index++)
+    {
+        if (size.type == V4L2_FRMSIZE_TYPE_DISCRETE)
+        {
+            if (size.discrete.width == width && size.discrete.height == height)
+                return true;
+            continue;
+        }
+
+        // Stepwise & continuous sizes are described by a single range.
+        return width >= size.stepwise.min_width && width <= size.stepwise.max_width &&
+            height >= size.stepwise.min_height && height <= size.stepwise.max_height &&
+            (width - size.stepwise.min_width) % MAX(1, size.stepwise.step_width) == 0 &&
+            (height - size.stepwise.min_height) % MAX(1, size.stepwise.step_height) == 0;
+    }
+
+    // Drivers that cannot enumerate sizes leave the decision to VIDIOC_S_FMT.
+    return size.index == 0;
+}
+
+/// @brief Finds the highest frame rate the camera offers for a pixel format & frame size.
+/// @param fastest Receives the shortest frame interval if not NULL.
+/// @return The frame rate, or 0 if the driver does not report frame intervals.
+float _max_frame_rate(Webcam *cam, unsigned int fourcc, unsigned int width, unsigned int height, struct v4l2_fract *fastest)
+{
+    struct v4l2_frmivalenum interval;
+    memset(&interval, 0, sizeof(interval));
+    interval.pixel_format = fourcc;
+    interval.width = width;
+    interval.height = height;
+
+    float max_fps = 0.0f;
+    for (interval.index = 0; ioctl(cam->handle, VIDIOC_ENUM_FRAMEINTERVALS, &interval) == 0; interval.index++)
+    {
+        const struct v4l2_fract *fract = (interval.type == V4L2_FRMIVAL_TYPE_DISCRETE) ?
+            &interval.discrete : &interval.stepwise.min;
+
+        if (fract->numerator > 0 && (float)fract->denominator / (float)fract->numerator > max_fps)
+        {
+            max_fps = (float)fract->denominator / (float)fract->numerator;
+            if (fastest != NULL)
+                *fastest = *fract;
+        }
+
+        if (interval.type != V4L2_FRMIVAL_TYPE_DISCRETE)
+            break;
+    }
+
+    return max_fps;
+}
+
+/// @brief The frame rate needed to meet target_fps & latency_target, 0 if neither is set.
+/// An event can wait up to a whole frame interval to be captured, so the interval may not exceed the latency target.
+float _required_frame_rate(const Img_Fmt *format)
+{
+    float required_fps = MAX(format->target_fps, 0.0f);
+    if (format->latency_target > 0.0f)
+        required_fps = MAX(required_fps, 1000.0f / format->latency_target);
+    return required_fps;
+}
+
+/// @brief Finds the largest frame size any usable pixel format offers at the required frame rate.
+/// @return false if none of them reaches it.
+bool _largest_frame_size(Webcam *cam, float required_fps, unsigned int *best_width, unsigned int *best_height, float *best_fps)
+{
+    *best_width = 0;
+    *best_height = 0;
+    *best_fps = 0.0f;
+
+    for (int i = 0; i < FORMAT_OPTION_COUNT; i++)
+    {
+        struct v4l2_frmsizeenum size;
+        memset(&size, 0, sizeof(size));
+        size.pixel_format = format_options[i].fourcc;
+
+        for (size.index = 0; ioctl(cam->handle, VIDIOC_ENUM_FRAMESIZES, &size) == 0; size.index++)
+        {
+            if (size.type != V4L2_FRMSIZE_TYPE_DISCRETE)
+                break;
+
+            // Pixels are converted in pairs, so the width has to be even.
+            unsigned int width = size.discrete.width, height = size.discrete.height;
+            if (width % 2 != 0)
+                continue;
+
+            float fps = _max_frame_rate(cam, size.pixel_format, width, height, NULL);
+            if (fps >= required_fps && width * height > *best_width * *best_height)
+            {
+                *best_width = width;
+                *best_height = height;
+                *best_fps = fps;
+            }
+        }
+    }
+
+    return *best_width > 0;
+}
+
+/// @brief Suggests the largest frame size any usable pixel format offers at the required frame rate.
+void _suggest_frame_size(Webcam *cam, float required_fps)
+{
+    unsigned int best_width, best_height;
+    float best_fps;
+    if (_largest_frame_size(cam, required_fps, &best_width, &best_height, &best_fps))
+        printf("Frame size %ux%u would reach %.0f fps (resolution=%ux%u).\n",
+            best_width, best_height, best_fps, best_width, best_height);
+}
+
+/// @brief Picks the cheapest pixel format to process at the requested frame size.
+/// A raw format is only chosen over MJPEG if it reaches the required frame rate,
+/// or, if none is required, if it does not lower the frame rate.
+/// @return Index into format_options, or -1 if the camera offers none of them.
+int _choose_pixel_format(Webcam *cam, const Img_Fmt *format)
+{
+    bool offered[FORMAT_OPTION_COUNT] = { false };
+    float max_fps[FORMAT_OPTION_COUNT] = { 0.0f };
+    struct v4l2_fract fastest[FORMAT_OPTION_COUNT];
+    memset(fastest, 0, sizeof(fastest));
+
+    struct v4l2_fmtdesc desc;
+    memset(&desc, 0, sizeof(desc));
+    desc.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+    for (desc.index = 0; ioctl(cam->handle, VIDIOC_ENUM_FMT, &desc) == 0; desc.index++)
+    {
+        for (int i = 0; i < FORMAT_OPTION_COUNT; i++)
+        {
+            if (format_options[i].fourcc != desc.pixelformat)
+                continue;
+
+            if (!_supports_frame_size(cam, desc.pixelformat, format->width, format->height))
+                continue;
+
+            offered[i] = true;
+            max_fps[i] = _max_frame_rate(cam, desc.pixelformat, format->width, format->height, &fastest[i]);
+        }
+    }
+
+    // A specific format was requested.
+    if (format->pixel_format != 0.0f)
+    {
+        for (int i = 0; i < FORMAT_OPTION_COUNT; i++)
+        {
+            if (format_options[i].format != (Pixel_Format)format->pixel_format)
+                continue;
+
+            cam->max_fps = max_fps[i];
+            cam->fastest_interval = fastest[i];
+            return offered[i] ? i : -1;
+        }
+        return -1;
+    }
+
+    float best_fps = 0.0f;
+    for (int i = 0; i < FORMAT_OPTION_COUNT; i++)
+        if (offered[i])
+            best_fps = MAX(best_fps, max_fps[i]);
+
+    // Any format fast enough is good enough, the cheapest of them is taken.
+    float required_fps = _required_frame_rate(format);
+    if (required_fps > 0.0f)
+        best_fps = MIN(best_fps, required_fps);
+
+    for (int i = 0; i < FORMAT_OPTION_COUNT; i++)
+    {
+        if (offered[i] && max_fps[i] >= best_fps)
+        {
+            cam->max_fps = max_fps[i];
+            cam->fastest_interval = fastest[i];
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+/// @brief Restores the full sensor area, which the driver keeps across opens of the device.
+void _reset_sensor_crop(Webcam *cam)
+{
+    struct v4l2_selection selection;
+    memset(&selection, 0, sizeof(selection));
+    selection.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    selection.target = V4L2_SEL_TGT_CROP_DEFAULT;
+
+    if (ioctl(cam->handle, VIDIOC_G_SELECTION, &selection) < 0)
+        return;
+
+    selection.target = V4L2_SEL_TGT_CROP;
+    ioctl(cam->handle, VIDIOC_S_SELECTION, &selection);
+}
+
+/// @brief Asks the driver to crop (or bin) the sensor to the region of interest, so that only its rows
+/// are transferred. Expects the full frame format to be set already.
+/// @return 0 if frames now hold only the region of interest, 1 if it has to be cropped in software.
+int _set_sensor_crop(Webcam *cam, const Img_Fmt *format)
+{
+    unsigned int roi_width = cam->roi.e - cam->roi.w;
+    unsigned int roi_height = cam->roi.s - cam->roi.n;
+
+    // The default crop rectangle covers the full frame, in sensor pixels which may be scaled to the frame size.
+    struct v4l2_selection full;
+    memset(&full, 0, sizeof(full));
+    full.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    full.target = V4L2_SEL_TGT_CROP_DEFAULT;
+
+    if (ioctl(cam->handle, VIDIOC_G_SELECTION, &full) < 0)
+    {
+        printf("%s cannot crop at the sensor, cropping in software.\n", cam->device);
+        return 1;
+    }
+
+    struct v4l2_selection crop = full;
+    crop.target = V4L2_SEL_TGT_CROP;
+    crop.flags = 0;
+    crop.r.left = full.r.left + (int)((unsigned long)cam->roi.w * full.r.width / format->width);
+    crop.r.top = full.r.top + (int)((unsigned long)cam->roi.n * full.r.height / format->height);
+    crop.r.width = (unsigned int)((unsigned long)roi_width * full.r.width / format->width);
+    crop.r.height = (unsigned int)((unsigned long)roi_height * full.r.height / format->height);
+
+    struct v4l2_rect wanted = crop.r;
+    if (ioctl(cam->handle, VIDIOC_S_SELECTION, &crop) < 0)
+    {
+        printf("VIDIOC_S_SELECTION failed on %s, cropping in software.\n", cam->device);
+        return 1;
+    }
+
+    // Ask for the cropped area at the same scale, so the frame holds the region of interest pixel for pixel.
+    struct v4l2_format cropped = cam->v4l2.format;
+    cropped.fmt.pix.width = roi_width;
+    cropped.fmt.pix.height = roi_height;
+
+    // Setting the format may move the crop rectangle again, so check what the driver settled on.
+    struct v4l2_selection result = crop;
+    bool adjusted =
+        ioctl(cam->handle, VIDIOC_S_FMT, &cropped) < 0 ||
+        ioctl(cam->handle, VIDIOC_G_SELECTION, &result) < 0 ||
+        cropped.fmt.pix.pixelformat != cam->v4l2.format.fmt.pix.pixelformat ||
+        cropped.fmt.pix.width != roi_width || cropped.fmt.pix.height != roi_height ||
+        result.r.top != wanted.top || result.r.height != wanted.height;
+
+    if (adjusted)
+    {
+        printf("%s adjusted the sensor crop, cropping in software.\n", cam->device);
+        _reset_sensor_crop(cam);
+        ioctl(cam->handle, VIDIOC_S_FMT, &cam->v4l2.format);
+        return 1;
+    }
 
+    cam->v4l2.format = cropped;
+    return 0;
+}
 
-/// @brief Tells the camera device what video format to use.
-int _set_supported_video_format(const Img_Fmt *format)
+/// @brief Negotiates the pixel format & frame size with the camera device.
+int _set_supported_video_format(Webcam *cam, const Img_Fmt *format)
 {
+    int option = _choose_pixel_format(cam, format);
+    if (option == -1)
+    {
+        printf("No supported pixel format at %ux%u!\n", format->width, format->height);
+        return -1;
+    }
+
+    // A crop left behind by a previous session would scale the full frame down.
+    _reset_sensor_crop(cam);
+
     // Overwrite memory in format with 0.
-    memset(&v4l2_container.format, 0, sizeof(v4l2_container.format));
+    memset(&cam->v4l2.format, 0, sizeof(cam->v4l2.format));
 
-    v4l2_container.format.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    v4l2_container.format.fmt.pix.width = format->width;
-    v4l2_container.format.fmt.pix.height = format->height;
-    v4l2_container.format.fmt.pix.pixelformat = V4L2_PIX_FMT_MJPEG;
-    v4l2_container.format.fmt.pix.field = V4L2_FIELD_NONE;
+    cam->v4l2.format.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    cam->v4l2.format.fmt.pix.width = format->width;
+    cam->v4l2.format.fmt.pix.height = format->height;
+    cam->v4l2.format.fmt.pix.pixelformat = format_options[option].fourcc;
+    cam->v4l2.format.fmt.pix.field = V4L2_FIELD_NONE;
 
     // Set the format in the camera device file.
-    if (ioctl(capture_data.handle, VIDIOC_S_FMT, &v4l2_container.format) < 0)
+    if (ioctl(cam->handle, VIDIOC_S_FMT, &cam->v4l2.format) < 0)
     {
         printf("VIDIOC_S_FMT Video format set failed!\n");
         return -1;
     }
 
+    // The driver may adjust the request, but all frame buffers are sized for the requested format.
+    if (cam->v4l2.format.fmt.pix.pixelformat != format_options[option].fourcc ||
+        cam->v4l2.format.fmt.pix.width != format->width ||
+        cam->v4l2.format.fmt.pix.height != format->height)
+    {
+        printf("VIDIOC_S_FMT changed the format to %ux%u!\n",
+            cam->v4l2.format.fmt.pix.width, cam->v4l2.format.fmt.pix.height);
+        return -1;
+    }
+
+    cam->roi = webcam_roi(format);
+    cam->sensor_crop = false;
+    if (cam->roi.n > 0 && format->sensor_crop == 1.0f)
+        cam->sensor_crop = _set_sensor_crop(cam, format) == 0;
+
+    cam->format_option = option;
+    cam->pixel_format = format_options[option].format;
+    cam->stride = cam->v4l2.format.fmt.pix.bytesperline;
     return 0;
 }
 
-/// @brief Requests the driver to allocate space for two video capture buffers.
-int _request_buffers()
+/// @brief The V4L2 memory type of the buffers.
+enum v4l2_memory _v4l2_memory(Webcam *cam)
+{
+    switch (cam->memory)
+    {
+    case CAPTURE_USERPTR:   return V4L2_MEMORY_USERPTR;
+    case CAPTURE_DMABUF:    return V4L2_MEMORY_DMABUF;
+    case CAPTURE_MMAP:
+    default:                return V4L2_MEMORY_MMAP;
+    }
+}
+
+/// @brief Makes sure the arena holds count buffers large enough for the negotiated format.
+/// The arena outlives streaming sessions, so it is only reallocated if the format grew.
+int _prepare_arena(Webcam *cam, unsigned int count)
 {
-    memset(&v4l2_container.buffer_request, 0, sizeof(v4l2_container.buffer_request));
+    size_t block_size = cam->v4l2.format.fmt.pix.sizeimage;
+    count = CLAMP(count, MIN_BUFFERS, MAX_BUFFERS);
+
+    if (arena_fits(&cam->arena, block_size, count) && cam->arena.dmabuf == (cam->memory == CAPTURE_DMABUF))
+        return 0;
 
-    // Two buffers are requested so that one can be read and the other written to.
-    // A single buffer would lead to either resource contention or race conditions.
-    v4l2_container.buffer_request.count = 2;
-    v4l2_container.buffer_request.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    v4l2_container.buffer_request.memory = V4L2_MEMORY_MMAP;
+    arena_free(&cam->arena);
 
-    if (ioctl(capture_data.handle, VIDIOC_REQBUFS, &v4l2_container.buffer_request) < 0)
+    if (cam->memory == CAPTURE_DMABUF)
     {
+        if (arena_init_dmabuf(&cam->arena, block_size, count) == 0)
+            return 0;
+
+        printf("DMA-BUF capture unavailable, using USERPTR instead.\n");
+        cam->memory = CAPTURE_USERPTR;
+    }
+
+    return arena_init(&cam->arena, block_size, count, cam->hugepages);
+}
+
+/// @brief Sets the frame interval: the fastest one available, or the one closest to target_fps.
+/// Cameras that do not support interval control keep streaming at their default rate.
+int _set_frame_interval(Webcam *cam, const Img_Fmt *format)
+{
+    struct v4l2_streamparm parm;
+    memset(&parm, 0, sizeof(parm));
+    parm.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+    memset(&cam->frame_interval, 0, sizeof(cam->frame_interval));
+
+    if (ioctl(cam->handle, VIDIOC_G_PARM, &parm) < 0 ||
+        !(parm.parm.capture.capability & V4L2_CAP_TIMEPERFRAME))
+    {
+        printf("Frame interval control is not supported, using the camera's default rate.\n");
+        return 0;
+    }
+
+    if (format->target_fps > 0.0f)
+        parm.parm.capture.timeperframe = (struct v4l2_fract){ 1000, (unsigned int)(format->target_fps * 1000.0f) };
+    else if (cam->fastest_interval.numerator > 0)
+        parm.parm.capture.timeperframe = cam->fastest_interval;
+    else
+        parm.parm.capture.timeperframe = (struct v4l2_fract){ 1, 1000 }; // The driver clamps to its fastest.
+
+    if (ioctl(cam->handle, VIDIOC_S_PARM, &parm) < 0)
+    {
+        printf("VIDIOC_S_PARM failed!\n");
+        return -1;
+    }
+
+    // The driver writes back the interval it actually uses.
+    cam->frame_interval = parm.parm.capture.timeperframe;
+    return 0;
+}
+
+/// @brief The frame rate of an interval, 0 if unknown.
+float _interval_fps(struct v4l2_fract interval)
+{
+    if (interval.numerator == 0)
+        return 0.0f;
+    return (float)interval.denominator / (float)interval.numerator;
+}
+
+/// @brief Requests the driver to allocate space for the buffer ring.
+int _request_buffers(Webcam *cam, unsigned int count)
+{
+    memset(&cam->v4l2.buffer_request, 0, sizeof(cam->v4l2.buffer_request));
+
+    // At least two buffers are needed so that one can be read while another is written to.
+    // Any extra buffers let the camera keep streaming while processing stalls.
+    cam->v4l2.buffer_request.count = CLAMP(count, MIN_BUFFERS, MAX_BUFFERS);
+    cam->v4l2.buffer_request.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    cam->v4l2.buffer_request.memory = _v4l2_memory(cam);
+
+    if (ioctl(cam->handle, VIDIOC_REQBUFS, &cam->v4l2.buffer_request) < 0)
+    {
+        // Not every driver can import application memory.
+        if (cam->memory != CAPTURE_MMAP)
+        {
+            printf("VIDIOC_REQBUFS does not support %s buffers, using MMAP instead.\n",
+                cam->memory == CAPTURE_DMABUF ? "DMABUF" : "USERPTR");
+            cam->memory = CAPTURE_MMAP;
+            arena_free(&cam->arena);
+            return _request_buffers(cam, count);
+        }
+
         printf("VIDIOC_REQBUFS failed!\n");
         return -1;
     }
+
+    // The driver may grant a different amount than requested.
+    if (cam->v4l2.buffer_request.count < MIN_BUFFERS)
+    {
+        printf("VIDIOC_REQBUFS granted only %u buffers!\n", cam->v4l2.buffer_request.count);
+        return -1;
+    }
+
+    cam->buffer_count = MIN(cam->v4l2.buffer_request.count, MAX_BUFFERS);
+    if (cam->memory != CAPTURE_MMAP)
+        cam->buffer_count = MIN(cam->buffer_count, cam->arena.block_count);
     return 0;
 }
 
+/// @brief Points the buffer at a given index to its block in the arena.
+void _attach_arena_block(Webcam *cam, int i)
+{
+    cam->img_mem[i] = cam->arena.blocks[i];
+    cam->img_len[i] = cam->arena.block_size;
+}
+
 /// @brief Queries & maps a requested buffer at a given index.
-int _query_buffer(int i)
+int _query_buffer(Webcam *cam, int i)
 {
-    memset(&v4l2_container.query_buffer, 0, sizeof(v4l2_container.query_buffer));
+    memset(&cam->v4l2.query_buffer, 0, sizeof(cam->v4l2.query_buffer));
 
-    v4l2_container.query_buffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    v4l2_container.query_buffer.memory = V4L2_MEMORY_MMAP;
-    v4l2_container.query_buffer.index = i;
+    cam->v4l2.query_buffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    cam->v4l2.query_buffer.memory = V4L2_MEMORY_MMAP;
+    cam->v4l2.query_buffer.index = i;
 
-    if (ioctl(capture_data.handle, VIDIOC_QUERYBUF, &v4l2_container.query_buffer) < 0)
+    if (ioctl(cam->handle, VIDIOC_QUERYBUF, &cam->v4l2.query_buffer) < 0)
     {
         printf("VIDIOC_QUERYBUF failed at index %i!\n", i);
         return -1;
     }
 
-    capture_data.img_mem[i] = mmap(
+    cam->img_len[i] = cam->v4l2.query_buffer.length;
+    cam->img_mem[i] = mmap(
         NULL,
-        v4l2_container.query_buffer.length,
+        cam->v4l2.query_buffer.length,
         PROT_READ,
         MAP_SHARED,
-        capture_data.handle,
-        v4l2_container.query_buffer.m.offset);
+        cam->handle,
+        cam->v4l2.query_buffer.m.offset);
+
+    if (cam->img_mem[i] == MAP_FAILED)
+    {
+        printf("mmap failed at index %i!\n", i);
+        cam->img_mem[i] = NULL;
+        return -1;
+    }
 
     return 0;
 }
 
 /// @brief Queues a buffer at a given index to be filled by the camera device.
-int _queue_buffer_to_write(int i)
+int _queue_buffer_to_write(Webcam *cam, int i)
 {
-    memset(&v4l2_container.write_buffer, 0, sizeof(v4l2_container.write_buffer));
+    struct v4l2_buffer buffer;
+    memset(&buffer, 0, sizeof(buffer));
 
-    v4l2_container.write_buffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    v4l2_container.write_buffer.memory = V4L2_MEMORY_MMAP;
-    v4l2_container.write_buffer.index = i;
+    buffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    buffer.memory = _v4l2_memory(cam);
+    buffer.index = i;
 
-    if (ioctl(capture_data.handle, VIDIOC_QBUF, &v4l2_container.write_buffer) < 0)
+    if (cam->memory == CAPTURE_USERPTR)
+    {
+        buffer.m.userptr = (unsigned long)cam->img_mem[i];
+        buffer.length = cam->img_len[i];
+    }
+    else if (cam->memory == CAPTURE_DMABUF)
+    {
+        buffer.m.fd = cam->arena.dmabuf_fds[i];
+        buffer.length = cam->img_len[i];
+    }
+
+    if (ioctl(cam->handle, VIDIOC_QBUF, &buffer) < 0)
     {
         printf("VIDIOC_QBUF failed at index %i!\n", i);
         return -1;
     }
+
+    cam->queued_count++;
     return 0;
 }
 
 /// @brief Tells the camera device to begin streaming video data to queued buffers.
-int _start_camera()
+int _start_camera(Webcam *cam)
 {
     enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
 
-    if (ioctl(capture_data.handle, VIDIOC_STREAMON, &type) < 0)
+    if (ioctl(cam->handle, VIDIOC_STREAMON, &type) < 0)
     {
         printf("VIDIOC_STREAMON failed!\n");
         return -1;
@@ -133,93 +655,784 @@ int _start_camera()
     return 0;
 }
 
-/// @brief Dequeues & processes a filled buffer.
-int _dequeue_buffer()
+/// @brief Tells the camera device to stop streaming.
+int _stop_camera(Webcam *cam)
 {
-    memset(&v4l2_container.queue_buffer, 0, sizeof(v4l2_container.queue_buffer));
+    enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+    if (ioctl(cam->handle, VIDIOC_STREAMOFF, &type) < 0)
+        return -1; // Expected if the device has disappeared.
+
+    return 0;
+}
 
-    v4l2_container.queue_buffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-    v4l2_container.queue_buffer.memory = V4L2_MEMORY_MMAP;
+/// @brief Dequeues a filled buffer without blocking.
+/// @return The index of the dequeued buffer, or -1 on failure with errno set.
+int _dequeue_buffer(Webcam *cam)
+{
+    struct v4l2_buffer buffer;
+    memset(&buffer, 0, sizeof(buffer));
 
-    if (ioctl(capture_data.handle, VIDIOC_DQBUF, &v4l2_container.queue_buffer) < 0)
+    buffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    buffer.memory = _v4l2_memory(cam);
+
+    if (ioctl(cam->handle, VIDIOC_DQBUF, &buffer) < 0)
+        return -1;
+
+    cam->queued_count--;
+    cam->img_used[buffer.index] = buffer.bytesused;
+    cam->img_sequence[buffer.index] = buffer.sequence;
+
+    // Monotonic driver timestamps are taken when the frame was captured, on the same clock as _now.
+    if ((buffer.flags & V4L2_BUF_FLAG_TIMESTAMP_MASK) == V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC)
+        cam->img_timestamp[buffer.index] = (double)buffer.timestamp.tv_sec + (double)buffer.timestamp.tv_usec / 1e6;
+    else
+        cam->img_timestamp[buffer.index] = _now();
+
+    if (cam->last_sequence >= 0 && buffer.sequence > cam->last_sequence + 1)
+        cam->lost_count += buffer.sequence - (unsigned int)cam->last_sequence - 1;
+    cam->last_sequence = buffer.sequence;
+
+    return (int)buffer.index;
+}
+
+
+/// @brief Opens a device node and checks that it is a streaming video capture device.
+/// @return The file descriptor, or -1 on failure.
+int _open_device(Webcam *cam, const char *path)
+{
+    int handle = open(path, O_RDWR | O_NONBLOCK, 0);
+    if (handle == -1)
+        return -1;
+
+    memset(&cam->v4l2.capability, 0, sizeof(cam->v4l2.capability));
+    if (ioctl(handle, VIDIOC_QUERYCAP, &cam->v4l2.capability) < 0 ||
+        !(cam->v4l2.capability.device_caps & V4L2_CAP_VIDEO_CAPTURE) ||
+        !(cam->v4l2.capability.device_caps & V4L2_CAP_STREAMING))
     {
-        printf("VIDIOC_DQBUF failed!\n");
+        close(handle);
         return -1;
     }
 
-    return 0;
+    return handle;
 }
 
-/// @brief Requeues a dequeued buffer.
-int _requeue_buffer()
+/// @brief Opens the camera, preferring its original device node.
+/// If the camera was re-enumerated under a different node, it is found again by its bus info.
+int _find_device(Webcam *cam)
 {
-    if (ioctl(capture_data.handle, VIDIOC_QBUF, &v4l2_container.queue_buffer) < 0)
+    int handle = _open_device(cam, cam->device);
+    if (handle != -1 || cam->bus_info[0] == '\0')
+        return handle;
+
+    for (int i = 0; i < MAX_VIDEO_DEVICES; i++)
     {
-        printf("VIDIOC_QBUF failed!\n");
+        char path[32];
+        snprintf(path, sizeof(path), "/dev/video%d", i);
+
+        handle = _open_device(cam, path);
+        if (handle == -1)
+            continue;
+
+        if (strncmp((const char *)cam->v4l2.capability.bus_info, cam->bus_info, sizeof(cam->bus_info)) == 0)
+        {
+            printf("Camera found again at %s.\n", path);
+            snprintf(cam->device, sizeof(cam->device), "%s", path);
+            return handle;
+        }
+        close(handle);
+    }
+
+    return -1;
+}
+
+/// @brief Stops streaming, unmaps all driver buffers and closes the device.
+/// Arena buffers stay allocated for the next session.
+void _close_session(Webcam *cam)
+{
+    if (cam->handle == -1)
+        return;
+
+    if (cam->streaming)
+        _stop_camera(cam);
+    cam->streaming = false;
+
+    for (int i = 0; i < MAX_BUFFERS; i++)
+    {
+        if (cam->img_mem[i] == NULL)
+            continue;
+
+        if (cam->memory == CAPTURE_MMAP && munmap(cam->img_mem[i], cam->img_len[i]) == -1)
+            printf("ERROR: munmap() for buffer %d returned -1.\n", i);
+        cam->img_mem[i] = NULL;
+    }
+
+    // Leave the full sensor area to whoever opens the device next.
+    if (cam->sensor_crop)
+        _reset_sensor_crop(cam);
+
+    if (close(cam->handle) == -1)
+        printf("ERROR: close() returned -1.\n");
+
+    cam->handle = -1;
+    cam->queued_count = 0;
+}
+
+/// @brief Opens the device, negotiates the format, maps & queues all buffers and starts streaming.
+int _open_session(Webcam *cam)
+{
+    cam->handle = _find_device(cam);
+    if (cam->handle == -1)
         return -1;
+
+    if (_set_supported_video_format(cam, cam->format) == -1)
+        goto session_failed;
+
+    if (_set_frame_interval(cam, cam->format) == -1)
+        goto session_failed;
+
+    if (cam->memory != CAPTURE_MMAP && _prepare_arena(cam, cam->requested_count) == -1)
+        goto session_failed;
+
+    if (_request_buffers(cam, cam->requested_count) == -1)
+        goto session_failed;
+
+    for (int i = 0; i < cam->buffer_count; i++)
+    {
+        if (cam->memory != CAPTURE_MMAP)
+            _attach_arena_block(cam, i);
+        else if (_query_buffer(cam, i) == -1)
+            goto session_failed;
     }
 
+    for (int i = 0; i < cam->buffer_count; i++)
+        if (_queue_buffer_to_write(cam, i) == -1)
+            goto session_failed;
+
+    if (_start_camera(cam) == -1)
+        goto session_failed;
+    cam->streaming = true;
+    cam->last_sequence = -1; // Sequence numbers restart with every session.
+
+    snprintf(cam->bus_info, sizeof(cam->bus_info), "%s", (const char *)cam->v4l2.capability.bus_info);
     return 0;
+
+session_failed:
+    _close_session(cam);
+    return -1;
 }
 
 
-int webcam_init(const Img_Fmt *format)
+/// @brief Pushes a slot onto the ring. Only called by the ring's producer.
+void _ring_push(Slot_Ring *ring, int slot)
 {
-    capture_data.handle = open("/dev/video0", O_RDWR, 0);
+    unsigned int head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    atomic_store_explicit(&ring->slots[head & (RING_SIZE - 1)], slot, memory_order_relaxed);
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
 
-    if (_set_supported_video_format(format) == -1) 
+/// @brief Pops a slot from the ring. Only called by the ring's consumer.
+/// @return The popped slot, or -1 if the ring is empty.
+int _ring_pop(Slot_Ring *ring)
+{
+    unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    if (tail == atomic_load_explicit(&ring->head, memory_order_acquire))
         return -1;
 
-    if (_request_buffers() == -1) 
+    int slot = atomic_load_explicit(&ring->slots[tail & (RING_SIZE - 1)], memory_order_relaxed);
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+    return slot;
+}
+
+/// @brief Whether the ring holds no slots.
+bool _ring_empty(Slot_Ring *ring)
+{
+    return atomic_load(&ring->tail) == atomic_load(&ring->head);
+}
+
+/// @brief Wakes the capture thread if it is waiting in poll.
+void _wake_capture_thread(Webcam *cam)
+{
+    uint64_t value = 1;
+    if (write(cam->wake_fd, &value, sizeof(value)) == -1)
+        printf("ERROR: Failed to wake capture thread.\n");
+}
+
+/// @brief Hands a filled buffer over to the consumer according to the queue policy.
+void _publish_buffer(Webcam *cam, int index)
+{
+    int slot = MAKE_SLOT(atomic_load(&cam->generation), index);
+    atomic_fetch_add_explicit(&cam->captured_count, 1, memory_order_relaxed);
+
+    switch (cam->policy)
+    {
+    case QUEUE_NO_DROP:
+        _ring_push(&cam->ready, slot);
+        sem_post(&cam->frame_sem);
+        break;
+
+    case QUEUE_LATEST:
+    default:
+    {
+        // Replace the pending frame. If one was still waiting, the consumer never saw it,
+        // so it goes straight back to the driver and the semaphore is left untouched.
+        int stale = atomic_exchange_explicit(&cam->latest, slot, memory_order_acq_rel);
+        if (stale == -1)
+        {
+            sem_post(&cam->frame_sem);
+        }
+        else
+        {
+            atomic_fetch_add_explicit(&cam->skipped_count, 1, memory_order_relaxed);
+            if (SLOT_GEN(stale) == SLOT_GEN(slot))
+                _queue_buffer_to_write(cam, SLOT_INDEX(stale));
+        }
+        break;
+    }
+    }
+}
+
+/// @brief Requeues all buffers the consumer has released since the last call.
+void _requeue_released(Webcam *cam)
+{
+    unsigned int generation = atomic_load(&cam->generation) & 0xFFFFFF;
+
+    int slot;
+    while ((slot = _ring_pop(&cam->released)) != -1)
+    {
+        // Buffers from a torn down session no longer exist in the driver.
+        if (SLOT_GEN(slot) != generation)
+            continue;
+
+        _queue_buffer_to_write(cam, SLOT_INDEX(slot));
+    }
+}
+
+/// @brief Waits for the timeout or until woken, whichever comes first.
+void _wait_for_wake(Webcam *cam, int timeout_ms)
+{
+    struct pollfd wake = { .fd = cam->wake_fd, .events = POLLIN };
+    if (poll(&wake, 1, timeout_ms) > 0)
+    {
+        uint64_t value;
+        if (read(cam->wake_fd, &value, sizeof(value)) == -1)
+            return;
+    }
+}
+
+/// @brief Tears down the streaming session and restarts it once the device is available again.
+void _recover_session(Webcam *cam)
+{
+    if (cam->recovery_start == 0.0)
+        cam->recovery_start = _now();
+
+    // Invalidate all slots of the current session before touching the device.
+    unsigned int old_generation = atomic_fetch_add(&cam->generation, 1) & 0xFFFFFF;
+
+    // A pending latest frame can be taken back directly. The consumer treats the leftover
+    // semaphore post as a spurious wakeup.
+    atomic_exchange(&cam->latest, -1);
+
+    // The buffer memory stays mapped until the consumer lets go of its old frame and
+    // has discarded any old frames still waiting in the ready ring.
+    while (atomic_load(&cam->running))
+    {
+        int held = atomic_load(&cam->held);
+        bool holds_old = held != -1 && SLOT_GEN(held) == old_generation;
+
+        if (!holds_old && _ring_empty(&cam->ready))
+            break;
+
+        _wait_for_wake(cam, 1);
+    }
+
+    // Slots released by the consumer until now all belong to the old session.
+    while (_ring_pop(&cam->released) != -1)
+        continue;
+
+    _close_session(cam);
+
+    while (atomic_load(&cam->running))
+    {
+        if (_open_session(cam) == 0)
+        {
+            printf("Capture session restarted on %s.\n", cam->device);
+            return;
+        }
+
+        _wait_for_wake(cam, cam->timeout_ms);
+    }
+}
+
+/// @brief Waits for filled buffers and publishes them to the consumer.
+/// Only this thread issues ioctls on the device once streaming has started.
+void *_capture_thread(void *input)
+{
+    Webcam *cam = (Webcam*)input;
+
+    while (atomic_load(&cam->running))
+    {
+        _requeue_released(cam);
+
+        struct pollfd fds[2] = {
+            // With no buffers queued there is nothing to wait for, but errors are still reported.
+            { .fd = cam->handle, .events = (cam->queued_count > 0) ? POLLIN : 0 },
+            { .fd = cam->wake_fd, .events = POLLIN },
+        };
+
+        int result = poll(fds, 2, cam->timeout_ms);
+        if (!atomic_load(&cam->running))
+            break;
+
+        if (result < 0)
+        {
+            if (errno == EINTR)
+                continue;
+
+            printf("Capture poll failed, restarting session...\n");
+            _recover_session(cam);
+            continue;
+        }
+
+        if (fds[1].revents & POLLIN)
+        {
+            uint64_t value;
+            if (read(cam->wake_fd, &value, sizeof(value)) == -1)
+                printf("ERROR: Failed to read capture wake event.\n");
+        }
+
+        if (result == 0)
+        {
+            // Only a stall if the driver had buffers to fill.
+            if (cam->queued_count > 0)
+            {
+                cam->stall_count++;
+                printf("Capture stalled for %d ms, restarting session...\n", cam->timeout_ms);
+                _recover_session(cam);
+            }
+            continue;
+        }
+
+        if (fds[0].revents & (POLLERR | POLLHUP | POLLNVAL))
+        {
+            printf("Capture device error, restarting session...\n");
+            _recover_session(cam);
+            continue;
+        }
+
+        if (!(fds[0].revents & POLLIN))
+            continue;
+
+        int index = _dequeue_buffer(cam);
+        if (index == -1)
+        {
+            if (errno == EAGAIN || errno == EINTR)
+                continue;
+
+            printf("VIDIOC_DQBUF failed, restarting session...\n");
+            _recover_session(cam);
+            continue;
+        }
+
+        if (cam->recovery_start != 0.0)
+        {
+            double recovery_time = (_now() - cam->recovery_start) * 1000.0;
+            cam->recovery_time_total += recovery_time;
+            cam->recovery_time_max = MAX(cam->recovery_time_max, recovery_time);
+            cam->recovery_count++;
+            cam->recovery_start = 0.0;
+            printf("Capture recovered in %.0f ms.\n", recovery_time);
+        }
+
+        cam->last_frame_time = _now();
+        if (cam->first_frame_time == 0.0)
+            cam->first_frame_time = cam->last_frame_time;
+
+        _publish_buffer(cam, index);
+    }
+
+    // Make sure a consumer blocked in next_frame is released.
+    sem_post(&cam->frame_sem);
+    return NULL;
+}
+
+
+AABB webcam_roi(const Img_Fmt *format)
+{
+    unsigned int top = (unsigned int)(CLAMP(format->roi_top, 0.0f, 0.9f) * format->height) & ~15u;
+    return (AABB){ .w = 0, .n = top, .e = format->width, .s = format->height };
+}
+
+int webcam_negotiate_size(const char *device, unsigned int *width, unsigned int *height, float required_fps)
+{
+    if (strncmp(device, "synthetic", 9) == 0)
+        return 0;
+
+    struct stat st;
+    if (stat(device, &st) == 0 && S_ISREG(st.st_mode))
+        return replay_probe(device, width, height);
+
+    Webcam *cam = calloc(1, sizeof(Webcam));
+    if (cam == NULL)
         return -1;
 
-    for (int i = 0; i < 2; i++)
-        if (_query_buffer(i) == -1) 
-            return -1;
+    cam->handle = _open_device(cam, device);
+    if (cam->handle == -1)
+    {
+        printf("Failed to open %s!\n", device);
+        free(cam);
+        return -1;
+    }
 
-    for (int i = 0; i < 2; i++)
-        if (_queue_buffer_to_write(i) == -1) 
-            return -1;
+    // The frame rate decides the size, trading resolution for latency.
+    if (required_fps > 0.0f)
+    {
+        unsigned int fast_width, fast_height;
+        float fps;
+        if (_largest_frame_size(cam, required_fps, &fast_width, &fast_height, &fps))
+        {
+            printf("%ux%u is the largest frame size reaching %.0f fps (up to %.0f fps).\n",
+                fast_width, fast_height, required_fps, fps);
+            close(cam->handle);
+            free(cam);
+
+            *width = fast_width;
+            *height = fast_height;
+            return 0;
+        }
+        printf("No frame size reaches %.0f fps, requesting %ux%u.\n", required_fps, *width, *height);
+    }
+
+    // Try every usable pixel format the camera offers and keep the closest size.
+    unsigned int best_width = 0, best_height = 0;
+    unsigned int best_distance = UINT32_MAX;
+
+    struct v4l2_fmtdesc desc;
+    memset(&desc, 0, sizeof(desc));
+    desc.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+    for (desc.index = 0; ioctl(cam->handle, VIDIOC_ENUM_FMT, &desc) == 0; desc.index++)
+    {
+        bool usable = false;
+        for (int i = 0; i < FORMAT_OPTION_COUNT; i++)
+            usable |= format_options[i].fourcc == desc.pixelformat;
+        if (!usable)
+            continue;
+
+        struct v4l2_format try_format;
+        memset(&try_format, 0, sizeof(try_format));
+        try_format.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+        try_format.fmt.pix.width = *width;
+        try_format.fmt.pix.height = *height;
+        try_format.fmt.pix.pixelformat = desc.pixelformat;
+        try_format.fmt.pix.field = V4L2_FIELD_NONE;
+
+        if (ioctl(cam->handle, VIDIOC_TRY_FMT, &try_format) < 0)
+            continue;
 
+        unsigned int distance =
+            abs((int)try_format.fmt.pix.width - (int)*width) +
+            abs((int)try_format.fmt.pix.height - (int)*height);
+
+        if (distance < best_distance)
+        {
+            best_distance = distance;
+            best_width = try_format.fmt.pix.width;
+            best_height = try_format.fmt.pix.height;
+        }
+    }
+
+    close(cam->handle);
+    free(cam);
+
+    // Drivers without VIDIOC_TRY_FMT are left to VIDIOC_S_FMT.
+    if (best_distance == UINT32_MAX)
+        return 0;
+
+    if (best_width != *width || best_height != *height)
+        printf("%s does not offer %ux%u, using %ux%u instead.\n", device, *width, *height, best_width, best_height);
+
+    *width = best_width;
+    *height = best_height;
     return 0;
 }
 
-int next_frame()
+int webcam_init(Webcam **out_cam, const char *device, const Img_Fmt *format)
 {
-    if (_start_camera() == -1) 
+    *out_cam = NULL;
+
+    Webcam *cam = calloc(1, sizeof(Webcam));
+    if (cam == NULL)
         return -1;
 
-    if (_dequeue_buffer() == -1) 
+    snprintf(cam->device, sizeof(cam->device), "%s", device);
+
+    if (strncmp(device, "synthetic", 9) == 0)
+    {
+        if (synthetic_open(&cam->synthetic, device, format) == -1)
+        {
+            free(cam);
+            return -1;
+        }
+
+        *out_cam = cam;
+        return 0;
+    }
+
+    // Regular files are recordings, played back through the same interface.
+    struct stat st;
+    if (stat(device, &st) == 0 && S_ISREG(st.st_mode))
+    {
+        if (replay_open(&cam->replay, device, format, format->replay_speed) == -1)
+        {
+            free(cam);
+            return -1;
+        }
+
+        *out_cam = cam;
+        return 0;
+    }
+
+    cam->format = format;
+    cam->handle = -1;
+    cam->requested_count = (unsigned int)format->buffer_count;
+    cam->policy = (format->queue_policy == 0.0f) ? QUEUE_LATEST : QUEUE_NO_DROP;
+    cam->timeout_ms = MAX(1, (int)format->capture_timeout);
+    cam->memory = (Capture_Memory)CLAMP((int)format->capture_memory, CAPTURE_MMAP, CAPTURE_DMABUF);
+    cam->hugepages = format->hugepages == 1.0f;
+    atomic_init(&cam->latest, -1);
+    atomic_init(&cam->held, -1);
+
+    cam->wake_fd = eventfd(0, EFD_NONBLOCK);
+    if (cam->wake_fd == -1)
+    {
+        free(cam);
         return -1;
+    }
 
+    if (sem_init(&cam->frame_sem, 0, 0) == -1)
+    {
+        close(cam->wake_fd);
+        free(cam);
+        return -1;
+    }
+
+    if (_open_session(cam) == -1)
+    {
+        printf("Failed to open %s!\n", cam->device);
+        goto init_failed;
+    }
+
+    // Streaming is started once, the capture thread keeps the ring filled from here on.
+    atomic_store(&cam->running, true);
+    if (pthread_create(&cam->thread, NULL, _capture_thread, cam) != 0)
+    {
+        printf("Failed to create capture thread!\n");
+        atomic_store(&cam->running, false);
+        _close_session(cam);
+        goto init_failed;
+    }
+
+    printf("Capturing from %s with %u buffers (%s).\n", cam->device, cam->buffer_count,
+        cam->policy == QUEUE_LATEST ? "latest frame" : "no drop");
+    printf("Pixel format: %s %ux%u, up to %.0f fps (%s, %u bytes per frame).\n",
+        format_options[cam->format_option].name, format->width, format->height, cam->max_fps,
+        format_options[cam->format_option].path, cam->v4l2.format.fmt.pix.sizeimage);
+
+    float fps = _interval_fps(cam->frame_interval);
+    if (fps > 0.0f)
+        printf("Frame interval: %u/%u s (%.1f fps).\n",
+            cam->frame_interval.numerator, cam->frame_interval.denominator, fps);
+
+    float required_fps = _required_frame_rate(format);
+    if (required_fps > 0.0f && fps > 0.0f && fps < required_fps * 0.99f)
+    {
+        printf("%ux%u reaches only %.1f of the %.1f fps required.\n", format->width, format->height, fps, required_fps);
+        _suggest_frame_size(cam, required_fps);
+    }
+
+    if (cam->roi.n > 0)
+        printf("Region of interest: rows %u-%u, cropped %s.\n", cam->roi.n, cam->roi.s,
+            cam->sensor_crop ? "at the sensor" : "in software");
+
+    if (cam->memory == CAPTURE_MMAP)
+        printf("Capture memory: driver MMAP.\n");
+    else
+        printf("Capture memory: %s arena, %u x %zu bytes%s.\n",
+            cam->memory == CAPTURE_DMABUF ? "DMABUF" : "USERPTR",
+            cam->arena.block_count, cam->arena.block_size,
+            cam->arena.hugepages ? ", huge pages" : "");
+
+    *out_cam = cam;
     return 0;
+
+init_failed:
+    arena_free(&cam->arena);
+    sem_destroy(&cam->frame_sem);
+    close(cam->wake_fd);
+    free(cam);
+    return -1;
 }
 
-int get_frame(unsigned char **mjpeg, unsigned int *mjpeg_size)
+int next_frame(Webcam *cam)
 {
-    *mjpeg = capture_data.img_mem[v4l2_container.queue_buffer.index];
-    *mjpeg_size = v4l2_container.queue_buffer.bytesused;
+    if (cam->replay != NULL)
+        return replay_next_frame(cam->replay);
+    if (cam->synthetic != NULL)
+        return synthetic_next_frame(cam->synthetic);
+
+    if (atomic_load(&cam->held) != -1)
+        return 0;
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += cam->timeout_ms / 1000;
+    deadline.tv_nsec += (long)(cam->timeout_ms % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L)
+    {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    while (true)
+    {
+        if (sem_timedwait(&cam->frame_sem, &deadline) == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == ETIMEDOUT)
+                return 1; // No frame arrived in time.
+            return -1;
+        }
+
+        if (!atomic_load(&cam->running))
+            return -1;
+
+        int slot;
+        if (cam->policy == QUEUE_NO_DROP)
+            slot = _ring_pop(&cam->ready);
+        else
+            slot = atomic_exchange(&cam->latest, -1);
+
+        if (slot == -1)
+            continue; // The pending frame was taken back by a recovery.
+
+        // Publish the acquisition before checking the session, so that a concurrent recovery
+        // either sees this slot as held or this check sees the new generation.
+        atomic_store(&cam->held, slot);
+        if (SLOT_GEN(slot) == (atomic_load(&cam->generation) & 0xFFFFFF))
+            return 0;
+
+        atomic_store(&cam->held, -1);
+        _wake_capture_thread(cam);
+    }
+}
+
+int get_frame(Webcam *cam, Frame *frame)
+{
+    if (cam->replay != NULL)
+        return replay_get_frame(cam->replay, frame);
+    if (cam->synthetic != NULL)
+        return synthetic_get_frame(cam->synthetic, frame);
+
+    int slot = atomic_load(&cam->held);
+    if (slot == -1)
+    {
+        printf("get_frame called without an acquired frame!\n");
+        return -1;
+    }
+
+    // DMA-BUFs written by the device must be synced before the CPU reads them.
+    if (arena_begin_access(&cam->arena, SLOT_INDEX(slot)) == -1)
+        printf("DMA_BUF_IOCTL_SYNC failed at index %d!\n", SLOT_INDEX(slot));
+
+    frame->slot = slot;
+    frame->data = cam->img_mem[SLOT_INDEX(slot)];
+    frame->size = cam->img_used[SLOT_INDEX(slot)];
+    frame->timestamp = cam->img_timestamp[SLOT_INDEX(slot)];
+    frame->sequence = cam->img_sequence[SLOT_INDEX(slot)];
+    frame->format = cam->pixel_format;
+    frame->stride = cam->stride;
+    frame->roi = cam->roi;
+    frame->cropped = cam->sensor_crop;
     return 0;
 }
 
-int close_frame()
+int close_frame(Webcam *cam, Frame *frame)
 {
-    if (_requeue_buffer() == -1) 
+    if (cam->replay != NULL)
+        return replay_close_frame(cam->replay, frame);
+    if (cam->synthetic != NULL)
+        return synthetic_close_frame(cam->synthetic, frame);
+
+    if (frame->slot == -1 || frame->slot != atomic_load(&cam->held))
         return -1;
 
+    arena_end_access(&cam->arena, SLOT_INDEX(frame->slot));
+
+    // The capture thread requeues the buffer, so the consumer never touches the device.
+    _ring_push(&cam->released, frame->slot);
+    atomic_store(&cam->held, -1);
+    _wake_capture_thread(cam);
+
+    frame->slot = -1;
+    frame->data = NULL;
     return 0;
 }
 
 
-int webcam_close(const Img_Fmt *format)
+int webcam_close(Webcam *cam)
 {
-    if (close(capture_data.handle) == -1)
-        printf("ERROR: close() returned -1.");
-        
-    if (munmap(capture_data.img_mem[0], v4l2_container.query_buffer.length) == -1)
-        printf("ERROR: munmap() for buffer 0 returned -1.");
-    if (munmap(capture_data.img_mem[1], v4l2_container.query_buffer.length) == -1)
-        printf("ERROR: munmap() for buffer 1 returned -1.");
+    if (cam == NULL)
+        return -1;
+
+    if (cam->replay != NULL || cam->synthetic != NULL)
+    {
+        replay_close(cam->replay);
+        synthetic_close(cam->synthetic);
+        free(cam);
+        return 0;
+    }
+
+    atomic_store(&cam->running, false);
+    _wake_capture_thread(cam);
+    pthread_join(cam->thread, NULL);
 
+    sem_destroy(&cam->frame_sem);
+    close(cam->wake_fd);
+    _close_session(cam);
+    arena_free(&cam->arena);
+
+    printf("Capture %s: %u frames dequeued, %u skipped, %u lost by the driver, %u stalls, %u recoveries",
+        cam->device,
+        atomic_load(&cam->captured_count),
+        atomic_load(&cam->skipped_count),
+        cam->lost_count,
+        cam->stall_count,
+        cam->recovery_count);
+    if (cam->recovery_count > 0)
+        printf(" (avg. %.0f ms, max %.0f ms)",
+            cam->recovery_time_total / cam->recovery_count,
+            cam->recovery_time_max);
+    printf(".\n");
+
+    unsigned int captured = atomic_load(&cam->captured_count);
+    if (captured > 1)
+    {
+        double interval = (cam->last_frame_time - cam->first_frame_time) * 1000.0 / (captured - 1);
+        printf("Achieved frame interval: %.2f ms (%.1f fps).\n", interval, (float)(1000.0 / interval));
+    }
+
+    free(cam);
     return 0;
 }
+
+Replay *webcam_replay(Webcam *cam)
+{
+    return cam->replay;
+}
+
+Synthetic *webcam_synthetic(Webcam *cam)
+{
+    return cam->synthetic;
+}
@@ -0,0 +1,421 @@
+#define _GNU_SOURCE
+#include "include/worker_pool.h"
+
+#include "include/img_data.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <math.h>
+#include <time.h>
+
+#include <pthread.h>
+#include <sched.h>
+
+
+#define CPU_LIST_MAX 1024
+
+
+/// @brief A call of pool_run, queued until all of its slots are claimed.
+typedef struct Pool_Job
+{
+    enum pool_stage stage;
+    pool_task task;
+    void *arg;
+    int t_count;
+
+    int next_slot; // The next t_id to be claimed.
+    int done_c;
+
+    double dispatch_time;
+    double first_pickup; // When a worker first started a slot, 0 if none did.
+    double last_end; // When the last slot to finish finished.
+    int caller_slots; // Slots the calling thread ran itself.
+
+    struct Pool_Job *next;
+} Pool_Job;
+
+typedef struct Stage_Stats
+{
+    unsigned int runs;
+    unsigned int picked_up_runs; // Runs that a worker took part in.
+    double fork_time; // Sum of the time from dispatch until a worker started a slot, in seconds.
+    double join_time; // Sum of the time from the last slot finishing until the caller returned.
+    unsigned long slots, caller_slots;
+} Stage_Stats;
+
+typedef struct Worker_Pool
+{
+    pthread_mutex_t lock;
+    pthread_cond_t work_cond; // Signaled when jobs are queued or workers are retired.
+    pthread_cond_t done_cond; // Signaled when the last slot of a job is done.
+
+    Pool_Job *jobs; // Jobs with unclaimed slots, oldest first.
+
+    int worker_c; // Workers that should be running, the calling threads come on top.
+    pthread_t threads[POOL_MAX_THREADS];
+    bool started[POOL_MAX_THREADS]; // Whether the thread exists & still has to be joined.
+    bool alive[POOL_MAX_THREADS]; // Cleared by a retired worker when it exits.
+
+    // CPUs to pin workers to, one per physical core first, then their SMT siblings.
+    int cpus[CPU_LIST_MAX];
+    int cpu_c;
+
+    Stage_Stats stats[POOL_STAGE_COUNT];
+    bool initialized;
+} Worker_Pool;
+
+static Worker_Pool pool = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .work_cond = PTHREAD_COND_INITIALIZER,
+    .done_cond = PTHREAD_COND_INITIALIZER,
+};
+
+static const char *stage_names[POOL_STAGE_COUNT] = {
+    "Decode", "Conversion", "Scan", "Bands", "Visualize"
+};
+
+
+double _pool_time()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/// @brief Reads a single integer from a sysfs file.
+int _read_sysfs_int(const char *path, int *value)
+{
+    FILE *file = fopen(path, "r");
+    if (file == NULL)
+        return -1;
+
+    int result = (fscanf(file, "%d", value) == 1) ? 0 : -1;
+    fclose(file);
+    return result;
+}
+
+/// @brief The CPUs the cgroup of the process may use per period, 0 if unlimited or unknown.
+float _cgroup_cpu_limit()
+{
+    long long quota, period;
+
+    // cgroup v2: "max 100000" or "<quota> <period>".
+    FILE *file = fopen("/sys/fs/cgroup/cpu.max", "r");
+    if (file != NULL)
+    {
+        char quota_str[32];
+        int read = fscanf(file, "%31s %lld", quota_str, &period);
+        fclose(file);
+
+        if (read == 2 && period > 0 && sscanf(quota_str, "%lld", &quota) == 1 && quota > 0)
+            return (float)quota / period;
+        return 0.0f;
+    }
+
+    // cgroup v1, -1 if unlimited.
+    file = fopen("/sys/fs/cgroup/cpu/cpu.cfs_quota_us", "r");
+    if (file == NULL)
+        return 0.0f;
+    int read = fscanf(file, "%lld", &quota);
+    fclose(file);
+
+    file = fopen("/sys/fs/cgroup/cpu/cpu.cfs_period_us", "r");
+    if (file == NULL)
+        return 0.0f;
+    read += fscanf(file, "%lld", &period);
+    fclose(file);
+
+    if (read == 2 && quota > 0 && period > 0)
+        return (float)quota / period;
+    return 0.0f;
+}
+
+/// @brief Lists the CPUs the process may run on, the first of every physical core first.
+/// @param core_c Receives the amount of physical cores among them.
+/// @return The amount of CPUs listed.
+int _list_cpus(int cpus[], int *core_c)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == -1)
+    {
+        *core_c = 1;
+        return 0;
+    }
+
+    int cpu_c = 0;
+    int core_keys[CPU_LIST_MAX];
+    int siblings[CPU_LIST_MAX], sibling_c = 0;
+    *core_c = 0;
+
+    for (int cpu = 0; cpu < CPU_SETSIZE && cpu_c + sibling_c < CPU_LIST_MAX; cpu++)
+    {
+        if (!CPU_ISSET(cpu, &set))
+            continue;
+
+        char path[128];
+        int core_id = cpu, package_id = 0;
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/core_id", cpu);
+        _read_sysfs_int(path, &core_id);
+        snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/physical_package_id", cpu);
+        _read_sysfs_int(path, &package_id);
+
+        int key = package_id * 65536 + core_id;
+        bool seen = false;
+        for (int i = 0; i < *core_c; i++)
+            seen |= core_keys[i] == key;
+
+        if (seen)
+            siblings[sibling_c++] = cpu;
+        else
+        {
+            core_keys[(*core_c)++] = key;
+            cpus[cpu_c++] = cpu;
+        }
+    }
+
+    for (int i = 0; i < sibling_c; i++)
+        cpus[cpu_c++] = siblings[i];
+
+    return cpu_c;
+}
+
+int pool_auto_size()
+{
+    int cpus[CPU_LIST_MAX], core_c;
+    int cpu_c = _list_cpus(cpus, &core_c);
+
+    int size = (cpu_c == 0) ? 1 : core_c;
+    float limit = _cgroup_cpu_limit();
+    if (limit > 0.0f)
+        size = MIN(size, (int)ceilf(limit));
+
+    return CLAMP(size, 1, POOL_MAX_THREADS);
+}
+
+
+/// @brief Takes a job whose slots are all claimed out of the queue.
+void _dequeue_job(Pool_Job *job)
+{
+    for (Pool_Job **queued = &pool.jobs; *queued != NULL; queued = &(*queued)->next)
+    {
+        if (*queued == job)
+        {
+            *queued = job->next;
+            return;
+        }
+    }
+}
+
+/// @brief Claims the next slot of a job, runs it & records it.
+/// Called & returns with the lock held, which is released while the slot runs.
+/// @param worker Whether a worker runs it, rather than the thread that called pool_run.
+void _run_slot(Pool_Job *job, bool worker)
+{
+    int t_id = job->next_slot++;
+    if (job->next_slot >= job->t_count)
+        _dequeue_job(job);
+
+    pthread_mutex_unlock(&pool.lock);
+    double start = _pool_time();
+    job->task(job->arg, t_id, job->t_count);
+    double end = _pool_time();
+    pthread_mutex_lock(&pool.lock);
+
+    if (worker && (job->first_pickup == 0.0 || start < job->first_pickup))
+        job->first_pickup = start;
+    if (!worker)
+        job->caller_slots++;
+    job->last_end = MAX(job->last_end, end);
+    if (++job->done_c == job->t_count)
+        pthread_cond_broadcast(&pool.done_cond);
+}
+
+void *_pool_worker(void *input)
+{
+    int index = (int)(intptr_t)input;
+
+    if (pool.cpu_c > 1)
+    {
+        // The calling threads are not pinned, so the first CPU is left to them.
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(pool.cpus[(index + 1) % pool.cpu_c], &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+
+    pthread_mutex_lock(&pool.lock);
+    while (index < pool.worker_c)
+    {
+        if (pool.jobs == NULL)
+            pthread_cond_wait(&pool.work_cond, &pool.lock);
+        else
+            _run_slot(pool.jobs, true);
+    }
+    pool.alive[index] = false;
+    pthread_mutex_unlock(&pool.lock);
+    return NULL;
+}
+
+/// @brief Sets the amount of workers. Called with the lock held.
+int _set_worker_count(int worker_c)
+{
+    worker_c = CLAMP(worker_c, 0, POOL_MAX_THREADS - 1);
+
+    for (int i = pool.worker_c; i < worker_c; i++)
+    {
+        // Workers retired earlier that have not noticed yet just keep going.
+        if (pool.started[i] && pool.alive[i])
+            continue;
+
+        // Retired workers that already left their loop only have to return.
+        if (pool.started[i])
+            pthread_join(pool.threads[i], NULL);
+
+        pool.alive[i] = true;
+        pool.started[i] = pthread_create(&pool.threads[i], NULL, _pool_worker, (void*)(intptr_t)i) == 0;
+        if (!pool.started[i])
+        {
+            printf("Failed to start worker %d!\n", i);
+            worker_c = i;
+            break;
+        }
+    }
+
+    pool.worker_c = worker_c;
+    // Wakes up the workers that were retired, so they exit.
+    pthread_cond_broadcast(&pool.work_cond);
+    return 0;
+}
+
+int pool_init(int thread_count)
+{
+    if (thread_count <= 0)
+        thread_count = pool_auto_size();
+
+    int core_c;
+    pool.cpu_c = _list_cpus(pool.cpus, &core_c);
+
+    pthread_mutex_lock(&pool.lock);
+    pool.initialized = true;
+    _set_worker_count(CLAMP(thread_count, 1, POOL_MAX_THREADS) - 1);
+    pthread_mutex_unlock(&pool.lock);
+    return 0;
+}
+
+int pool_resize(int thread_count)
+{
+    if (!pool.initialized)
+        return -1;
+
+    pthread_mutex_lock(&pool.lock);
+    _set_worker_count(CLAMP(thread_count, 1, POOL_MAX_THREADS) - 1);
+    pthread_mutex_unlock(&pool.lock);
+    return 0;
+}
+
+int pool_size()
+{
+    return pool.worker_c + 1;
+}
+
+int pool_run(enum pool_stage stage, int t_count, pool_task task, void *arg)
+{
+    t_count = MAX(1, t_count);
+
+    if (!pool.initialized || t_count == 1)
+    {
+        for (int i = 0; i < t_count; i++)
+            task(arg, i, t_count);
+        return 0;
+    }
+
+    Pool_Job job = {
+        .stage = stage,
+        .task = task,
+        .arg = arg,
+        .t_count = t_count,
+        .next_slot = 1, // The calling thread runs the first slot.
+        .dispatch_time = _pool_time()
+    };
+
+    pthread_mutex_lock(&pool.lock);
+    Pool_Job **tail = &pool.jobs;
+    while (*tail != NULL)
+        tail = &(*tail)->next;
+    *tail = &job;
+    pthread_cond_broadcast(&pool.work_cond);
+
+    pthread_mutex_unlock(&pool.lock);
+    task(arg, 0, t_count);
+    double end = _pool_time();
+    pthread_mutex_lock(&pool.lock);
+
+    job.last_end = MAX(job.last_end, end);
+    job.caller_slots++;
+    job.done_c++;
+
+    // Slots that no worker got to yet are run by the calling thread, as the workers may be busy with other cameras.
+    while (job.next_slot < t_count)
+        _run_slot(&job, false);
+
+    while (job.done_c < t_count)
+        pthread_cond_wait(&pool.done_cond, &pool.lock);
+
+    Stage_Stats *stats = &pool.stats[stage];
+    stats->runs++;
+    if (job.first_pickup > 0.0)
+    {
+        stats->picked_up_runs++;
+        stats->fork_time += job.first_pickup - job.dispatch_time;
+    }
+    stats->join_time += _pool_time() - job.last_end;
+    stats->slots += t_count;
+    stats->caller_slots += job.caller_slots;
+    pthread_mutex_unlock(&pool.lock);
+    return 0;
+}
+
+int pool_report()
+{
+    pthread_mutex_lock(&pool.lock);
+    printf("Worker pool: %d threads\n", pool.worker_c + 1);
+    printf("Fork/join per stage (avg. from dispatch until a worker starts / from the last slot done until return),\n");
+    printf("and the share of slots the calling thread ran itself because no worker was free:\n");
+    for (int i = 0; i < POOL_STAGE_COUNT; i++)
+    {
+        Stage_Stats *stats = &pool.stats[i];
+        if (stats->runs == 0)
+            continue;
+
+        printf("%s: %u runs, fork %.1f us, join %.1f us, %.0f%% of slots on the caller\n", stage_names[i], stats->runs,
+            (stats->picked_up_runs > 0) ? stats->fork_time / stats->picked_up_runs * 1e6 : 0.0, 
+            stats->join_time / stats->runs * 1e6,
+            100.0 * stats->caller_slots / stats->slots);
+    }
+    pthread_mutex_unlock(&pool.lock);
+    return 0;
+}
+
+int pool_quit()
+{
+    if (!pool.initialized)
+        return 0;
+
+    pthread_mutex_lock(&pool.lock);
+    pool.worker_c = 0;
+    pthread_cond_broadcast(&pool.work_cond);
+    pthread_mutex_unlock(&pool.lock);
+
+    for (int i = 0; i < POOL_MAX_THREADS; i++)
+    {
+        if (pool.started[i])
+            pthread_join(pool.threads[i], NULL);
+        pool.started[i] = false;
+    }
+
+    pool.initialized = false;
+    return 0;
+}